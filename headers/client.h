@@ -4,6 +4,7 @@
 
 #include <utility>
 #include "mqtt_protocol.h"
+#include "frame_decoder.h"
 
 class Client{
 private:
@@ -11,6 +12,7 @@ private:
     mqtt_protocol::MqttStringEntity        client_id;
     std::queue<mqtt_protocol::MqttTopic>        topics_to_send;
     std::unordered_map<std::string, uint8_t>   subscribed_topics;
+    const uint64_t conn_id;
 
     uint8_t flags;
     uint16_t alive;
@@ -25,6 +27,9 @@ public:
     mqtt_protocol::MqttPropertyChain conn_properties;
     mqtt_protocol::MqttPropertyChain will_properties;
     mqtt_protocol::MqttTopic will_topic;
+    mqtt_protocol::FrameDecoder decoder;
+    bool retransmit_armed{false};   //owned by the shard thread
+    uint64_t session_gen{0};        //generation of the client id taken when it was claimed
 
     void SetConnFlags(uint8_t _flags);
     void SetConnAlive(uint16_t _alive);
@@ -50,6 +55,8 @@ public:
     void SetClientMQTTVersion(const uint8_t version) noexcept;
     std::unordered_map<std::string, uint8_t>::const_iterator CFind(const std::string &_topic_name);
     std::unordered_map<std::string, uint8_t>::const_iterator CEnd();
+    const std::unordered_map<std::string, uint8_t>& GetSubscriptions() const noexcept;
+    uint64_t GetConnId() const noexcept;
 
     void SetPacketLastTime(time_t _cur_time);
     void SetRandomID();
@@ -17,53 +17,88 @@
 #include <stdlib.h>
 #include <errno.h>
 
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <shared_mutex>
+#include <unordered_map>
+
 #include "functions.h"
+#include "outbound_queue.h"
+#include "epoch.h"
+
+#define COMMANDS_BATCH_SIZE     64
+#define DEFAULT_SENDERS         2
 
+//Flushes a batch of outbound queues without blocking, status[i] gets the result for batch[i]
 class Writer {
 public:
     Writer()= default;
-    int Write(int fd, const std::shared_ptr<uint8_t>& buf, uint32_t buf_len);
+    virtual ~Writer() = default;
+    virtual void Flush(std::vector<std::shared_ptr<OutboundQueue>>& batch, std::vector<outbound_status>& status);
 };
 
-class ICommand{
-public:
-    virtual void Execute() = 0;
-    virtual ~ICommand() = default;
-};
-
-class WriteCommand: public ICommand{
-protected:
-    std::shared_ptr<Writer> stream;
-    explicit WriteCommand(std::shared_ptr<Writer> _stream): stream(std::move(_stream)) {}
+//Sends the whole batch with one io_uring_enter() per round on the calling thread's own ring
+class UringWriter : public Writer {
+private:
+    bool sqpoll;
 public:
-    ~WriteCommand() override = default;
+    explicit UringWriter(bool _sqpoll) : sqpoll(_sqpoll) {}
+    void Flush(std::vector<std::shared_ptr<OutboundQueue>>& batch, std::vector<outbound_status>& status) override;
 };
 
-class FdWriteCommand : public WriteCommand{
-private:
-    std::tuple<uint32_t, std::shared_ptr<uint8_t>> cmd;
-    static int count;
-    int fd;
-public:
-    FdWriteCommand(std::shared_ptr<Writer> _writer, const int _fd, std::tuple<uint32_t, std::shared_ptr<uint8_t>> _cmd) : WriteCommand(std::move(_writer)), cmd(std::move(_cmd)), fd(_fd) {
-        count++;
-    }
-    void Execute() override;
+//Ready list of one sender thread. The sender sleeps on the futex word when the list is empty,
+//a producer wakes it right after the push.
+struct SenderSlot{
+    MpscQueue<OutboundQueue> ready;
+    alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> sleeping{0};
+    //reused by the sender on every pass
+    std::vector<std::shared_ptr<OutboundQueue>> batch;
+    std::vector<outbound_status> status;
 };
 
+//Every connection owns an outbound queue. AddCommand() only appends bytes, the queues with data are
+//handed to the sender threads which write them with gather writes, so a slow reader never blocks the others.
+//Connections are sharded over the senders by fd, so a connection is always written by the same thread.
+//Scheduling is lock free: every sender drains its own MPSC ready list in batches, and a producer finds
+//the queue of an fd in an RcuTable, so the only lock it takes is the one of the connection's queue.
 class Commands{
 protected:
-    std::queue<std::shared_ptr<ICommand>> commands;
+    std::vector<std::unique_ptr<SenderSlot>> senders;
     std::shared_ptr<Writer> stream;
 
-    std::mutex com_mutex;
-    std::condition_variable cond;
+    RcuTable<std::shared_ptr<OutboundQueue>> outbound;
+
+    bool zerocopy{false};
+    ZerocopyStats zerocopy_stats;
+    std::mutex linger_mtx;
+    std::vector<std::shared_ptr<OutboundQueue>> lingering;     //closed, waiting for zero-copy completions
+
+    std::shared_ptr<OutboundQueue> GetOutbound(int fd);
+    void Schedule(std::shared_ptr<OutboundQueue> queue);
+    //the socket would block: the owner has to report when it is writable again (OnWritable)
+    virtual void OnWriteBlocked(int fd, unsigned int owner);
+
 public:
-    Commands(){
-        stream = std::make_shared<Writer>();
-    }
+    explicit Commands(unsigned int sender_count = DEFAULT_SENDERS);
+    virtual ~Commands() = default;
 
+    void SetWriter(std::shared_ptr<Writer> _stream);
+    void SetSenderCount(unsigned int count);
+    void SetZerocopy(bool on) noexcept;
+    void OpenOutbound(int fd, unsigned int owner);
+    void CloseOutbound(int fd);
     void AddCommand(int fd, std::tuple<uint32_t, std::shared_ptr<uint8_t>> _cmd);
-    void Execute();
-    void Notify();
+    //a small control packet (EncodeAck) copied into the queue
+    void AddCommand(int fd, const uint8_t* data, uint32_t len);
+    push_status AddCommand(int fd, std::tuple<uint32_t, std::shared_ptr<uint8_t>> _cmd, const QueueLimits& limits, bool droppable, size_t& evicted);
+    //a PUBLISH in pieces, mostly shared by all subscribers; a zerocopy piece may be sent with MSG_ZEROCOPY
+    push_status AddCommand(int fd, OutboundPiece* pieces, unsigned int count, const QueueLimits& limits, bool droppable, size_t& evicted);
+    bool AbortOutbound(int fd, std::tuple<uint32_t, std::shared_ptr<uint8_t>> _last);
+    bool GetOutboundDepth(int fd, OutboundDepth& depth);
+    void OnWritable(int fd);
+    void ReapOutbound(int fd);
+    void ReapLingering(time_t now);
+    void Execute(unsigned int sender);
+    [[nodiscard]] unsigned int GetSenderCount() const noexcept;
 };
@@ -0,0 +1,173 @@
+#pragma once
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wignored-attributes"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <cstddef>
+#include <cstdint>
+
+#include "spsc_queue.h"
+
+#define EPOCH_MAX_THREADS       256     //live threads that have entered a read section
+#define EPOCH_SLOT_RETRIES      1000    //rounds a new reader waits for a slot of an exiting thread
+#define EPOCH_RECLAIM_BATCH     64      //retired objects that make Retire() try to reclaim
+
+//Read section of the epoch based reclamation. Entering is a load, a store and a fence, so readers are
+//wait-free; objects retired by the writers are freed once every thread that could see them has left
+//its read section. Sections nest, a thread keeps its slot until it exits.
+class EpochGuard{
+public:
+    EpochGuard() noexcept;
+    ~EpochGuard();
+    EpochGuard(const EpochGuard&)               = delete;
+    EpochGuard& operator=(const EpochGuard&)    = delete;
+};
+
+class Epoch{
+public:
+    static void Retire(void* ptr, void (*deleter)(void*));
+
+    template <class T>
+    static void Retire(const T* ptr){
+        Retire(const_cast<T*>(ptr), [](void* p){ delete static_cast<T*>(p); });
+    }
+
+    //advances the global epoch if every reader has seen the current one and frees what is safe,
+    //returns the number of freed objects
+    static size_t Reclaim();
+    [[nodiscard]] static size_t Pending();
+};
+
+//Read-mostly object published as immutable snapshots. Readers Load() it inside an EpochGuard and never
+//block; writers are serialized, change a copy and publish it, the replaced snapshot is retired.
+template <class T>
+class RcuPtr{
+private:
+    std::atomic<const T*> current;
+    std::mutex write_mtx;
+
+public:
+    explicit RcuPtr(T* initial = new T) : current(initial) {}
+    RcuPtr(const RcuPtr&)               = delete;
+    RcuPtr& operator=(const RcuPtr&)    = delete;
+    ~RcuPtr(){
+        delete current.load(std::memory_order_relaxed);
+    }
+
+    //valid until the caller leaves its EpochGuard
+    const T* Load() const noexcept {
+        return current.load(std::memory_order_acquire);
+    }
+
+    //modify(T& copy) returns false when it changed nothing, the copy is then dropped
+    template <class F>
+    bool Update(F&& modify){
+        std::lock_guard lock{write_mtx};
+        auto copy = std::make_unique<T>(*current.load(std::memory_order_relaxed));
+        if (!modify(*copy)) return false;
+        Epoch::Retire(current.exchange(copy.release(), std::memory_order_acq_rel));
+        return true;
+    }
+};
+
+#define RCU_TABLE_SEGMENT_SIZE  4096
+#define RCU_TABLE_SEGMENTS      1024    //keys below 4M
+
+//Table keyed by a small non negative integer (a descriptor) with immutable values. A value is replaced
+//as a whole and the old one retired, so Find() and ForEach() inside an EpochGuard are wait-free.
+//Segments are allocated on first use and kept. Writers are serialized.
+template <class V>
+class RcuTable{
+private:
+    struct Segment{
+        std::atomic<const V*> slots[RCU_TABLE_SEGMENT_SIZE];
+        Segment(){
+            for(auto& it : slots) it.store(nullptr, std::memory_order_relaxed);
+        }
+    };
+
+    std::atomic<Segment*> segments[RCU_TABLE_SEGMENTS];
+    std::atomic<size_t> count{0};
+    std::mutex write_mtx;
+
+    std::atomic<const V*>* Slot(const int key, const bool create){
+        if (key < 0 || size_t(key) >= size_t(RCU_TABLE_SEGMENT_SIZE) * RCU_TABLE_SEGMENTS) return nullptr;
+        auto& segment = segments[key / RCU_TABLE_SEGMENT_SIZE];
+        auto seg = segment.load(std::memory_order_acquire);
+        if (seg == nullptr){
+            if (!create) return nullptr;
+            seg = new Segment;
+            segment.store(seg, std::memory_order_release);
+        }
+        return &seg->slots[key % RCU_TABLE_SEGMENT_SIZE];
+    }
+
+public:
+    RcuTable(){
+        for(auto& it : segments) it.store(nullptr, std::memory_order_relaxed);
+    }
+    RcuTable(const RcuTable&)               = delete;
+    RcuTable& operator=(const RcuTable&)    = delete;
+    ~RcuTable(){
+        for(auto& segment : segments){
+            auto seg = segment.load(std::memory_order_relaxed);
+            if (seg == nullptr) continue;
+            for(auto& it : seg->slots) delete it.load(std::memory_order_relaxed);
+            delete seg;
+        }
+    }
+
+    //reader side, the value is valid until the caller leaves its EpochGuard
+    const V* Find(const int key) const noexcept {
+        auto slot = const_cast<RcuTable*>(this)->Slot(key, false);
+        return slot != nullptr ? slot->load(std::memory_order_acquire) : nullptr;
+    }
+
+    //f(int key, const V& value)
+    template <class F>
+    void ForEach(F&& f) const {
+        for(size_t i = 0; i < RCU_TABLE_SEGMENTS; i++){
+            auto seg = segments[i].load(std::memory_order_acquire);
+            if (seg == nullptr) continue;
+            for(size_t j = 0; j < RCU_TABLE_SEGMENT_SIZE; j++){
+                auto value = seg->slots[j].load(std::memory_order_acquire);
+                if (value != nullptr) f(int(i * RCU_TABLE_SEGMENT_SIZE + j), *value);
+            }
+        }
+    }
+
+    //writer side
+    bool Insert(const int key, V value){
+        std::lock_guard lock{write_mtx};
+        auto slot = Slot(key, true);
+        if (slot == nullptr || slot->load(std::memory_order_relaxed) != nullptr) return false;
+        slot->store(new V(std::move(value)), std::memory_order_release);
+        count.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    bool Replace(const int key, V value){
+        std::lock_guard lock{write_mtx};
+        auto slot = Slot(key, false);
+        if (slot == nullptr || slot->load(std::memory_order_relaxed) == nullptr) return false;
+        Epoch::Retire(slot->exchange(new V(std::move(value)), std::memory_order_acq_rel));
+        return true;
+    }
+
+    bool Erase(const int key){
+        std::lock_guard lock{write_mtx};
+        auto slot = Slot(key, false);
+        if (slot == nullptr) return false;
+        auto old = slot->exchange(nullptr, std::memory_order_acq_rel);
+        if (old == nullptr) return false;
+        Epoch::Retire(old);
+        count.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    [[nodiscard]] size_t Size() const noexcept {
+        return count.load(std::memory_order_relaxed);
+    }
+};
@@ -0,0 +1,44 @@
+#pragma once
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wignored-attributes"
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+#include "mqtt_protocol.h"
+
+#define DEFAULT_DECODER_CHUNK       4096
+#define DEFAULT_DECODER_READ_LIMIT  (256 * 1024)
+
+namespace mqtt_protocol {
+    enum class decoder_status : uint8_t {
+        ok,
+        need_more,
+        would_block,
+        closed,
+        read_err,
+        malformed
+    };
+
+    //Per-connection receive buffer with a resumable frame parser. The socket is read in chunks as large as the
+    //data it has, every complete frame is handed out by Next() and an incomplete tail waits for more bytes.
+    class FrameDecoder{
+    private:
+        std::vector<uint8_t> buf;
+        size_t head{0};     //first byte that is not decoded yet
+        size_t tail{0};     //end of the received data
+        size_t want{0};     //size of the incomplete frame at head, if its header is already known
+
+        void Reserve(size_t size);
+
+    public:
+        FrameDecoder() = default;
+
+        decoder_status ReadFrom(int fd, bool drain);
+        void Append(const uint8_t* data, size_t size);
+        decoder_status Next(FixedHeader& f_head, std::shared_ptr<uint8_t>& payload);
+
+        [[nodiscard]] size_t Pending() const noexcept;
+    };
+}
@@ -6,6 +6,8 @@
 #include <list>
 #include "spdlog/spdlog.h"
 
+#define DEFAULT_WRITE_TIMEOUT   5000    //ms
+
 namespace temp_funcs {
     template<int V, int num>
     struct mult {
@@ -0,0 +1,53 @@
+#pragma once
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wignored-attributes"
+
+#include <string>
+#include <cstdint>
+
+#define DEFAULT_LISTEN_ADDRESS  "0.0.0.0"
+#define DEFAULT_LISTEN_BACKLOG  1024
+
+enum class listener_err : uint8_t {
+    ok,
+    address_err,
+    socket_err,
+    bind_err,
+    listen_err
+};
+
+//Socket settings of one listener, 0/false leaves the kernel default
+struct ListenerCfg{
+    std::string address{DEFAULT_LISTEN_ADDRESS};
+    int port{0};
+    int backlog{DEFAULT_LISTEN_BACKLOG};
+    int defer_accept{0};            //TCP_DEFER_ACCEPT, seconds
+    bool tcp_nodelay{false};
+    bool tcp_quickack{false};
+    int sndbuf{0};
+    int rcvbuf{0};
+    unsigned int user_timeout{0};   //TCP_USER_TIMEOUT, ms
+    int busy_poll{0};               //SO_BUSY_POLL, us
+    int fastopen{0};                //TCP_FASTOPEN queue length
+};
+
+//A listening socket with its own tuning. The options are set on the listen socket (the buffer sizes have
+//to be known before listen() for window scaling) and again on every accepted socket, because TCP_QUICKACK,
+//SO_BUSY_POLL and TCP_USER_TIMEOUT are not inherited reliably.
+class Listener{
+private:
+    ListenerCfg cfg;
+    int fd{-1};
+
+public:
+    explicit Listener(ListenerCfg _cfg);
+    Listener(const Listener&)               = delete;
+    Listener& operator=(const Listener&)    = delete;
+    ~Listener();
+
+    listener_err Open(const char*& failed_option);
+    const char* Tune(int sock, bool listen_socket) const;
+
+    [[nodiscard]] int                   GetFd() const noexcept;
+    [[nodiscard]] const ListenerCfg&    GetCfg() const noexcept;
+};
@@ -0,0 +1,28 @@
+#pragma once
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wignored-attributes"
+
+#include <atomic>
+#include <string>
+#include <cstdint>
+
+//Broker wide counters. The shard threads bump them with relaxed atomics, the rates are
+//computed by Sample() which is called once per second.
+class Metrics{
+private:
+    uint64_t last_accepted{0};
+    std::atomic<uint64_t> accept_rate{0};
+
+public:
+    std::atomic<uint64_t> accepted{0};
+    std::atomic<uint64_t> accept_errors{0};
+    std::atomic<uint64_t> publish_dropped{0};       //slow consumers: PUBLISH packets discarded by the queue limits
+    std::atomic<uint64_t> quota_disconnects{0};
+    std::atomic<uint64_t> subscriber_cache_hits{0};
+    std::atomic<uint64_t> subscriber_cache_misses{0};
+
+    void Sample();
+
+    [[nodiscard]] uint64_t      GetAcceptRate() const noexcept;
+    [[nodiscard]] std::string   Format() const;
+};
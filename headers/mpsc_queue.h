@@ -0,0 +1,66 @@
+#pragma once
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wignored-attributes"
+
+#include <atomic>
+#include <cstddef>
+
+#include "spsc_queue.h"
+
+//Link of an intrusive MPSC queue. A node may be linked in one queue at a time.
+struct MpscNode{
+    std::atomic<MpscNode*> mpsc_next{nullptr};
+};
+
+//Unbounded lock-free multi producer / single consumer queue of intrusive nodes (Vyukov).
+//Push() is one exchange and never waits for other producers. Any thread may Push(), only one may Pop().
+//Pop() may miss a node whose producer is between the exchange and the link, Empty() still reports it.
+template <class T>
+class MpscQueue{
+private:
+    alignas(CACHE_LINE_SIZE) std::atomic<MpscNode*> head;   //last pushed, written by producers
+    alignas(CACHE_LINE_SIZE) MpscNode* tail;                //next to pop, owned by the consumer
+    MpscNode stub;
+
+    void Link(MpscNode* node) noexcept {
+        node->mpsc_next.store(nullptr, std::memory_order_relaxed);
+        MpscNode* prev = head.exchange(node, std::memory_order_seq_cst);
+        prev->mpsc_next.store(node, std::memory_order_release);
+    }
+
+public:
+    MpscQueue() : head(&stub), tail(&stub) {}
+    MpscQueue(const MpscQueue&)            = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    void Push(T* value) noexcept {
+        Link(static_cast<MpscNode*>(value));
+    }
+
+    T* Pop() noexcept {
+        MpscNode* cur = tail;
+        MpscNode* next = cur->mpsc_next.load(std::memory_order_acquire);
+        if (cur == &stub){
+            if (next == nullptr) return nullptr;
+            tail = next;
+            cur = next;
+            next = next->mpsc_next.load(std::memory_order_acquire);
+        }
+        if (next != nullptr){
+            tail = next;
+            return static_cast<T*>(cur);
+        }
+        if (cur != head.load(std::memory_order_acquire)) return nullptr;
+        //cur is the last node: the stub goes behind it, so cur can be unlinked
+        Link(&stub);
+        next = cur->mpsc_next.load(std::memory_order_acquire);
+        if (next == nullptr) return nullptr;
+        tail = next;
+        return static_cast<T*>(cur);
+    }
+
+    //consumer side only
+    [[nodiscard]] bool Empty() const noexcept {
+        return tail == &stub && head.load(std::memory_order_seq_cst) == &stub;
+    }
+};
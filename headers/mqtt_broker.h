@@ -14,6 +14,7 @@
 #include <thread>
 #include <chrono>
 #include <unordered_set>
+#include <atomic>
 #include <signal.h>
 
 #include "spdlog/spdlog.h"
@@ -29,10 +30,21 @@
 #include "topic_storage.h"
 #include "MqttPacketHandler.h"
 #include "mqtt_error_handler.h"
+#include "shard.h"
+#include "metrics.h"
+#include "listener.h"
+#include "topic_trie.h"
+#include "epoch.h"
+#include "mqtt_view.h"
 
 #define DEFAULT_CFG_FILE    "/home/cfg/mqtt_broker.cfg"
 #define DEFAULT_LOG_FILE    "/home/logs/mqtt_broker.log"
 #define DEFAULT_PORT        1883
+#define DEFAULT_ACCEPT_BATCH    256
+#define DEFAULT_KEEP_ALIVE_GRACE    5   //seconds over the keep alive before the connection is dropped
+#define DEFAULT_QOS_RETRANSMIT      1   //seconds between resends of an unacknowledged packet
+#define DEFAULT_QUEUE_MAX_BYTES     (16*1048576)    //per client
+#define DEFAULT_QUEUE_MAX_MESSAGES  10000
 #define CONTROL_SOCKET_NAME "/tmp/9Lq7BNBnBycd6nxy.socket"
 
 #define _1MB_                1048576
@@ -55,6 +67,11 @@ enum class broker_err {
     write_err
 };
 
+enum class io_backend : uint8_t {
+    epoll,
+    io_uring
+};
+
 enum broker_states : int {
     init,
     started,
@@ -80,6 +97,19 @@ public:
     int port;
     int level;
     std::string control_socket_path;
+    bool edge_triggered{false};
+    unsigned int shards{1};
+    unsigned int writers{DEFAULT_SENDERS};
+    io_backend backend{io_backend::epoll};
+    bool io_uring_sqpoll{false};
+    int listen_backlog{DEFAULT_LISTEN_BACKLOG};
+    int defer_accept{0};
+    std::vector<ListenerCfg> listeners;
+    QueueLimits outbound_limits{DEFAULT_QUEUE_MAX_BYTES, DEFAULT_QUEUE_MAX_MESSAGES, overflow_policy::drop_oldest_qos0};
+    std::vector<std::pair<std::string, QueueLimits>> topic_limits;
+    uint32_t zerocopy_threshold{0};
+    share_strategy shared_strategy{share_strategy::round_robin};
+    size_t subscriber_cache_size{DEFAULT_SUBSCRIBER_CACHE_SIZE};
 
     ServerCfgData() : log_file_path(DEFAULT_LOG_FILE), log_max_size(10*_1MB_), log_max_files(5), port(DEFAULT_PORT), level(spdlog::level::info), control_socket_path(CONTROL_SOCKET_NAME) {}
 
@@ -92,35 +122,84 @@ public:
 ServerCfgData ReadConfig(const char *path, cfg_err &err);
 [[noreturn]] void SenderThread(int id);
 
+//Entry of the client table. The id is a copy taken when the client claimed it, readers compare it
+//without touching the client.
+struct ClientEntry{
+    std::shared_ptr<Client> client;
+    std::string id;
+};
+
 class Broker : public Commands, public CTopicStorage, public MqttPacketHandler, private MqttErrorHandler {
 private:
-    std::shared_mutex clients_mtx;
-    unsigned int current_clients;
-    std::unordered_map<int, std::shared_ptr<Client>> clients;
+    //read on every packet and every delivery, changed on connect and disconnect
+    RcuTable<ClientEntry> clients;
+    std::mutex client_id_mtx;   //a client id is checked and claimed as one step
+    std::unordered_map<std::string, uint64_t> session_gen;     //bumped on every claim, under client_id_mtx
+    std::atomic<unsigned int> current_clients;
+
+    std::vector<std::unique_ptr<Shard>> shards;
+    RcuPtr<TopicTrie> subscriptions;
+    static thread_local Shard* current_shard;
+    Metrics metrics;
 
     int state;
     int control_sock;
-    int main_socket;
+    std::vector<std::unique_ptr<Listener>> listeners;
     std::string control_sock_path;
     int port{};
 
     Broker();
 
-    broker_err SendCommand(const char *buf, int buf_size);
-    broker_err ReadFixedHeader(int fd, FixedHeader &f_hed);
+    bool HandleReceived(int fd, const std::shared_ptr<Client>& pClient);
+    void DropConnection(int fd, const std::shared_ptr<Client>& pClient, int err, std::unordered_set<int>& fd_to_delete);
+    bool DispatchPacket(int fd, const std::shared_ptr<Client>& pClient, FixedHeader& f_head, const std::shared_ptr<uint8_t>& buf);
+    void HandleReactorEvents(Shard& shard, int ready, time_t current_time, std::unordered_set<int>& fd_to_delete);
+    void HandleCompletions(Shard& shard, time_t current_time, std::unordered_set<int>& fd_to_delete);
+    void HandleTimers(Shard& shard, time_t current_time, std::unordered_set<int>& fd_to_delete);
+    void CheckKeepAlive(Shard& shard, ShardTimer& timer, time_t current_time, std::unordered_set<int>& fd_to_delete);
+    void ArmRetransmit(int fd, const std::shared_ptr<Client>& pClient);
+    void Retransmit(Shard& shard, ShardTimer& timer, time_t current_time);
+    void PublishWill(const std::shared_ptr<Client>& pClient);
+    void ArmSessionExpiry(Shard& shard, const std::shared_ptr<Client>& pClient);
+    void ExpireSession(const std::string& client_id, uint64_t gen);
+    bool IsSessionCurrent(const std::string& client_id, uint64_t gen);
+    void HandleControlCommand();
+    void OnWriteBlocked(int fd, unsigned int owner) override;
+    void AcceptClients(Shard& shard, const Listener& listener);
+    const Listener* FindListener(int fd) const noexcept;
+    broker_err AddClient(Shard& shard, int sock, const std::string &_ip);
+    void HandleShardEvent(Shard& shard, ShardEvent& event);
+    std::shared_ptr<Client> GetClient(int fd);
     std::string GetControlPacketTypeName(uint8_t _packet);
 
-    int NotifyClients(MqttTopic& topic);
+    bool Subscribe(int fd, const std::shared_ptr<Client>& pClient, const std::string& filter, uint8_t options);
+    bool Unsubscribe(int fd, const std::shared_ptr<Client>& pClient, const std::string& filter);
+    void UnsubscribeAll(int fd, const std::shared_ptr<Client>& pClient);
+    size_t GetSubscriptionCount();
+
+    int NotifyClients(MqttTopic& topic, const std::string& publisher);
+    void MatchSubscribers(Shard& shard, const MqttTopic& topic, std::vector<Subscriber>& matched, std::vector<Subscriber>* picked, uint64_t share_key);
+    int NotifyLocalClients(Shard& shard, MqttTopic& topic, std::vector<Subscriber>& matched);
     int NotifyClient(int fd, MqttTopic& topic);
+    //a message is encoded once per protocol version and QoS for all the subscribers it goes to, [is v5][QoS]
+    using PublishVariants = std::array<std::array<EncodedPublish, mqtt_QoS::QoS_2 + 1>, 2>;
+    int Deliver(int fd, const std::shared_ptr<Client>& pClient, MqttTopic& topic, PublishVariants& variants);
+    void QueuePublish(int fd, MqttTopic& topic, const EncodedPublish& encoded);
+    void QuotaExceeded(int fd);
+
+    QueueLimitTable queue_limits;
+    uint32_t zerocopy_threshold{0};     //payload bytes, 0 - off
+    share_strategy shared_strategy{share_strategy::round_robin};
+    size_t subscriber_cache_size{DEFAULT_SUBSCRIBER_CACHE_SIZE};   //topic names per shard, 0 - off
 
     std::unordered_map<std::string, std::list<mqtt_packet>> postponed_events;
 
     std::shared_mutex qos_mutex;
-    std::thread qos_thread;
-    bool qos_thread_started{false};
+    bool senders_started{false};
     bool erase_old_values_in_queue{false};
     bool CheckIfMoreMessages(const std::string& client_id);
     std::pair<uint32_t, std::shared_ptr<uint8_t>> GetPacket(const std::string& client_id, bool &found);
+    bool SendPostponed(int fd, const std::string& client_id);
 
     friend MqttConnectPacketHandler;
     friend MqttPublishPacketHandler;
@@ -139,9 +218,8 @@ public:
     Broker(Broker&& root)               = delete;
     Broker& operator=(Broker&&)         = delete;
 
-    static void ServerThread();
+    static void ServerThread(unsigned int shard_id);
     [[noreturn]] static void SenderThread(int id);
-    [[noreturn]] static void QoSThread();
 
     static Broker& GetInstance(){
         static Broker instance;
@@ -150,11 +228,15 @@ public:
 
     std::shared_ptr<spdlog::logger> lg;
 
-    broker_err AddClient(int sock, const std::string &_ip);
     void DelClient(int sock);
+    broker_err InitShards(unsigned int count, bool edge_triggered, io_backend backend, bool sqpoll);
     broker_err InitControlSocket(const std::string& sock_path);
-    int InitSocket();
-    int WaitForClient(char* _ip);
+    broker_err InitListeners(const std::vector<ListenerCfg>& cfg);
+    void SampleMetrics();
+    void SetQueueLimits(const QueueLimits& global, const std::vector<std::pair<std::string, QueueLimits>>& topics);
+    void SetZerocopyThreshold(uint32_t threshold);
+    void SetShareStrategy(share_strategy strategy);
+    void SetSubscriberCacheSize(size_t size);
 
     void AddQosEvent(const std::string& client_id, const mqtt_packet& mqtt_message);
     void DelQosEvent(const std::string& client_id, uint16_t packet_id);
@@ -168,21 +250,22 @@ public:
     void    InitLogger(const std::string & _path, size_t  _size, size_t _max_files, int _level);
 
     void Start();
-    bool CheckClientID(const std::string& client_id) const noexcept;
-	int  GetClientFd(const std::string& client_id) const noexcept;
+    bool CheckClientID(const std::string& client_id) noexcept;
+    bool ClaimClientID(int fd, const std::shared_ptr<Client>& pClient, const std::string& client_id, bool unique);
+	int  GetClientFd(const std::string& client_id) noexcept;
 	void CloseConnection(int fd);
 };
 
-int HandleMqttConnect(std::shared_ptr<Client>& pClient, const std::shared_ptr<uint8_t>& buf, std::shared_ptr<spdlog::logger>& lg, Broker* broker);
+int HandleMqttConnect(int fd, std::shared_ptr<Client>& pClient, const FixedHeader &fh, const std::shared_ptr<uint8_t>& buf, std::shared_ptr<spdlog::logger>& lg, Broker* broker);
 
-int HandleMqttPublish(std::shared_ptr<Client>& pClient, const FixedHeader &fh, const std::shared_ptr<uint8_t>& buf, std::shared_ptr<spdlog::logger>& lg, PublishVH &vh, std::shared_ptr<MqttBinaryDataEntity> &message);
+int HandleMqttPublish(std::shared_ptr<Client>& pClient, const FixedHeader &fh, const std::shared_ptr<uint8_t>& buf, std::shared_ptr<spdlog::logger>& lg, PublishView &vh, std::shared_ptr<MqttBinaryDataEntity> &message);
 
 int HandleMqttSubscribe(std::shared_ptr<Client>& pClient, const FixedHeader &fh, const std::shared_ptr<uint8_t>& buf, std::shared_ptr<spdlog::logger>& lg,
-                        SubscribeVH &vh, std::vector<uint8_t> &_reason_codes, std::list<std::pair<std::string, uint8_t>>& subscribe_topics);
+                        SubscribeView &vh, std::vector<uint8_t> &_reason_codes, std::list<std::pair<std::string, uint8_t>>& subscribe_topics);
 
 int HandleMqttPuback(const std::shared_ptr<uint8_t>& buf, std::shared_ptr<spdlog::logger>& lg, PubackVH& p_vh);
 
 int HandleMqttUnsubscribe(std::shared_ptr<Client>& pClient, const std::shared_ptr<uint8_t>& buf, const FixedHeader &fh,
-                          std::shared_ptr<spdlog::logger>& lg, UnsubscribeVH&  p_vh, std::list<std::string> &topics_to_unsubscribe);
+                          std::shared_ptr<spdlog::logger>& lg, SubscribeView&  p_vh, std::list<std::string> &topics_to_unsubscribe);
 
 int HandleMqttPubrel(const std::shared_ptr<uint8_t>& buf, std::shared_ptr<spdlog::logger>& lg, TypicalVH&  t_vh);
@@ -3,10 +3,16 @@
 #pragma GCC diagnostic ignored "-Wignored-attributes"
 
 #include <strings.h>
+#include <endian.h>
 #include <stdlib.h>
 #include <sys/types.h>
+#include <cstring>
 #include <memory>
 #include <utility>
+#include <optional>
+#include <array>
+#include <variant>
+#include <string_view>
 #include <arpa/inet.h>
 #include <iostream>
 #include <map>
@@ -14,6 +20,8 @@
 #include <queue>
 
 #include "functions.h"
+#include "topic_names.h"
+#include "small_vector.h"
 
 //mqtt flags
 #define RETAIN_FLAG     0x01;
@@ -22,6 +30,11 @@
 #define MQTT_VERSION_5      5
 #define MQTT_VERSION_3      4
 
+#define PROPERTY_CHAIN_INLINE   4   //properties kept inside MqttPropertyChain before it allocates
+#define PROPERTY_ID_LIMIT       64  //property ids are below, see property_table
+#define PROPERTIES_OF_WILL      16  //pseudo packet type of the will properties in CONNECT
+#define ACK_MAX_SIZE            6   //largest pre-encoded acknowledgement, see ack_templates
+
 namespace mqtt_protocol{
     //MQTT Control Packet types
     namespace mqtt_pack_type {
@@ -144,6 +157,108 @@ namespace mqtt_protocol{
         duplicate_client_id
     };
 
+    //What the protocol says about a property: its wire type, the packets it may appear in (a bit per
+    //mqtt_pack_type, PROPERTIES_OF_WILL for the will properties of CONNECT) and the packets it may appear in
+    //more than once. Decoding and validation are driven by property_table, a new property is one line there.
+    struct PropertyDescriptor{
+        uint8_t type{mqtt_data_type::undefined};    //undefined: not a property id
+        uint32_t packets{0};
+        uint32_t repeatable{0};
+    };
+
+    [[nodiscard]] constexpr uint32_t PacketBit(const int type) noexcept {
+        return uint32_t{1} << type;
+    }
+
+    inline constexpr auto property_table = []{
+        using namespace mqtt_pack_type;
+        std::array<PropertyDescriptor, PROPERTY_ID_LIMIT> table{};
+        const uint32_t will = PacketBit(PROPERTIES_OF_WILL);
+        const uint32_t acks = PacketBit(PUBACK) | PacketBit(PUBREC) | PacketBit(PUBREL) | PacketBit(PUBCOMP);
+        const uint32_t any = PacketBit(CONNECT) | PacketBit(CONNACK) | PacketBit(PUBLISH) | acks | PacketBit(SUBSCRIBE) | PacketBit(SUBACK) |
+                             PacketBit(UNSUBSCRIBE) | PacketBit(UNSUBACK) | PacketBit(DISCONNECT) | PacketBit(AUTH) | will;
+
+        table[payload_format_indicator]             = {mqtt_data_type::byte, PacketBit(PUBLISH) | will};
+        table[message_expiry_interval]              = {mqtt_data_type::four_byte, PacketBit(PUBLISH) | will};
+        table[content_type]                         = {mqtt_data_type::mqtt_string, PacketBit(PUBLISH) | will};
+        table[response_topic]                       = {mqtt_data_type::mqtt_string, PacketBit(PUBLISH) | will};
+        table[correlation_data]                     = {mqtt_data_type::binary_data, PacketBit(PUBLISH) | will};
+        table[subscription_identifier]              = {mqtt_data_type::variable_int, PacketBit(PUBLISH) | PacketBit(SUBSCRIBE), PacketBit(PUBLISH)};
+        table[session_expiry_interval]              = {mqtt_data_type::four_byte, PacketBit(CONNECT) | PacketBit(CONNACK) | PacketBit(DISCONNECT)};
+        table[assigned_client_identifier]           = {mqtt_data_type::mqtt_string, PacketBit(CONNACK)};
+        table[server_keep_alive]                    = {mqtt_data_type::two_byte, PacketBit(CONNACK)};
+        table[authentication_method]                = {mqtt_data_type::mqtt_string, PacketBit(CONNECT) | PacketBit(CONNACK) | PacketBit(AUTH)};
+        table[authentication_data]                  = {mqtt_data_type::binary_data, PacketBit(CONNECT) | PacketBit(CONNACK) | PacketBit(AUTH)};
+        table[request_problem_information]          = {mqtt_data_type::byte, PacketBit(CONNECT)};
+        table[will_delay_interval]                  = {mqtt_data_type::four_byte, will};
+        table[request_response_information]         = {mqtt_data_type::byte, PacketBit(CONNECT)};
+        table[response_information]                 = {mqtt_data_type::mqtt_string, PacketBit(CONNACK)};
+        table[server_reference]                     = {mqtt_data_type::mqtt_string, PacketBit(CONNACK) | PacketBit(DISCONNECT)};
+        table[reason_string]                        = {mqtt_data_type::mqtt_string, PacketBit(CONNACK) | acks | PacketBit(SUBACK) |
+                                                                                    PacketBit(UNSUBACK) | PacketBit(DISCONNECT) | PacketBit(AUTH)};
+        table[receive_maximum]                      = {mqtt_data_type::two_byte, PacketBit(CONNECT) | PacketBit(CONNACK)};
+        table[topic_alias_maximum]                  = {mqtt_data_type::two_byte, PacketBit(CONNECT) | PacketBit(CONNACK)};
+        table[topic_alias]                          = {mqtt_data_type::two_byte, PacketBit(PUBLISH)};
+        table[maximum_qos]                          = {mqtt_data_type::byte, PacketBit(CONNACK)};
+        table[retain_available]                     = {mqtt_data_type::byte, PacketBit(CONNACK)};
+        table[user_property]                        = {mqtt_data_type::mqtt_string_pair, any, any};
+        table[maximum_packet_size]                  = {mqtt_data_type::four_byte, PacketBit(CONNECT) | PacketBit(CONNACK)};
+        table[wildcard_subscription_available]      = {mqtt_data_type::byte, PacketBit(CONNACK)};
+        table[subscription_identifier_available]    = {mqtt_data_type::byte, PacketBit(CONNACK)};
+        table[shared_subscription_available]        = {mqtt_data_type::byte, PacketBit(CONNACK)};
+        return table;
+    }();
+
+    [[nodiscard]] constexpr const PropertyDescriptor& GetPropertyDescriptor(const uint8_t id) noexcept {
+        return property_table[id < PROPERTY_ID_LIMIT ? id : 0];
+    }
+
+    //packet is a mqtt_pack_type or PROPERTIES_OF_WILL, RESERVED accepts any property;
+    //seen collects the ids of the block read so far
+    [[nodiscard]] constexpr bool isPropertyAllowed(const uint8_t id, const uint8_t packet, uint64_t& seen) noexcept {
+        if (packet == mqtt_pack_type::RESERVED) return true;
+        const auto& descriptor = GetPropertyDescriptor(id);
+        const uint64_t bit = uint64_t{1} << (id % PROPERTY_ID_LIMIT);
+        if ((descriptor.packets & PacketBit(packet)) == 0) return false;
+        if ((seen & bit) != 0 && (descriptor.repeatable & PacketBit(packet)) == 0) return false;
+        seen |= bit;
+        return true;
+    }
+
+    //Acknowledgement answered with success, byte for byte what PubackVH/TypicalVH (v5: success reason code and
+    //an empty property block) or TypicalV3VH produce. The packet id (bytes 2-3) is left zero.
+    struct AckTemplate{
+        std::array<uint8_t, ACK_MAX_SIZE> bytes;
+        uint8_t size;
+    };
+
+    [[nodiscard]] constexpr AckTemplate MakeAckTemplate(const uint8_t type, const uint8_t version) noexcept {
+        const auto first = static_cast<uint8_t>(type << 4 | (type == mqtt_pack_type::PUBREL ? 0x02 : 0));
+        if (type == mqtt_pack_type::PINGRESP) return {{first, 0}, 2};
+        if (version == MQTT_VERSION_5) return {{first, 4, 0, 0, mqtt_reason_code::success, 0}, 6};
+        return {{first, 2, 0, 0}, 4};
+    }
+
+    //[is v5][packet type]: PUBACK, PUBREC, PUBREL, PUBCOMP and PINGRESP
+    inline constexpr auto ack_templates = []{
+        using namespace mqtt_pack_type;
+        std::array<std::array<AckTemplate, AUTH + 1>, 2> table{};
+        for(const uint8_t type : {PUBACK, PUBREC, PUBREL, PUBCOMP, PINGRESP}){
+            table[0][type] = MakeAckTemplate(type, MQTT_VERSION_3);
+            table[1][type] = MakeAckTemplate(type, MQTT_VERSION_5);
+        }
+        return table;
+    }();
+
+    //writes the ack into dst (ACK_MAX_SIZE bytes) with the packet id patched in, returns the packet size
+    inline uint8_t EncodeAck(uint8_t* dst, const uint8_t type, const uint8_t version, const uint16_t packet_id) noexcept {
+        const auto& ack = ack_templates[version == MQTT_VERSION_5][type];
+        memcpy(dst, ack.bytes.data(), ACK_MAX_SIZE);
+        const uint16_t id = htons(packet_id);
+        if (ack.size > 2) memcpy(dst + 2, &id, sizeof(id));
+        return ack.size;
+    }
+
     class FixedHeader{
     public:
         friend class FHBuilder;
@@ -180,251 +295,208 @@ namespace mqtt_protocol{
         FixedHeader header;
     };
 
-    class MqttStringEntity;
-
-    class MqttEntity{
-    protected:
-        uint8_t type = 0;
-    public:
-        [[nodiscard]] virtual uint32_t  Size() const = 0;
-        virtual uint8_t*                GetData() = 0;
-        virtual void                    Serialize(uint8_t* dst_buf, uint32_t &offset) = 0;
-
-        virtual std::shared_ptr<std::pair<MqttStringEntity, MqttStringEntity>> GetPair();
-        [[nodiscard]] virtual uint8_t     GetType() const;
-        [[nodiscard]] virtual uint32_t    GetUint() const;
-        [[nodiscard]] virtual std::string      GetString() const;
-        [[nodiscard]] virtual std::pair<std::string, std::string>      GetStringPair() const;
-        virtual ~MqttEntity() = default;
-    };
-
-    class MqttByteEntity : public MqttEntity{
-    private:
-        std::shared_ptr<uint8_t> data{};
-    public:
-        MqttByteEntity() = delete;
+    //bytes taken by the variable byte integer: 7 bits per byte
+    [[nodiscard]] constexpr uint8_t GetVarIntSize(const uint32_t value) noexcept {
+        return (32 - __builtin_clz(value | 1) + 6) / 7;
+    }
 
-        explicit MqttByteEntity(const uint8_t* _data);
-        explicit MqttByteEntity(uint8_t value);
+    inline uint8_t CodeVarInt(uint8_t *buf, uint32_t value, uint8_t &size) noexcept {
+        uint8_t offset = 0;
+        for(; value >= 0x80; value >>= 7) buf[offset++] = uint8_t(value) | 0x80;
+        buf[offset++] = uint8_t(value);
+        size = offset;
+        return mqtt_err::ok;
+    }
 
-        MqttByteEntity(const MqttByteEntity& _obj) noexcept;
-        MqttByteEntity(MqttByteEntity&& _obj) noexcept;
-        MqttByteEntity& operator=(const MqttByteEntity& _obj) noexcept;
-        MqttByteEntity& operator=(MqttByteEntity&& _obj) noexcept;
+    //Variable byte integer read from at most avail bytes: read_err if it is not complete within avail,
+    //var_int_err if it is longer than 4 bytes. The 4 bytes are handled as one word: the first byte without
+    //the continuation bit gives the size, the 7 bit groups are gathered with shifts.
+    [[nodiscard]] inline uint8_t DecodeVarInt(const uint8_t *buf, const size_t avail, uint32_t &value, uint8_t &size) noexcept {
+        uint32_t word = 0;
+        if (avail >= sizeof(word)) memcpy(&word, buf, sizeof(word));
+        else memcpy(&word, buf, avail);
+        word = le32toh(word);
+        const uint32_t last = ~word & 0x80808080u;
+        if (last == 0) return mqtt_err::var_int_err;
+        size = (__builtin_ctz(last) >> 3) + 1;
+        if (size > avail) return mqtt_err::read_err;
+        const uint32_t bits = word & (0xFFFFFFFFu >> (32 - 8 * size)) & 0x7F7F7F7Fu;
+        value = (bits & 0x7F) | ((bits >> 1) & 0x3F80) | ((bits >> 2) & 0x1FC000) | ((bits >> 3) & 0xFE00000);
+        return mqtt_err::ok;
+    }
 
-        [[nodiscard]] uint32_t Size() const override;
-        uint8_t* GetData() override;
-        [[nodiscard]] uint32_t GetUint() const override;
-        void Serialize(uint8_t* dst_buf, uint32_t &offset) override;
-        ~MqttByteEntity() override {
-            data.reset();
-        }
-    };
+    //Entities are plain values: an integer is stored inline, a string owns its characters. Nothing is
+    //virtual, MqttProperty keeps any of them in a std::variant and every call is resolved at compile time.
 
-    class MqttTwoByteEntity : public MqttEntity{
+    //byte, two_byte, four_byte and variable_int, the value is kept in host order
+    template <class T, uint8_t Type>
+    class MqttIntegerEntity{
     private:
-        std::shared_ptr<uint16_t> data{};
+        T value{};
     public:
-        MqttTwoByteEntity() = delete;
-
-        explicit MqttTwoByteEntity(const uint8_t * _data);
-        explicit MqttTwoByteEntity(uint16_t value);
-
-        MqttTwoByteEntity(const MqttTwoByteEntity& _obj) noexcept;
-        MqttTwoByteEntity(MqttTwoByteEntity&& _obj) noexcept;
-        MqttTwoByteEntity& operator=(const MqttTwoByteEntity& _obj) noexcept;
-        MqttTwoByteEntity& operator=(MqttTwoByteEntity&& _obj) noexcept;
-
-        [[nodiscard]] uint32_t Size() const override;
-        uint8_t* GetData() override;
-        [[nodiscard]] uint32_t GetUint() const override;
-        void Serialize(uint8_t* dst_buf, uint32_t &offset) override;
-
-        ~MqttTwoByteEntity() override {
-            data.reset();
+        MqttIntegerEntity() = delete;
+        explicit MqttIntegerEntity(const uint8_t* _data) noexcept {
+            memcpy(&value, _data, sizeof(value));
         }
-    };
-
-    class MqttFourByteEntity : public MqttEntity{
-    private:
-        std::shared_ptr<uint32_t> data{};
-    public:
-        MqttFourByteEntity() = delete;
-
-        explicit MqttFourByteEntity(const uint8_t * _data);
-        explicit MqttFourByteEntity(uint32_t value);
-
-        MqttFourByteEntity(const MqttFourByteEntity& _obj) noexcept;
-        MqttFourByteEntity(MqttFourByteEntity&& _obj) noexcept;
-        MqttFourByteEntity& operator=(const MqttFourByteEntity& _obj) noexcept;
-        MqttFourByteEntity& operator=(MqttFourByteEntity&& _obj) noexcept;
-
-        [[nodiscard]] uint32_t Size() const override;
-        uint8_t* GetData() override;
-        [[nodiscard]] uint32_t GetUint() const override;
-        void Serialize(uint8_t* dst_buf, uint32_t &offset) override;
+        explicit MqttIntegerEntity(const T _value) noexcept : value(_value) {}
 
-        ~MqttFourByteEntity() override {
-            data.reset();
+        [[nodiscard]] uint32_t Size() const noexcept {
+            if constexpr (Type == mqtt_data_type::variable_int) return GetVarIntSize(value);
+            else return sizeof(T);
+        }
+        [[nodiscard]] uint8_t  GetType() const noexcept { return Type; }
+        [[nodiscard]] uint32_t GetUint() const noexcept { return value; }
+        uint8_t*                GetData() noexcept { return reinterpret_cast<uint8_t*>(&value); }
+        [[nodiscard]] const uint8_t* GetData() const noexcept { return reinterpret_cast<const uint8_t*>(&value); }
+
+        void Serialize(uint8_t* dst_buf, uint32_t &offset) const {
+            if constexpr (Type == mqtt_data_type::variable_int){
+                uint8_t size;
+                CodeVarInt(dst_buf, value, size);
+                offset += size;
+            } else {
+                T raw_val = value;
+                if constexpr (sizeof(T) == sizeof(uint16_t)) raw_val = htons(value);
+                if constexpr (sizeof(T) == sizeof(uint32_t)) raw_val = htonl(value);
+                memcpy(dst_buf, &raw_val, sizeof(raw_val));
+                offset += sizeof(raw_val);
+            }
         }
     };
 
-    class MqttStringEntity : public MqttEntity{
+    using MqttByteEntity        = MqttIntegerEntity<uint8_t, mqtt_data_type::byte>;
+    using MqttTwoByteEntity     = MqttIntegerEntity<uint16_t, mqtt_data_type::two_byte>;
+    using MqttFourByteEntity    = MqttIntegerEntity<uint32_t, mqtt_data_type::four_byte>;
+    using MqttVIntEntity        = MqttIntegerEntity<uint32_t, mqtt_data_type::variable_int>;
+
+    class MqttStringEntity{
     private:
-        std::shared_ptr<std::string> data{};
+        std::string data;
     public:
         MqttStringEntity() = delete;
-
-        MqttStringEntity(const uint16_t _len, const uint8_t * _data){
-            type = mqtt_data_type::mqtt_string;
-            data = std::make_shared<std::string>((char *)_data, _len);
+        MqttStringEntity(const uint16_t _len, const uint8_t * _data) : data(reinterpret_cast<const char*>(_data), _len) {}
+        explicit MqttStringEntity(const std::string& _str) : data(_str) {}
+        explicit MqttStringEntity(std::string_view _str) : data(_str) {}
+        explicit MqttStringEntity(const char* _str) : data(_str) {}
+        MqttStringEntity& operator=(const std::string& _str){
+            data = _str;
+            return *this;
         }
 
-        explicit MqttStringEntity(const std::string& _str) noexcept;
-        MqttStringEntity(const MqttStringEntity& _obj) noexcept;
-        MqttStringEntity(MqttStringEntity&& _obj) noexcept;
-        MqttStringEntity& operator=(const MqttStringEntity& _obj) noexcept;
-        MqttStringEntity& operator=(MqttStringEntity&& _obj) noexcept;
-        MqttStringEntity& operator=(const std::string& _str) noexcept;
-
-        [[nodiscard]] uint32_t Size() const override;
-        uint8_t* GetData() override;
-        [[nodiscard]] std::string GetString() const override;
-        void Serialize(uint8_t* dst_buf, uint32_t &offset) override;
-
-        ~MqttStringEntity() override {
-            data.reset();
-        }
+        [[nodiscard]] uint32_t Size() const noexcept { return sizeof(uint16_t) + data.size(); }
+        [[nodiscard]] uint8_t  GetType() const noexcept { return mqtt_data_type::mqtt_string; }
+        uint8_t*                GetData() noexcept { return reinterpret_cast<uint8_t*>(data.data()); }
+        [[nodiscard]] const uint8_t* GetData() const noexcept { return reinterpret_cast<const uint8_t*>(data.data()); }
+        [[nodiscard]] std::string GetString() const { return data; }
+        [[nodiscard]] const std::string& Str() const noexcept { return data; }
+        void Serialize(uint8_t* dst_buf, uint32_t &offset) const;
     };
 
-    class MqttBinaryDataEntity : public MqttEntity{
+    //the bytes are kept behind a shared_ptr, so a payload can stay in the buffer it was received in
+    class MqttBinaryDataEntity{
     private:
         std::shared_ptr<uint8_t> data{};
         uint16_t size{};
     public:
         MqttBinaryDataEntity() = default;
         MqttBinaryDataEntity(uint16_t _len, const uint8_t * _data);
-        MqttBinaryDataEntity(const MqttBinaryDataEntity& _obj) noexcept;
+        //shares _data (e.g. the payload inside a received packet) instead of copying it
+        MqttBinaryDataEntity(uint16_t _len, std::shared_ptr<uint8_t> _data) noexcept;
+        MqttBinaryDataEntity(const MqttBinaryDataEntity& _obj);
         MqttBinaryDataEntity(MqttBinaryDataEntity&& _obj) noexcept;
-        MqttBinaryDataEntity& operator=(const MqttBinaryDataEntity& _obj) noexcept;
+        MqttBinaryDataEntity& operator=(const MqttBinaryDataEntity& _obj);
         MqttBinaryDataEntity& operator=(MqttBinaryDataEntity&& _obj) noexcept;
 
-        [[nodiscard]] uint32_t Size() const override;
-        uint8_t* GetData() override;
-        void Serialize(uint8_t* dst_buf, uint32_t &offset) override;
-        void SerializeWithoutLen(uint8_t* dst_buf, uint32_t &offset);
-        [[nodiscard]] std::string GetString() const override;
-
-        bool isEmpty();
+        [[nodiscard]] uint32_t Size() const noexcept { return sizeof(uint16_t) + size; }
+        [[nodiscard]] uint8_t  GetType() const noexcept { return mqtt_data_type::binary_data; }
+        uint8_t*                GetData() noexcept { return data.get(); }
+        [[nodiscard]] const uint8_t* GetData() const noexcept { return data.get(); }
+        void Serialize(uint8_t* dst_buf, uint32_t &offset) const;
+        void SerializeWithoutLen(uint8_t* dst_buf, uint32_t &offset) const;
+        [[nodiscard]] std::string GetString() const;
 
-        ~MqttBinaryDataEntity() override {
-            data.reset();
-        }
+        [[nodiscard]] bool isEmpty() const noexcept { return size == 0; }
     };
 
-    class MqttStringPairEntity : public MqttEntity {
+    class MqttStringPairEntity{
     private:
-        std::shared_ptr<std::pair<MqttStringEntity, MqttStringEntity>> data{};
+        std::pair<MqttStringEntity, MqttStringEntity> data;
     public:
-        MqttStringPairEntity(const MqttStringEntity& str_1, const MqttStringEntity& str_2){
-            type = mqtt_data_type::mqtt_string_pair;
-            data = std::make_shared<std::pair<MqttStringEntity, MqttStringEntity>>(str_1, str_2);
-        }
-
-        MqttStringPairEntity(const MqttStringPairEntity& _obj) noexcept;
-        MqttStringPairEntity(const std::string &_str_1, const std::string &_str_2) noexcept;
-        MqttStringPairEntity(MqttStringPairEntity&& _obj) noexcept;
-        MqttStringPairEntity& operator=(const MqttStringPairEntity& _obj) noexcept;
-        MqttStringPairEntity& operator=(MqttStringPairEntity&& _obj) noexcept;
-
-        [[nodiscard]] uint32_t Size() const override;
-        uint8_t* GetData()  override;
-        std::shared_ptr<std::pair<MqttStringEntity, MqttStringEntity>> GetPair() override;
-        [[nodiscard]] std::pair<std::string, std::string> GetStringPair() const override;
-        void Serialize(uint8_t* dst_buf, uint32_t &offset) override;
+        MqttStringPairEntity(const MqttStringEntity& str_1, const MqttStringEntity& str_2) : data(str_1, str_2) {}
+        MqttStringPairEntity(const std::string &_str_1, const std::string &_str_2) : data(_str_1, _str_2) {}
 
-        ~MqttStringPairEntity() override {
-            data.reset();
-        }
+        [[nodiscard]] uint32_t Size() const noexcept { return data.first.Size() + data.second.Size(); }
+        [[nodiscard]] uint8_t  GetType() const noexcept { return mqtt_data_type::mqtt_string_pair; }
+        uint8_t*                GetData() noexcept { return data.first.GetData(); }
+        [[nodiscard]] const uint8_t* GetData() const noexcept { return data.first.GetData(); }
+        std::pair<MqttStringEntity, MqttStringEntity>* GetPair() noexcept { return &data; }
+        [[nodiscard]] const std::pair<MqttStringEntity, MqttStringEntity>* GetPair() const noexcept { return &data; }
+        [[nodiscard]] std::pair<std::string, std::string> GetStringPair() const;
+        void Serialize(uint8_t* dst_buf, uint32_t &offset) const;
     };
 
-    class MqttVIntEntity : public MqttEntity{
-    private:
-        std::shared_ptr<uint32_t> data{};
-    public:
-        MqttVIntEntity() = delete;
-
-        explicit MqttVIntEntity(const uint8_t* _data);
-        explicit MqttVIntEntity(uint32_t value);
+    using MqttValue = std::variant<MqttByteEntity, MqttTwoByteEntity, MqttFourByteEntity, MqttVIntEntity,
+                                   MqttStringEntity, MqttBinaryDataEntity, MqttStringPairEntity>;
 
-        [[nodiscard]] uint32_t Size() const override;
-        [[nodiscard]] uint32_t GetUint() const override;
-        uint8_t* GetData() override;
-        void Serialize(uint8_t* dst_buf, uint32_t &offset) override;
-
-        ~MqttVIntEntity() override {
-            data.reset();
-        }
-    };
-
-    class MqttProperty final : public MqttEntity {
+    //A property id and its value. The accessors of a type the value does not have return an empty result.
+    class MqttProperty{
     private:
-        std::shared_ptr<MqttEntity> property;
+        MqttValue value;
         uint8_t id;
     public:
         MqttProperty() = delete;
-
-        MqttProperty(uint8_t _id, std::shared_ptr<MqttEntity> entity);
-
-        [[nodiscard]] uint8_t     GetId() const;
-        uint8_t*    GetData() override;
-        [[nodiscard]] uint32_t    Size() const override;
-        [[nodiscard]] uint8_t     GetType() const override;
-        std::shared_ptr<std::pair<MqttStringEntity, MqttStringEntity>>     GetPair() override;
-        [[nodiscard]] uint32_t    GetUint() const override;
-        [[nodiscard]] std::string      GetString() const override;
-        [[nodiscard]] std::pair<std::string, std::string> GetStringPair() const override;
-        void        Serialize(uint8_t* buf_dst, uint32_t &offset) override;
-
-        ~MqttProperty() override {
-            //property->~MqttEntity();
-        };
+        MqttProperty(uint8_t _id, MqttValue _value) noexcept : value(std::move(_value)), id(_id) {}
+
+        [[nodiscard]] uint8_t     GetId() const noexcept { return id; }
+        [[nodiscard]] const MqttValue& GetValue() const noexcept { return value; }
+        uint8_t*                    GetData();
+        [[nodiscard]] uint32_t    Size() const;
+        [[nodiscard]] uint8_t     GetType() const;
+        std::pair<MqttStringEntity, MqttStringEntity>*     GetPair();
+        [[nodiscard]] uint32_t    GetUint() const;
+        [[nodiscard]] std::string GetString() const;
+        [[nodiscard]] std::pair<std::string, std::string> GetStringPair() const;
+        void        Serialize(uint8_t* buf_dst, uint32_t &offset) const;
     };
 
+    //Properties in the order they were added, a repeated id (user_property) is kept every time.
+    //present has bit (id % 64) set for every id in the chain, so looking up a missing id is one test;
+    //encoded_size is the length of the serialized properties, updated by AddProperty.
     class MqttPropertyChain{
     private:
-        //map<uint8_t, shared_ptr<MqttProperty>, less<>, PoolAllocator<pair<uint8_t, shared_ptr<MqttProperty>>, 5>> properties;
-        std::map<uint8_t, std::shared_ptr<MqttProperty>> properties;
+        SmallVector<MqttProperty, PROPERTY_CHAIN_INLINE> properties;
+        uint64_t present{0};
+        uint16_t encoded_size{0};
+
+        [[nodiscard]] static uint64_t Bit(const uint8_t _id) noexcept { return uint64_t{1} << (_id % 64); }
     public:
         MqttPropertyChain() = default;
-        MqttPropertyChain(const MqttPropertyChain & _chain);
-        MqttPropertyChain& operator = (const MqttPropertyChain & _chain);
-        MqttPropertyChain(MqttPropertyChain && _chain) noexcept;
-        MqttPropertyChain& operator = (MqttPropertyChain && _chain) noexcept;
 
         [[nodiscard]] uint32_t    Count() const;
         [[nodiscard]] uint16_t    GetSize() const;
-        std::shared_ptr<MqttProperty>   GetProperty(uint8_t _id);
-        std::shared_ptr<MqttProperty>   operator[](uint8_t _id);
-
-        int  Create(const uint8_t *buf, uint32_t &size);
-        void AddProperty(const std::shared_ptr<MqttProperty>& entity);
+        //the first property with the id, nullptr if there is none;
+        //a property may be changed in place but not resized, encoded_size would be stale
+        MqttProperty*   GetProperty(uint8_t _id);
+        MqttProperty*   operator[](uint8_t _id);
+
+        //packet is the type the properties were read from (PROPERTIES_OF_WILL for the will), a property
+        //not allowed there fails with mqtt_property_err; RESERVED skips the check
+        int  Create(const uint8_t *buf, uint32_t &size, uint8_t packet = mqtt_pack_type::RESERVED);
+        void AddProperty(MqttProperty property);
         void Serialize(uint8_t *buf, uint32_t &offset);
         void Clear();
 
-        decltype(properties)::const_iterator Cbegin(){
-            return properties.cbegin();
-        }
-
-        decltype(properties)::const_iterator Cend(){
-            return properties.cend();
-        }
-
-        ~MqttPropertyChain() {
-            for (auto &it : properties){
-                it.second.reset();
+        //calls f(const MqttProperty&) for every property with the id, in the order they were added
+        template <class F>
+        void ForEach(const uint8_t _id, F&& f) const {
+            if ((present & Bit(_id)) == 0) return;
+            for(const auto& it : properties){
+                if (it.GetId() == _id) f(it);
             }
         }
+
+        [[nodiscard]] const MqttProperty* begin() const noexcept { return properties.begin(); }
+        [[nodiscard]] const MqttProperty* end() const noexcept { return properties.end(); }
     };
 
     class IVariableHeader{
@@ -618,12 +690,13 @@ namespace mqtt_protocol{
     private:
         uint8_t qos;
         uint16_t id;
-        std::string name;
+        std::shared_ptr<const TopicName> name;
         std::shared_ptr<MqttBinaryDataEntity> data;
 
     public:
         MqttTopic() = default;
-        MqttTopic(uint8_t _qos, uint16_t _id, const std::string &_name, const std::shared_ptr<MqttBinaryDataEntity> &_data);
+        MqttTopic(uint8_t _qos, uint16_t _id, std::string_view _name, const std::shared_ptr<MqttBinaryDataEntity> &_data);
+        MqttTopic(uint8_t _qos, uint16_t _id, std::shared_ptr<const TopicName> _name, const std::shared_ptr<MqttBinaryDataEntity> &_data);
 
         MqttTopic(const MqttTopic &_topic) = default;
         MqttTopic(MqttTopic &&_topic) noexcept = default;
@@ -639,7 +712,9 @@ namespace mqtt_protocol{
         [[nodiscard]] MqttBinaryDataEntity GetValue() const;
         [[nodiscard]] uint16_t GetID() const;
         [[nodiscard]] uint8_t GetQoS() const;
-        [[nodiscard]] std::string GetName() const;
+        [[nodiscard]] const std::string& GetName() const;
+        [[nodiscard]] const std::shared_ptr<const TopicName>& GetTopicName() const noexcept;
+        [[nodiscard]] uint32_t GetNameID() const noexcept;
 
         void SetPacketID(uint16_t new_id);
         void SetQos(uint8_t _qos);
@@ -678,14 +753,27 @@ namespace mqtt_protocol{
         ~PublishV3VH() override = default;
     };
 
-    [[nodiscard]] uint8_t ReadVariableInt(int fd, int &value);
+    //the end of buf is not known, nothing past the integer is read; DecodeVarInt when it is
     [[nodiscard]] uint8_t DeCodeVarInt(const uint8_t *buf, uint32_t &value, uint8_t &size);
-    uint8_t               CodeVarInt(uint8_t *buf, uint32_t value, uint8_t &size);
-    [[nodiscard]] uint8_t GetVarIntSize(uint32_t value);
-    [[nodiscard]] std::shared_ptr<MqttProperty> CreateProperty(const uint8_t *buf, uint8_t &size);
+    //avail - bytes left in the packet
+    [[nodiscard]] std::optional<MqttProperty> CreateProperty(const uint8_t *buf, uint32_t &size, uint32_t avail = UINT32_MAX);
     [[nodiscard]] std::shared_ptr<MqttStringEntity> CreateMqttStringEntity(const uint8_t *buf, uint8_t &size);
 
     std::shared_ptr<uint8_t> CreateMqttPacket(uint8_t pack_type, uint32_t &size);
     std::shared_ptr<uint8_t> CreateMqttPacket(uint8_t pack_type, VariableHeader &vh, uint32_t &size);
     std::shared_ptr<uint8_t> CreateMqttPacket(uint8_t pack_type, VariableHeader &vh, const std::shared_ptr<MqttBinaryDataEntity> &message, uint32_t &size);
+
+    //PUBLISH encoded once for all the subscribers of one variant (protocol version, QoS). A subscriber's packet is
+    //data[0, id_offset), its own packet id when QoS > 0, data[id_offset + 2, size) and then the payload if it is
+    //not in data (with_payload false: a large payload is sent from the message buffer).
+    struct EncodedPublish{
+        std::shared_ptr<uint8_t> data;
+        uint32_t size{0};
+        uint32_t id_offset{0};      //size when QoS 0, the packet id bytes are zero
+        bool with_payload{true};
+    };
+
+    [[nodiscard]] EncodedPublish EncodePublish(uint8_t version, uint8_t qos, const std::string& topic_name, const std::shared_ptr<MqttBinaryDataEntity> &message, bool with_payload);
+    //the packet of one subscriber in a buffer of its own
+    std::shared_ptr<uint8_t> CreateMqttPacket(const EncodedPublish &encoded, uint16_t packet_id, const std::shared_ptr<MqttBinaryDataEntity> &message, uint32_t &size);
 }
@@ -0,0 +1,86 @@
+#pragma once
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wignored-attributes"
+
+#include <string_view>
+#include <cstdint>
+
+#include "mqtt_protocol.h"
+
+//Views over a received packet. Reading only checks the bounds and the layout, nothing is copied or
+//allocated: the strings point into the packet buffer and are valid while the buffer is. Whatever has to
+//outlive the packet (a subscription, a client id, a retained message) is copied by its owner.
+namespace mqtt_protocol{
+    //one property, the numeric types are in value, the strings and the binary data in str
+    struct PropertyView{
+        uint8_t id{0};
+        uint8_t type{mqtt_data_type::undefined};
+        uint32_t value{0};
+        std::string_view str;       //mqtt_string, binary_data, the name of a mqtt_string_pair
+        std::string_view str2;      //the value of a mqtt_string_pair
+    };
+
+    //buf points at the length of the string, avail - bytes left in the packet
+    [[nodiscard]] int ReadString(const uint8_t* buf, uint32_t avail, std::string_view& str, uint32_t& size);
+    [[nodiscard]] int ReadProperty(const uint8_t* buf, uint32_t avail, PropertyView& property, uint32_t& size);
+
+    class PropertiesView{
+    private:
+        const uint8_t* data{nullptr};
+        uint32_t len{0};
+        uint32_t count{0};
+
+    public:
+        //buf points at the property length, size is the whole block with its length;
+        //a property not allowed in the packet type fails with mqtt_property_err
+        [[nodiscard]] int Read(const uint8_t* buf, uint32_t avail, uint32_t& size, uint8_t packet);
+
+        [[nodiscard]] bool Find(uint8_t id, PropertyView& property) const;
+        [[nodiscard]] uint32_t Count() const noexcept;
+
+        //f(const PropertyView&), the block is already validated by Read()
+        template <class F>
+        void ForEach(F&& f) const {
+            PropertyView property;
+            for(uint32_t offset = 0, size = 0; offset < len; offset += size){
+                if (ReadProperty(data + offset, len - offset, property, size) != mqtt_err::ok) return;
+                f(property);
+            }
+        }
+    };
+
+    class PublishView{
+    public:
+        std::string_view topic;
+        uint16_t packet_id{0};
+        PropertiesView properties;
+        uint32_t payload_offset{0};
+        uint32_t payload_len{0};
+
+        [[nodiscard]] int Read(const FixedHeader& fh, const uint8_t* buf, uint8_t version);
+    };
+
+    //SUBSCRIBE and UNSUBSCRIBE, the topic filters follow the properties
+    class SubscribeView{
+    private:
+        const uint8_t* filters{nullptr};
+        uint32_t len{0};
+        bool options{true};
+
+    public:
+        uint16_t packet_id{0};
+        PropertiesView properties;
+
+        [[nodiscard]] int Read(const FixedHeader& fh, const uint8_t* buf, uint8_t version);
+
+        //f(std::string_view filter, uint8_t options), options are 0 for UNSUBSCRIBE
+        template <class F>
+        void ForEach(F&& f) const {
+            std::string_view filter;
+            for(uint32_t offset = 0, size = 0; offset < len; offset += size + options){
+                if (ReadString(filters + offset, len - offset, filter, size) != mqtt_err::ok) return;
+                f(filter, options ? filters[offset + size] : uint8_t(0));
+            }
+        }
+    };
+}
@@ -0,0 +1,157 @@
+#pragma once
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wignored-attributes"
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <ctime>
+#include <sys/uio.h>
+
+#include "mpsc_queue.h"
+#include "send_pool.h"
+
+#define OUTBOUND_MAX_IOV        64
+#define OUTBOUND_FLUSH_LIMIT    (1024 * 1024)   //bytes per connection and flush, the rest goes to the end of the line
+#define OUTBOUND_ZEROCOPY_LINGER    30          //seconds a closed socket waits for zero-copy completions, then it is reset
+
+enum class outbound_status : uint8_t {
+    drained,
+    more,
+    blocked,
+    error,
+    closed
+};
+
+enum class overflow_policy : uint8_t {
+    drop_oldest_qos0,
+    drop_newest,
+    disconnect
+};
+
+enum class push_status : uint8_t {
+    queued,
+    scheduled,
+    dropped,
+    overflow
+};
+
+//One piece of a packet handed to Push: a shared buffer, or bytes copied into the queue (data == nullptr),
+//which take no allocation up to SEND_INLINE_SIZE
+struct OutboundPiece{
+    std::shared_ptr<uint8_t> data;
+    const uint8_t* bytes{nullptr};
+    uint32_t len{0};
+    bool zerocopy{false};       //sent with MSG_ZEROCOPY when the connection has it on
+};
+
+//Bounds of one connection queue, 0 - unlimited
+struct QueueLimits{
+    size_t max_bytes{0};
+    size_t max_messages{0};
+    overflow_policy policy{overflow_policy::drop_oldest_qos0};
+};
+
+//Global limits with overrides per topic prefix, the longest matching prefix wins
+class QueueLimitTable{
+private:
+    QueueLimits global;
+    std::vector<std::pair<std::string, QueueLimits>> prefixes;
+
+public:
+    void SetGlobal(const QueueLimits& limits) noexcept;
+    void AddPrefix(const std::string& prefix, const QueueLimits& limits);
+    [[nodiscard]] const QueueLimits& Find(const std::string& topic_name) const noexcept;
+    [[nodiscard]] const QueueLimits& GetGlobal() const noexcept;
+};
+
+struct OutboundDepth{
+    size_t bytes;
+    size_t messages;
+    uint64_t dropped;
+};
+
+//Buffers handed to the kernel by a MSG_ZEROCOPY send, kept until the error queue reports the send completed
+struct ZerocopyPin{
+    uint32_t seq;
+    uint32_t bytes;
+    std::shared_ptr<uint8_t> data;
+};
+
+struct ZerocopyStats{
+    std::atomic<uint64_t> sent{0};          //bytes passed with MSG_ZEROCOPY
+    std::atomic<uint64_t> avoided{0};       //completed without a copy
+    std::atomic<uint64_t> copied{0};        //the kernel fell back to copying (e.g. loopback)
+};
+
+//Bytes waiting to be written to one connection. Producers append from any thread, only one sender
+//flushes a queue at a time (the scheduled flag). When the socket would block the queue is parked
+//until the owning shard reports the fd writable.
+class OutboundQueue : public MpscNode {
+private:
+    SendDescriptor* front{nullptr};     //a descriptor per piece, a PUBLISH mostly points into bytes shared by all subscribers
+    SendDescriptor* back{nullptr};
+    size_t bytes{0};
+    size_t messages{0};
+    bool in_message{false};     //the front packet is partially written
+    bool scheduled{false};
+    bool blocked{false};
+    bool closed{false};
+    bool aborted{false};
+    uint64_t dropped{0};
+
+    ZerocopyStats* zc_stats{nullptr};   //nullptr - SO_ZEROCOPY is off
+    std::deque<ZerocopyPin> zc_pins;
+    uint32_t zc_seq{0};
+    int zc_fd{-1};                      //duplicate keeping a closed socket until its pins are released
+    time_t zc_deadline{0};
+
+    [[nodiscard]] bool Fits(const QueueLimits& limits, uint32_t len) const noexcept;
+    void Append(OutboundPiece& piece, bool droppable, bool last);
+    void Erase(SendDescriptor* prev, SendDescriptor* end);
+    bool Enqueue(OutboundPiece* pieces, unsigned int count, bool droppable);
+    void Release(uint32_t lo, uint32_t hi, bool copied);
+
+public:
+    const int fd;
+    const unsigned int owner;
+    const unsigned int sender;      //the only sender thread writing this connection
+    std::mutex mtx;
+    std::shared_ptr<OutboundQueue> ready_ref;   //keeps the queue alive while it is linked in a sender list
+
+    OutboundQueue(int _fd, unsigned int _owner, unsigned int _sender = 0) : fd(_fd), owner(_owner), sender(_sender) {}
+    OutboundQueue(const OutboundQueue&)             = delete;
+    OutboundQueue& operator=(const OutboundQueue&)  = delete;
+    ~OutboundQueue();
+
+    bool Push(std::shared_ptr<uint8_t> data, uint32_t len);
+    //copies up to SEND_INLINE_SIZE bytes into the queue, no allocation
+    bool Push(const uint8_t* data, uint32_t len);
+    push_status Push(std::shared_ptr<uint8_t> data, uint32_t len, const QueueLimits& limits, bool droppable, size_t& evicted,
+                     std::shared_ptr<uint8_t> payload = nullptr, uint32_t payload_len = 0);
+    //the pieces are one packet, evicted and sent as a whole
+    push_status Push(OutboundPiece* pieces, unsigned int count, const QueueLimits& limits, bool droppable, size_t& evicted);
+    bool Abort(std::shared_ptr<uint8_t> data, uint32_t len, bool& wake);
+    bool Wake();
+    bool Close();
+    bool EnableZerocopy(ZerocopyStats* stats);
+    void Reap();
+    bool Linger(time_t now);
+    OutboundDepth GetDepth();
+
+    //the methods below are called with mtx held
+    unsigned int Gather(struct iovec* iov, unsigned int max_iov, bool& zerocopy) const;
+    void Pin(unsigned int count, size_t sent);
+    void ReapLocked();
+    void Consume(size_t size);
+    outbound_status WriteV(size_t limit);
+    outbound_status Finish(outbound_status status);
+    [[nodiscard]] bool      isEmpty() const noexcept;
+    [[nodiscard]] bool      isClosed() const noexcept;
+    [[nodiscard]] bool      isPinned() const noexcept;
+    [[nodiscard]] size_t    GetBytes() const noexcept;
+};
@@ -0,0 +1,37 @@
+#pragma once
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wignored-attributes"
+
+#include <vector>
+#include <cstdint>
+#include <sys/epoll.h>
+
+#define DEFAULT_REACTOR_EVENTS  1024
+
+//epoll based event loop. Descriptors are registered once and stay in the kernel interest list until Del(),
+//so connect/disconnect cost does not depend on the number of connections.
+class Reactor{
+private:
+    int epoll_fd;
+    bool edge_triggered;
+    uint32_t mode_flags;
+    std::vector<struct epoll_event> events;
+
+public:
+    explicit Reactor(bool _edge_triggered, unsigned int max_events = DEFAULT_REACTOR_EVENTS);
+    Reactor(const Reactor&)             = delete;
+    Reactor& operator=(const Reactor&)  = delete;
+    ~Reactor();
+
+    bool Add(int fd, uint32_t _events = EPOLLIN);
+    bool AddListener(int fd);
+    bool Modify(int fd, uint32_t _events);
+    void Del(int fd);
+    int  Wait(int timeout_ms);
+
+    [[nodiscard]] int       GetFd(int index) const noexcept;
+    [[nodiscard]] int       GetEpollFd() const noexcept;
+    [[nodiscard]] uint32_t  GetEvents(int index) const noexcept;
+    [[nodiscard]] bool      isEdgeTriggered() const noexcept;
+    [[nodiscard]] bool      isValid() const noexcept;
+};
@@ -0,0 +1,52 @@
+#pragma once
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wignored-attributes"
+
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+#include "mpsc_queue.h"
+
+#define SEND_POOL_CAPACITY  4096    //descriptors per thread, more are taken from the heap
+#define SEND_INLINE_SIZE    8       //small control packets are copied into the descriptor
+
+class SendPool;
+
+//One piece of a queued packet: a whole packet, or the head or the shared payload of a PUBLISH.
+//Linked into the outbound queue of a connection and returned to the pool of the thread that allocated it.
+struct SendDescriptor : public MpscNode {
+    SendDescriptor* next{nullptr};
+    SendPool* pool{nullptr};        //nullptr - allocated from the heap
+    std::shared_ptr<uint8_t> data;  //nullptr - the bytes are inline
+    uint8_t inline_bytes[SEND_INLINE_SIZE];
+    uint32_t len{0};
+    uint32_t offset{0};
+    bool droppable{false};          //QoS 0 PUBLISH
+    bool last{true};                //last piece of the packet
+    bool zerocopy{false};           //large payload, sent with MSG_ZEROCOPY
+
+    [[nodiscard]] uint8_t* Bytes() noexcept {
+        return data != nullptr ? data.get() : inline_bytes;
+    }
+};
+
+//Fixed capacity of descriptors owned by one thread. Only the owner allocates, so the fast path is a
+//pop from a plain free list. Descriptors freed on another thread (the sender) come back through a
+//lock-free MPSC list, which the owner takes over when its free list runs dry.
+//Pools are never destroyed: a descriptor may outlive the thread that allocated it.
+class SendPool{
+private:
+    std::unique_ptr<SendDescriptor[]> slab;
+    SendDescriptor* free_list{nullptr};
+    MpscQueue<SendDescriptor> remote;
+
+    explicit SendPool(size_t capacity);
+
+public:
+    SendPool(const SendPool&)               = delete;
+    SendPool& operator=(const SendPool&)    = delete;
+
+    static SendDescriptor* Allocate();
+    static void Release(SendDescriptor* desc);
+};
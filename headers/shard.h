@@ -0,0 +1,139 @@
+#pragma once
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wignored-attributes"
+
+#include <memory>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <unordered_map>
+
+#include "reactor.h"
+#include "uring.h"
+#include "spsc_queue.h"
+#include "timer_wheel.h"
+#include "client.h"
+#include "subscriber_cache.h"
+
+#define DEFAULT_MAILBOX_SIZE    4096
+#define SHARD_REPOST_MS         10      //wait limit while io_uring requests are waiting for a free SQE
+
+enum class shard_event_type : uint8_t {
+    none,
+    publish
+};
+
+//tag of the io_uring requests issued by a shard, stored in the upper bits of user_data
+enum class uring_op : uint8_t {
+    none,
+    poll_reactor,
+    recv,
+    cancel
+};
+
+struct ShardEvent{
+    shard_event_type type{shard_event_type::none};
+    int fd{-1};                     //-1 - every local subscriber, otherwise one picked member of a shared group
+    mqtt_protocol::MqttTopic topic;
+    uint64_t conn_id{0};
+    uint8_t options{0};
+};
+
+enum class timer_type : uint8_t {
+    keep_alive,
+    qos_retransmit,
+    will_delay,
+    session_expiry
+};
+
+//The connection timers hold the client weakly, the will and session timers outlive the connection
+struct ShardTimer{
+    timer_type type;
+    int fd{-1};
+    std::weak_ptr<Client> client;
+    std::string client_id{};
+    mqtt_protocol::MqttTopic will{};
+    uint64_t session_gen{0};        //a will or session timer armed before the id was claimed again is stale
+};
+
+class Shard;
+
+//Producer side of the shard mailboxes. Every thread that posts events owns exactly one writer, so each
+//(producer, shard) pair maps to one SPSC ring. Events that do not fit are kept in a local backlog and
+//retried in order, a full mailbox never blocks the producer.
+class MailboxWriter{
+private:
+    unsigned int producer_id;
+    std::vector<std::deque<ShardEvent>> backlog;
+
+public:
+    MailboxWriter(unsigned int _producer_id, unsigned int shard_count);
+
+    void Send(Shard& dst, ShardEvent&& event);
+    void Flush(std::vector<std::unique_ptr<Shard>>& shards);
+    [[nodiscard]] unsigned int GetProducerId() const noexcept;
+};
+
+//One reactor thread. A shard owns the connections it was given: only its thread reads from them,
+//runs their handlers and walks its local client map.
+//In io_uring mode the client sockets are read with multishot recv and the reactor is left with the wake
+//and control descriptors; the epoll fd itself is polled through the ring.
+class Shard{
+private:
+    unsigned int id;
+    int wake_fd;
+    std::atomic<bool> sleeping{false};
+    std::vector<std::unique_ptr<SpscQueue<ShardEvent>>> inbox;
+
+    //the generation tells a stale completion of a closed fd from the one of a reused fd number
+    std::unordered_map<int, uint32_t> recv_gen;
+    uint32_t next_gen{0};
+    //requests that found the submission queue full, they are posted again before the next wait
+    std::vector<uint64_t> unposted;
+
+    [[nodiscard]] bool HasMail() const;
+    void PostRequest(uint64_t user_data);
+    void RepostRequests();
+
+public:
+    Reactor reactor;
+    MailboxWriter writer;
+    std::unordered_map<int, std::shared_ptr<Client>> clients;
+    std::unique_ptr<Uring> uring;
+    TimerWheel<ShardTimer> timers;
+    SubscriberCache subscriber_cache;
+
+    Shard(unsigned int _id, unsigned int shard_count, unsigned int producer_count, bool edge_triggered);
+    Shard(const Shard&)             = delete;
+    Shard& operator=(const Shard&)  = delete;
+    ~Shard();
+
+    bool Post(unsigned int producer, ShardEvent&& event);
+    void Wake();
+    int  Wait(int timeout_ms);
+    void ClearWake();
+
+    bool EnableUring(bool sqpoll);
+    void ArmReactorPoll();
+    void AttachRecv(int fd);
+    void RearmRecv(int fd);
+    void DetachRecv(int fd);
+    bool WantWrite(int fd, bool on);
+    [[nodiscard]] bool isCurrentRecv(uint64_t user_data) const;
+
+    static uint64_t MakeUserData(uring_op op, uint32_t gen, int fd) noexcept;
+    static uring_op GetUringOp(uint64_t user_data) noexcept;
+    static int      GetUringFd(uint64_t user_data) noexcept;
+
+    template <class F>
+    void Drain(F&& handler){
+        ShardEvent event;
+        for(auto& it : inbox){
+            while (it->Pop(event)) handler(event);
+        }
+    }
+
+    [[nodiscard]] unsigned int  GetId() const noexcept;
+    [[nodiscard]] int           GetWakeFd() const noexcept;
+    [[nodiscard]] bool          isValid() const noexcept;
+};
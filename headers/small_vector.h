@@ -0,0 +1,109 @@
+#pragma once
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wignored-attributes"
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+
+//Vector keeping up to N elements inside the object, it moves to the heap only when it grows past N.
+//Elements keep the order they were added in.
+template <class T, size_t N>
+class SmallVector{
+private:
+    alignas(T) unsigned char storage[N * sizeof(T)];
+    T* items{reinterpret_cast<T*>(storage)};
+    size_t count{0};
+    size_t capacity{N};
+
+    [[nodiscard]] bool isInline() const noexcept {
+        return items == reinterpret_cast<const T*>(storage);
+    }
+
+    void Release() noexcept {
+        Clear();
+        if (!isInline()) std::allocator<T>().deallocate(items, capacity);
+        items = reinterpret_cast<T*>(storage);
+        capacity = N;
+    }
+
+    //takes the elements of other, other is left empty
+    void Take(SmallVector&& other) noexcept {
+        if (other.isInline()){
+            for(size_t i=0; i<other.count; i++) new (items + i) T(std::move(other.items[i]));
+            count = other.count;
+            other.Clear();
+        } else {
+            items = other.items;
+            count = other.count;
+            capacity = other.capacity;
+            other.items = reinterpret_cast<T*>(other.storage);
+            other.count = 0;
+            other.capacity = N;
+        }
+    }
+
+public:
+    SmallVector() noexcept = default;
+    SmallVector(const SmallVector& other){
+        Reserve(other.count);
+        for(const auto& it : other) PushBack(it);
+    }
+    SmallVector(SmallVector&& other) noexcept {
+        Take(std::move(other));
+    }
+    SmallVector& operator=(const SmallVector& other){
+        if (this == &other) return *this;
+        Clear();
+        Reserve(other.count);
+        for(const auto& it : other) PushBack(it);
+        return *this;
+    }
+    SmallVector& operator=(SmallVector&& other) noexcept {
+        if (this == &other) return *this;
+        Release();
+        Take(std::move(other));
+        return *this;
+    }
+    ~SmallVector(){
+        Release();
+    }
+
+    void Reserve(const size_t new_capacity){
+        if (new_capacity <= capacity) return;
+        T* grown = std::allocator<T>().allocate(new_capacity);
+        for(size_t i=0; i<count; i++){
+            new (grown + i) T(std::move(items[i]));
+            items[i].~T();
+        }
+        if (!isInline()) std::allocator<T>().deallocate(items, capacity);
+        items = grown;
+        capacity = new_capacity;
+    }
+
+    template <class... Args>
+    T& EmplaceBack(Args&&... args){
+        if (count == capacity) Reserve(capacity * 2);
+        return *new (items + count++) T(std::forward<Args>(args)...);
+    }
+
+    void PushBack(const T& value){ EmplaceBack(value); }
+    void PushBack(T&& value){ EmplaceBack(std::move(value)); }
+
+    void Clear() noexcept {
+        for(size_t i=0; i<count; i++) items[i].~T();
+        count = 0;
+    }
+
+    [[nodiscard]] size_t Size() const noexcept { return count; }
+    [[nodiscard]] bool Empty() const noexcept { return count == 0; }
+
+    T& operator[](const size_t idx) noexcept { return items[idx]; }
+    const T& operator[](const size_t idx) const noexcept { return items[idx]; }
+
+    T* begin() noexcept { return items; }
+    T* end() noexcept { return items + count; }
+    const T* begin() const noexcept { return items; }
+    const T* end() const noexcept { return items + count; }
+};
@@ -0,0 +1,66 @@
+#pragma once
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wignored-attributes"
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+#include <utility>
+
+#define CACHE_LINE_SIZE     64
+
+//Bounded lock-free single producer / single consumer ring.
+//Exactly one thread may call Push() and exactly one (other) thread may call Pop().
+template <class T>
+class SpscQueue{
+private:
+    std::vector<T> ring;
+    size_t mask;
+
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> head{0};  //next slot to read, written by consumer
+    size_t cached_tail{0};
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail{0};  //next slot to write, written by producer
+    size_t cached_head{0};
+
+    static size_t RoundUp(size_t val){
+        size_t res = 1;
+        while (res < val) res <<= 1;
+        return res;
+    }
+
+public:
+    explicit SpscQueue(size_t capacity) : ring(RoundUp(capacity < 2 ? 2 : capacity)), mask(ring.size() - 1) {}
+    SpscQueue(const SpscQueue&)            = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    bool Push(T&& value){
+        const size_t cur_tail = tail.load(std::memory_order_relaxed);
+        if (cur_tail - cached_head == ring.size()){
+            cached_head = head.load(std::memory_order_acquire);
+            if (cur_tail - cached_head == ring.size()) return false;
+        }
+        ring[cur_tail & mask] = std::move(value);
+        tail.store(cur_tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool Pop(T& value){
+        const size_t cur_head = head.load(std::memory_order_relaxed);
+        if (cur_head == cached_tail){
+            cached_tail = tail.load(std::memory_order_acquire);
+            if (cur_head == cached_tail) return false;
+        }
+        value = std::move(ring[cur_head & mask]);
+        ring[cur_head & mask] = T{};
+        head.store(cur_head + 1, std::memory_order_release);
+        return true;
+    }
+
+    [[nodiscard]] bool Empty() const noexcept {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+
+    [[nodiscard]] size_t Capacity() const noexcept {
+        return ring.size();
+    }
+};
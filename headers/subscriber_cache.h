@@ -0,0 +1,47 @@
+#pragma once
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wignored-attributes"
+
+#include <list>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+#include "topic_trie.h"
+#include "topic_names.h"
+
+#define DEFAULT_SUBSCRIBER_CACHE_SIZE   4096    //topic names per shard
+
+//Resolved subscribers of the recently published topic names, least recently used are evicted first.
+//Entries are keyed by the interned name id and hold the name, so the id is not reused while cached.
+//An entry is valid for the trie generation it was resolved at, any subscription change makes it stale.
+//The group pointers are only used while the trie is still at that generation.
+//Owned by one shard thread, no locking.
+class SubscriberCache{
+public:
+    struct Entry{
+        std::shared_ptr<const TopicName> topic;
+        uint64_t generation{0};
+        std::vector<Subscriber> subscribers;
+        std::vector<const ShareGroup*> groups;
+    };
+
+private:
+    size_t capacity;
+    std::list<Entry> entries;       //most recently used first
+    std::unordered_map<uint32_t, std::list<Entry>::iterator> index;
+    Entry scratch;                  //resolved entry when the cache is off
+
+public:
+    explicit SubscriberCache(size_t _capacity = DEFAULT_SUBSCRIBER_CACHE_SIZE);
+    SubscriberCache(const SubscriberCache&)             = delete;
+    SubscriberCache& operator=(const SubscriberCache&)  = delete;
+
+    void SetCapacity(size_t _capacity);
+    //nullptr when the topic is not cached or its entry is stale
+    const Entry* Find(const TopicName& topic, uint64_t generation);
+    //empty entry to be filled, it replaces a stale one or the least recently used
+    Entry& Insert(const std::shared_ptr<const TopicName>& topic, uint64_t generation);
+    [[nodiscard]] size_t Size() const noexcept;
+};
@@ -0,0 +1,91 @@
+#pragma once
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wignored-attributes"
+
+#include <vector>
+#include <ctime>
+#include <cstddef>
+
+#define TIMER_WHEEL_BITS    6
+#define TIMER_WHEEL_SLOTS   (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS  4       //64^4 seconds, longer deadlines are parked at the top level and re-queued
+
+//Hierarchical timer wheel with one second ticks. Level n slots span 64^n seconds, when the lower level
+//wraps around the next slot of the upper level is cascaded down, so a timer within 64^4 seconds is moved at most LEVELS times
+//and Advance() only touches timers that are due. There is no cancel: the owner checks on expiry whether
+//the timer is still relevant. Not thread safe, every shard owns its wheel.
+template <class T>
+class TimerWheel{
+private:
+    struct Entry{
+        time_t deadline;
+        T value;
+    };
+
+    std::vector<Entry> slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    time_t current{0};      //next tick to process
+    size_t count{0};
+
+    static constexpr time_t LevelSpan(const unsigned int level) noexcept {
+        return time_t(1) << (TIMER_WHEEL_BITS * level);
+    }
+
+    void Place(Entry&& entry){
+        time_t delta = entry.deadline - current;
+        if (delta < 0) delta = 0;
+        if (delta >= LevelSpan(TIMER_WHEEL_LEVELS)) delta = LevelSpan(TIMER_WHEEL_LEVELS) - 1;
+        const time_t tick = current + delta;
+        unsigned int level = 0;
+        while (level < TIMER_WHEEL_LEVELS - 1 && delta >= LevelSpan(level + 1)) level++;
+        slots[level][(tick >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1)].push_back(std::move(entry));
+    }
+
+    void Cascade(const unsigned int level, const unsigned int index){
+        std::vector<Entry> entries;
+        entries.swap(slots[level][index]);
+        for(auto& it : entries) Place(std::move(it));
+    }
+
+public:
+    void Add(const time_t deadline, T value){
+        if (current == 0) current = time(nullptr);
+        count++;
+        Place(Entry{deadline, std::move(value)});
+    }
+
+    //Fires every timer with deadline <= now. The handler may add new timers.
+    template <class F>
+    size_t Advance(const time_t now, F&& handler){
+        if (current == 0) current = now;
+        size_t fired = 0;
+        std::vector<Entry> due;
+        while (current <= now){
+            const unsigned int index = current & (TIMER_WHEEL_SLOTS - 1);
+            if (index == 0){
+                for(unsigned int level = 1; level < TIMER_WHEEL_LEVELS; level++){
+                    const unsigned int upper = (current >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+                    Cascade(level, upper);
+                    if (upper != 0) break;
+                }
+            }
+            due.clear();
+            due.swap(slots[0][index]);
+            current++;
+            for(auto& it : due){
+                //a deadline past the wheel span comes down early, it goes round again
+                if (it.deadline >= current){
+                    Place(std::move(it));
+                    continue;
+                }
+                count--;
+                fired++;
+                handler(it.value);
+            }
+        }
+        return fired;
+    }
+
+    [[nodiscard]] size_t Size() const noexcept {
+        return count;
+    }
+};
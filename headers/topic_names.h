@@ -0,0 +1,51 @@
+#pragma once
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wignored-attributes"
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <shared_mutex>
+#include <unordered_map>
+#include <atomic>
+#include <cstdint>
+
+#define TOPIC_NAMES_STRIPES     16      //independently locked parts of the intern table
+
+//Interned topic name. One instance per distinct name is alive at a time, so the id identifies the name
+//as long as a reference is held and the hash is computed once.
+struct TopicName{
+    std::string name;
+    size_t hash;
+    uint32_t id;
+};
+
+//Intern table of the topic names. Intern() of a known name is a lookup under a shared lock of one
+//stripe and a reference count increment; a name is dropped from the table with its last reference.
+class TopicNames{
+private:
+    struct Entry{
+        std::weak_ptr<const TopicName> name;
+        uint32_t id;
+    };
+    struct Stripe{
+        std::shared_mutex mtx;
+        std::unordered_map<std::string_view, Entry> names;     //keys view the interned strings
+    };
+
+    Stripe stripes[TOPIC_NAMES_STRIPES];
+    std::atomic<uint32_t> id_gen{1};
+
+    TopicNames() = default;
+    static TopicNames& GetInstance();
+    void Release(const TopicName* name) noexcept;
+
+public:
+    TopicNames(const TopicNames&)               = delete;
+    TopicNames& operator=(const TopicNames&)    = delete;
+
+    static std::shared_ptr<const TopicName> Intern(std::string_view name);
+    //nullptr if nothing holds the name
+    static std::shared_ptr<const TopicName> Find(std::string_view name);
+    [[nodiscard]] static size_t Size();
+};
@@ -4,6 +4,7 @@
 
 #include "mqtt_protocol.h"
 #include <shared_mutex>
+#include <unordered_map>
 
 using namespace mqtt_protocol;
 
@@ -15,6 +16,7 @@ public:
     MqttBinaryDataEntity GetStoredValue(const std::string& topic_name, bool& found);
     std::shared_ptr<MqttBinaryDataEntity> GetStoredValuePtr(const std::string& topic_name);
     MqttTopic GetTopic(const std::string& topic_name, bool& found);
+    void GetMatchingTopics(const std::string& filter, std::vector<MqttTopic>& found);
     void DeleteTopicValue(const MqttTopic& _topic);
 
     void AddQoSTopic(const std::string& client_id, const MqttTopic& topic);
@@ -24,7 +26,7 @@ public:
 
 private:
     std::shared_mutex mtx;
-    std::set<MqttTopic> topics;
+    std::unordered_map<uint32_t, MqttTopic> topics;     //retained, by the interned name id
 
     std::shared_mutex qos_mtx;
     std::unordered_multimap<std::string, MqttTopic> qos_2_topics;
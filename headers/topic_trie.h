@@ -0,0 +1,158 @@
+#pragma once
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wignored-attributes"
+
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+
+#define TOPIC_LEVEL_SEPARATOR   '/'
+#define TOPIC_SINGLE_LEVEL      "+"
+#define TOPIC_MULTI_LEVEL       "#"
+#define SHARED_PREFIX           "$share/"
+
+//One subscription of a connection. conn_id tells the connection from a later one that reused the fd.
+struct Subscriber{
+    int fd{-1};
+    unsigned int shard{0};
+    uint64_t conn_id{0};
+    uint8_t options{0};
+    bool shared{false};     //picked from a shared group, delivered as its own copy
+};
+
+//How a shared subscription group picks the member that receives a message
+enum class share_strategy : uint8_t {
+    round_robin,
+    least_inflight,     //fewest packets waiting in the outbound queue
+    sticky_publisher,   //messages of one publisher always go to the same member
+    hash_topic          //messages of one topic always go to the same member
+};
+
+//Members of one $share/{group}/{filter}. A member stays put while the membership does not change,
+//so the hashed strategies keep their mapping until a member joins or leaves.
+struct ShareGroup{
+    std::vector<Subscriber> members;
+    mutable std::atomic<uint32_t> next{0};
+
+    ShareGroup() = default;
+    ShareGroup(const ShareGroup& other) : members(other.members), next(other.next.load(std::memory_order_relaxed)) {}
+    ShareGroup& operator=(const ShareGroup&) = delete;
+
+    //key is the hash of the publisher or of the topic, load(const Subscriber&) is used by least_inflight
+    template <class L>
+    const Subscriber& Pick(const share_strategy strategy, const uint64_t key, L&& load) const {
+        const size_t count = members.size();
+        switch(strategy){
+            case share_strategy::sticky_publisher :
+            case share_strategy::hash_topic :
+                return members[key % count];
+            case share_strategy::least_inflight : {
+                //the scan starts at a rotating member, so idle members share the load
+                const size_t start = next.fetch_add(1, std::memory_order_relaxed) % count;
+                size_t best = start;
+                auto best_load = load(members[start]);
+                for(size_t i = 1; i < count && best_load != 0; i++){
+                    const size_t idx = (start + i) % count;
+                    auto cur = load(members[idx]);
+                    if (cur < best_load){
+                        best = idx;
+                        best_load = cur;
+                    }
+                }
+                return members[best];
+            }
+            default :
+                return members[next.fetch_add(1, std::memory_order_relaxed) % count];
+        }
+    }
+};
+
+//Subscription index by topic level. A filter level is a name, '+' (exactly one level) or '#' (the parent
+//level and everything below, last level only). Topics starting with '$' are not matched by a wildcard
+//in the first level. Matching walks only the branches that can match, so its cost depends on the
+//topic depth and the number of matching subscribers, not on the number of clients.
+//A copy shares all the nodes with the original and a change copies only the nodes on its path, so the
+//owner can publish the changed trie as a new snapshot while readers keep matching the old one.
+//Not thread safe, the owner guards it.
+class TopicTrie{
+private:
+    struct Node{
+        std::map<std::string, std::shared_ptr<Node>, std::less<>> children;
+        std::vector<Subscriber> subscribers;
+        std::map<std::string, std::shared_ptr<ShareGroup>, std::less<>> groups;
+    };
+
+    std::shared_ptr<Node> root{std::make_shared<Node>()};
+    size_t count{0};
+    uint64_t generation{0};     //bumped by every change
+
+    //the node is about to change: a node still shared with another copy is replaced by its own copy
+    template <class T>
+    static T& Own(std::shared_ptr<T>& ptr){
+        if (ptr.use_count() != 1) ptr = std::make_shared<T>(*ptr);
+        return *ptr;
+    }
+
+    template <class F, class G>
+    static void Report(const Node& node, F& handler, G& on_group){
+        for(const auto& it : node.subscribers) handler(it);
+        for(const auto& it : node.groups) on_group(*it.second);
+    }
+
+    template <class F, class G>
+    static void MatchLevel(const Node& node, const std::vector<std::string_view>& levels, size_t level, F& handler, G& on_group){
+        const bool wildcards = level != 0 || levels[0].empty() || levels[0][0] != '$';
+        if (wildcards){
+            auto multi = node.children.find(std::string_view{TOPIC_MULTI_LEVEL});
+            if (multi != node.children.end()) Report(*multi->second, handler, on_group);
+        }
+        if (level == levels.size()){
+            Report(node, handler, on_group);
+            return;
+        }
+        auto exact = node.children.find(levels[level]);
+        if (exact != node.children.end()) MatchLevel(*exact->second, levels, level + 1, handler, on_group);
+        if (wildcards){
+            auto single = node.children.find(std::string_view{TOPIC_SINGLE_LEVEL});
+            if (single != node.children.end()) MatchLevel(*single->second, levels, level + 1, handler, on_group);
+        }
+    }
+
+    static bool Erase(std::shared_ptr<Node>& node, const std::vector<std::string_view>& levels, size_t level, std::string_view group, int fd, uint64_t conn_id);
+
+public:
+    static void Split(std::string_view name, std::vector<std::string_view>& levels);
+    [[nodiscard]] static bool isValidFilter(std::string_view filter);
+    [[nodiscard]] static bool isValidTopic(std::string_view topic);
+    [[nodiscard]] static bool isWildcard(std::string_view filter);
+    [[nodiscard]] static bool Matches(std::string_view filter, std::string_view topic);
+    //splits $share/{group}/{filter}, returns false for a plain filter
+    static bool isShared(std::string_view filter, std::string_view& group, std::string_view& topic_filter);
+
+    //a $share/{group}/{filter} makes the connection a member of the group
+    //returns false if the connection was already subscribed with this filter, its options are replaced
+    bool Subscribe(std::string_view filter, const Subscriber& subscriber);
+    bool Unsubscribe(std::string_view filter, int fd, uint64_t conn_id);
+
+    //calls handler(const Subscriber&) for every subscription matching the topic name and
+    //on_group(const ShareGroup&) for every matching shared group; a connection with several matching
+    //filters is reported once per filter
+    template <class F, class G>
+    void Match(std::string_view topic, F&& handler, G&& on_group) const {
+        std::vector<std::string_view> levels;
+        Split(topic, levels);
+        MatchLevel(*root, levels, 0, handler, on_group);
+    }
+
+    template <class F>
+    void Match(std::string_view topic, F&& handler) const {
+        Match(topic, handler, [](const ShareGroup&){});
+    }
+
+    [[nodiscard]] size_t Size() const noexcept;
+    [[nodiscard]] uint64_t Generation() const noexcept;
+};
@@ -0,0 +1,101 @@
+#pragma once
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wignored-attributes"
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+#define DEFAULT_URING_ENTRIES       1024
+#define DEFAULT_URING_BUF_COUNT     512
+#define DEFAULT_URING_BUF_SIZE      4096
+#define URING_BUF_GROUP             1
+#define URING_DRAIN_ATTEMPTS        10      //waits for the outstanding completions after a failed io_uring_enter()
+#define URING_DRAIN_TIMEOUT_MS      100
+
+//Minimal io_uring wrapper on top of the raw syscalls (no liburing dependency).
+//A ring is not thread safe, every thread uses its own instance.
+class Uring{
+private:
+    int ring_fd;
+    bool sqpoll;
+
+    void*    sq_ptr;
+    size_t   sq_map_size;
+    void*    cq_ptr;
+    size_t   cq_map_size;
+    struct io_uring_sqe* sqes;
+    size_t   sqes_map_size;
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_flags;
+    unsigned* sq_array;
+    unsigned  sq_mask;
+    unsigned  sq_entries;
+    unsigned  sqe_tail;
+
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned  cq_mask;
+    struct io_uring_cqe* cqes;
+
+    //provided buffers for multishot receive
+    struct io_uring_buf_ring* buf_ring;
+    size_t   buf_ring_size;
+    uint8_t* buffers;
+    unsigned buf_count;
+    unsigned buf_size;
+    uint16_t buf_ring_tail;
+
+    static std::atomic<uint64_t> sqe_full;
+
+    int Enter(unsigned to_submit, unsigned min_complete, unsigned flags, int timeout_ms);
+    unsigned FlushSq();
+
+public:
+    explicit Uring(unsigned entries = DEFAULT_URING_ENTRIES, bool _sqpoll = false);
+    Uring(const Uring&)             = delete;
+    Uring& operator=(const Uring&)  = delete;
+    ~Uring();
+
+    bool SetupBufferRing(unsigned count = DEFAULT_URING_BUF_COUNT, unsigned size = DEFAULT_URING_BUF_SIZE);
+
+    //the Prep functions return false when no SQE is free even after a submit, the request is not queued
+    struct io_uring_sqe* GetSqe();
+    bool PrepRecvMultishot(int fd, uint64_t user_data);
+    bool PrepSendmsg(int fd, const struct msghdr* msg, uint32_t msg_flags, uint64_t user_data);
+    bool PrepPoll(int fd, uint32_t poll_events, uint64_t user_data);
+    bool PrepCancel(uint64_t target_user_data, uint64_t user_data);
+
+    int Submit();
+    int SubmitAndWait(unsigned wait_nr, int timeout_ms);
+
+    template <class F>
+    unsigned ForEachCompletion(F&& handler){
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        unsigned count = 0;
+        while (head != tail){
+            const struct io_uring_cqe& cqe = cqes[head & cq_mask];
+            handler(cqe.user_data, cqe.res, cqe.flags);
+            head++;
+            count++;
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        return count;
+    }
+
+    [[nodiscard]] const uint8_t* GetBuffer(uint16_t bid) const noexcept;
+    void RecycleBuffer(uint16_t bid);
+
+    [[nodiscard]] bool isValid() const noexcept;
+    [[nodiscard]] bool isSqPoll() const noexcept;
+    //requests of every ring that found the submission queue full
+    [[nodiscard]] static uint64_t GetSqeFull() noexcept;
+
+    //creates a throw-away ring and checks that multishot recv with provided buffers works on this kernel
+    static bool Probe(bool sqpoll);
+};
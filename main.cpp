@@ -33,29 +33,25 @@ int main() {
     broker.SetPort(cfg_data.port);
     broker.InitLogger(cfg_data.log_file_path, cfg_data.log_max_size, cfg_data.log_max_files, cfg_data.level);
     broker.SetEraseOldValues(false);
-
-    int sock_fd = broker.InitSocket();
-    if (sock_fd <= 0) exit(0);
+    broker.SetQueueLimits(cfg_data.outbound_limits, cfg_data.topic_limits);
+    broker.SetZerocopyThreshold(cfg_data.zerocopy_threshold);
+    broker.SetShareStrategy(cfg_data.shared_strategy);
+    broker.SetSubscriberCacheSize(cfg_data.subscriber_cache_size);
+    broker.SetSenderCount(cfg_data.writers);
+
+    if (broker.InitShards(cfg_data.shards, cfg_data.edge_triggered, cfg_data.backend, cfg_data.io_uring_sqpoll) != broker_err::ok) exit(0);
+    if (broker.InitListeners(cfg_data.listeners) != broker_err::ok) exit(0);
     broker.InitControlSocket(cfg_data.control_socket_path);
 
 	signal(SIGPIPE, SIG_IGN);
 
+    //connections are accepted by the shard threads
+    broker.Start();
+    lg->info("Waiting for clients..."); lg->flush();
     while (true){
-        lg->info("Waiting for a client..."); lg->flush();
-        char ip[16];
-        auto newsock_fd = broker.WaitForClient(ip);
-        if(newsock_fd > 0) {
-            lg->info("New client has connected: {}", ip);
-            broker_err status = broker.AddClient(newsock_fd, ip);
-            if (status != broker_err::ok) {
-                lg->error("Insertion error, close connection");
-                close(newsock_fd);
-                continue;
-            }
-            lg->info("New client has been added: fd:{}", newsock_fd);
-            if (broker.GetState() == broker_states::init) broker.Start();
-        }
-        lg->flush();
+        this_thread::sleep_for(chrono::seconds(1));
+        broker.SampleMetrics();
+        broker.ReapLingering(time(nullptr));
     }
     return EXIT_FAILURE;
 }
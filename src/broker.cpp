@@ -5,12 +5,17 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/ioctl.h> 
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <algorithm>
 
 #include "mqtt_broker.h"
 
 using namespace std;
 using namespace mqtt_pack_type;
 
+thread_local Shard* Broker::current_shard = nullptr;
+
 vector<string> pack_type_names{"RESERVED", "CONNECT", "CONNACK", "PUBLISH", "PUBACK", "PUBREC", "PUBREL", "PUBCOMP", "SUBSCRIBE", "SUBACK",
                                "UNSUBSCRIBE", "UNSUBACK", "PINGREQ", "PINGRESP", "DISCONNECT", "AUTH"};
 
@@ -19,178 +24,362 @@ vector<string> pack_type_names{"RESERVED", "CONNECT", "CONNACK", "PUBLISH", "PUB
     broker.lg->debug("Start Sender Thread {}", id);
 
     while(true){      
-		broker.Execute();
+		broker.Execute(id);
 		broker.lg->trace("Sender Thread {} executed", id);  
 		broker.lg->flush(); 
     }
 }
 
-[[noreturn]] void Broker::QoSThread(){
+void Broker::ServerThread(const unsigned int shard_id){
     Broker& broker = Broker::GetInstance();
-    broker.lg->debug("Start QoSThread{}");
+    Shard& shard = *broker.shards[shard_id];
+    current_shard = &shard;
+    broker.lg->debug("Start ServerThread shard:{}", shard_id);
+    broker.SetState(broker_states::wait_state);
+    while(true){
+        broker.lg->trace("state wait"); broker.lg->flush();
+        int ready = shard.Wait(1000);
+        if (ready == -1){
+            broker.lg->critical("epoll_wait error: {}", strerror(errno)); broker.lg->flush();
+            //the completion queue still has to be reaped
+            if (!shard.uring){
+                sleep(1);
+                continue;
+            }
+        }
+        unordered_set<int> fd_to_delete;
+        time_t current_time;
+        time(&current_time);
+        if (shard.uring) broker.HandleCompletions(shard, current_time, fd_to_delete);
+        else             broker.HandleReactorEvents(shard, ready, current_time, fd_to_delete);
+        shard.Drain([&broker, &shard](ShardEvent& event){ broker.HandleShardEvent(shard, event); });
+        broker.HandleTimers(shard, current_time, fd_to_delete);
+        if (!fd_to_delete.empty()){
+            broker.lg->warn("close connections"); broker.lg->flush();
+            for(const auto &it : fd_to_delete){
+                auto pClient = broker.GetClient(it);
+                broker.lg->warn("close connection fd:{} ID:{}", it, pClient ? pClient->GetID() : string{}); broker.lg->flush();
+                broker.CloseConnection(it);
+            }
+        }
+        shard.writer.Flush(broker.shards);
+        broker.lg->flush();
+    }
+}
 
-    shared_lock lock(broker.qos_mutex, std::defer_lock);
-    map<int, string> clients_id_map;
+void Broker::HandleReactorEvents(Shard& shard, const int ready, const time_t current_time, unordered_set<int>& fd_to_delete){
+    for(int i=0; i<ready; i++) {
+        int fd = shard.reactor.GetFd(i);
+        uint32_t events = shard.reactor.GetEvents(i);
+        if (fd == shard.GetWakeFd()){
+            shard.ClearWake();
+            continue;
+        }
+        if (fd == control_sock){
+            if (events & EPOLLIN) HandleControlCommand();
+            continue;
+        }
+        auto it_cli = shard.clients.find(fd);
+        if (it_cli == shard.clients.end()){
+            auto listener = FindListener(fd);
+            if (listener != nullptr) AcceptClients(shard, *listener);
+            continue;
+        }
+        auto pClient = it_cli->second;
 
-    while(true){
-        broker.lg->trace("QoSThread execute"); broker.lg->flush();
-        if (!broker.postponed_events.empty()){
-            clients_id_map.clear();
-            lock.lock();
-
-            shared_lock lock_2{broker.clients_mtx};
-            for(const auto &it : broker.clients){
-                clients_id_map.insert(make_pair(it.first, it.second->GetID()));
+        //write interest is dropped before the queue is handed to a sender, which may re-arm it
+        if (events & EPOLLOUT){
+            shard.WantWrite(fd, false);
+            OnWritable(fd);
+        }
+        //completions of zero-copy sends are reported through the error queue, a real error stays in SO_ERROR
+        if ((events & EPOLLERR) && zerocopy_threshold != 0){
+            ReapOutbound(fd);
+            int err = 0;
+            socklen_t err_len = sizeof(err);
+            if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) == 0 && err == 0){
+                events &= ~uint32_t(EPOLLERR);
+            } else {
+                DropConnection(fd, pClient, err, fd_to_delete);
+                continue;
+            }
+        }
+        if (shard.uring) continue;
+
+        if (events & EPOLLIN) {
+            lg->debug("Have data"); lg->flush();
+            pClient->SetPacketLastTime(current_time);
+            //in edge-triggered mode there is no new notification for already buffered data, so drain the socket
+            auto status = pClient->decoder.ReadFrom(fd, shard.reactor.isEdgeTriggered());
+            if (!HandleReceived(fd, pClient)){
+                fd_to_delete.insert(fd);
+                continue;
             }
-            lock_2.unlock();
+            if (status == decoder_status::closed)        DropConnection(fd, pClient, 0, fd_to_delete);
+            else if (status == decoder_status::read_err) DropConnection(fd, pClient, errno, fd_to_delete);
+        } else if (events & (EPOLLHUP | EPOLLERR | EPOLLRDHUP)) {
+            DropConnection(fd, pClient, 0, fd_to_delete);
+        }
+    }
+}
 
-            for(const auto& it : clients_id_map){
-                auto it_cli = broker.postponed_events.find(it.second);
-                if (it_cli != broker.postponed_events.end() && !it_cli->second.empty()){
-                    broker.AddCommand(it.first, tuple{it_cli->second.front().data_len, it_cli->second.front().pData});
+void Broker::HandleCompletions(Shard& shard, const time_t current_time, unordered_set<int>& fd_to_delete){
+    Uring& ring = *shard.uring;
+    bool reactor_ready = false;
+    unordered_set<int> have_data;
+    unordered_map<int, int32_t> closed;
+
+    ring.ForEachCompletion([&](uint64_t user_data, int32_t res, uint32_t flags){
+        switch (Shard::GetUringOp(user_data)){
+            case uring_op::poll_reactor : reactor_ready = true; return;
+            case uring_op::recv : break;
+            default : return;
+        }
+        const int fd = Shard::GetUringFd(user_data);
+        const bool current = shard.isCurrentRecv(user_data) && closed.count(fd) == 0;
+        if (flags & IORING_CQE_F_BUFFER){
+            const auto bid = static_cast<uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT);
+            if (current && res > 0){
+                auto it_cli = shard.clients.find(fd);
+                if (it_cli != shard.clients.end()){
+                    it_cli->second->decoder.Append(ring.GetBuffer(bid), res);
+                    have_data.insert(fd);
                 }
             }
-            lock.unlock();
-            broker.lg->flush();
+            ring.RecycleBuffer(bid);
+        }
+        if (!current) return;
+
+        if (res > 0 || res == -ENOBUFS){
+            if (!(flags & IORING_CQE_F_MORE)) shard.RearmRecv(fd);
+            return;
+        }
+        closed.insert(make_pair(fd, res));
+    });
+
+    for(const auto& fd : have_data){
+        auto it_cli = shard.clients.find(fd);
+        if (it_cli == shard.clients.end()) continue;
+        lg->debug("Have data"); lg->flush();
+        it_cli->second->SetPacketLastTime(current_time);
+        if (!HandleReceived(fd, it_cli->second)) fd_to_delete.insert(fd);
+    }
+
+    //the data received before EOF (e.g. DISCONNECT) is handled first
+    for(const auto& it : closed){
+        if (fd_to_delete.count(it.first)) continue;
+        auto it_cli = shard.clients.find(it.first);
+        if (it_cli == shard.clients.end()) continue;
+        DropConnection(it.first, it_cli->second, -it.second, fd_to_delete);
+    }
+
+    //wake and control descriptors stay in epoll, its fd is polled through the ring
+    if (reactor_ready){
+        int ready = shard.reactor.Wait(0);
+        if (ready > 0) HandleReactorEvents(shard, ready, current_time, fd_to_delete);
+        shard.ArmReactorPoll();
+    }
+}
+
+void Broker::HandleShardEvent(Shard& shard, ShardEvent& event){
+    switch(event.type){
+        case shard_event_type::publish : {
+            //a member picked from a shared group is addressed directly, the rest is matched here
+            static thread_local vector<Subscriber> matched;
+            if (event.fd != -1){
+                matched.assign(1, Subscriber{event.fd, shard.GetId(), event.conn_id, event.options, true});
+            } else {
+                MatchSubscribers(shard, event.topic, matched, nullptr, 0);
+            }
+            NotifyLocalClients(shard, event.topic, matched);
+        }; break;
+
+        default : break;
+    }
+}
+
+//Hands out every complete frame the connection has buffered, a partial tail waits for the next read
+bool Broker::HandleReceived(const int fd, const shared_ptr<Client>& pClient){
+    FixedHeader f_head;
+    shared_ptr<uint8_t> buf;
+    while (true){
+        auto status = pClient->decoder.Next(f_head, buf);
+        if (status == decoder_status::need_more) return true;
+        if (status != decoder_status::ok){
+            lg->error("Mqtt protocol error. Can't read FixedHeader. status:{}", static_cast<int>(broker_err::mqtt_err));
+            PublishWill(pClient);
+            return false;
         }
-        this_thread::sleep_for(chrono::seconds(1));
+        if (!DispatchPacket(fd, pClient, f_head, buf)) return false;
     }
 }
 
-void Broker::ServerThread(){
-    Broker& broker = Broker::GetInstance();
-    broker.lg->debug("Start ServerThread");
-    vector<struct pollfd> vec_fds;
-    while(true){
-        switch (broker.state){
-            case broker_states::started : {
-                broker.lg->debug("state started"); broker.lg->flush();
-                vec_fds.clear();
-                vec_fds.reserve(50);
-                uint32_t client_num = broker.GetClientCount();
-                if (client_num == 0){
-                    broker.SetState(broker_states::init);
-                    broker.lg->info("Stop ServerThread");
-                    broker.Execute();
-                    return;
-                }
-                client_num++; // for control socket
-                for(auto const &it : broker.clients){
-                    struct pollfd tmp_fd{it.first, POLLIN, 0};
-                    vec_fds.push_back(tmp_fd);
-                }
-                struct pollfd tmp_fd_control{broker.control_sock, POLLIN, 0};
-                vec_fds.push_back(tmp_fd_control);
-                broker.SetState(broker_states::wait_state);
-                broker.lg->info("Current fds: {}", vec_fds.size()); broker.lg->flush();
-            }; break;
+void Broker::DropConnection(const int fd, const shared_ptr<Client>& pClient, const int err, unordered_set<int>& fd_to_delete){
+    if (err == 0) lg->debug("[{}] Client closed socket", pClient->GetID());
+    else          lg->error("[{}] read error fd:{} {}", pClient->GetID(), fd, strerror(err));
+    fd_to_delete.insert(fd);
+    PublishWill(pClient);
+}
 
-            case broker_states::wait_state : {
-                broker.lg->trace("state wait"); broker.lg->flush();
-                int ready;
-                uint32_t client_num = broker.GetClientCount() + 1;
-                ready = poll(vec_fds.data(), client_num, 1000);
-                if (ready == -1){
-                    broker.lg->critical("poll error"); broker.lg->flush();
-                    sleep(1);
-                    broker.SetState(broker_states::started);
-                }
-                list<int> fd_to_delete;
-                time_t current_time;
-                time(&current_time);
-                for(unsigned int i=0; i<client_num; i++) {
-                    if (vec_fds[i].revents != 0) {
-                        if (vec_fds[i].revents & POLLIN) {
-                            vec_fds[i].revents = 0;
-                            if (vec_fds[i].fd == broker.control_sock){
-                                broker.lg->debug("Got control command");
-                                int data_socket = accept(broker.control_sock, nullptr, nullptr);
-                                if (data_socket != -1) {
-                                    char c_buf[16] = "";
-                                    int ret = read(data_socket, c_buf, sizeof(c_buf));
-                                    if (ret > 0) {
-                                        if (!strncmp(c_buf, "ADD", sizeof(c_buf))) {
-                                            broker.lg->debug("add new client, reinit fds");
-                                            broker.SetState(broker_states::started);
-                                            close(data_socket);
-                                            break;
-                                        } else  broker.lg->warn("Ignore command. Unknown command in command socket.");
-                                    } else broker.lg->error("data_socket read error");
-                                    close(data_socket);
-                                } else broker.lg->error("control socket accept error");
-                            } else {
-                                broker.lg->debug("Have data"); broker.lg->flush();
-                                int fd = vec_fds[i].fd;
-                                auto pClient = broker.clients[fd];
-                                pClient->SetPacketLastTime(current_time);
-                                FixedHeader f_head;
-                                broker_err ret = broker.ReadFixedHeader(fd, f_head);
-                                if (ret == broker_err::ok){
-                                    broker.lg->info("[{}] {} <------", pClient->GetIP(), broker.GetControlPacketTypeName(f_head.GetType()));
-                                    shared_ptr<uint8_t> buf(new uint8_t[f_head.remaining_len], default_delete<uint8_t[]>());
-                                    int read_status = ReadData(fd, buf.get(), f_head.remaining_len, 0);
-                                    broker.lg->debug("remaining_len:{}", f_head.remaining_len);
-                                    if (read_status != (int) f_head.remaining_len){
-                                        broker.lg->error("Read error. Read {} bytes instead of {}", read_status, f_head.remaining_len);
-                                        fd_to_delete.push_back(fd);
-                                        continue;
-                                    }
-                                    broker.lg->flush();
-
-                                    int handle_stat = broker.HandlePacket(f_head, buf, &broker, fd);
-                                    if (handle_stat != mqtt_err::ok){
-                                        broker.HandleError(handle_stat, broker, fd);
-                                        fd_to_delete.push_back(fd);
-                                    } else broker.lg->debug("handle_stat OK");
-                                    broker.lg->flush();
-                                } else {
-                                    broker.lg->error("Mqtt protocol error. Can't read FixedHeader. status:{}", static_cast<int>(ret));
-                                    fd_to_delete.push_back(fd);
-                                    if (pClient->isWillFlag()){
-                                        broker.NotifyClients(pClient->will_topic);
-                                    }
-                                }
-                            }
-                        } else {
-                            broker.lg->debug("[{}] Client closed socket", broker.clients[vec_fds[i].fd]->GetID());
-                            fd_to_delete.push_back(vec_fds[i].fd);
-                            auto pClient = broker.clients[vec_fds[i].fd];
-                            if (pClient->isWillFlag()){
-                                broker.NotifyClients(pClient->will_topic);
-                            }
-                        }
-                    } else {
-                        // no data from current socket
-                        int fd = vec_fds[i].fd;
-                        if (fd != broker.control_sock){
-                            auto pClient = broker.clients[fd];
-                            if (current_time - pClient->GetPacketLastTime() >= uint32_t (pClient->GetAlive() + 5)){
-                                broker.lg->warn("[{}] time out, disconnect", pClient->GetIP());
-                                VariableHeader answer_vh{shared_ptr<IVariableHeader>(new DisconnectVH(keep_alive_timeout, MqttPropertyChain()))};
-                                uint32_t answer_size;
-                                broker.AddCommand(fd, tuple{answer_size, CreateMqttPacket(FHBuilder().PacketType(DISCONNECT).Build(), answer_vh, answer_size)});
-                                broker.lg->info("[{}] {} ------>", pClient->GetIP(), broker.GetControlPacketTypeName(DISCONNECT));
-                                fd_to_delete.push_back(fd);
-                                if (pClient->isWillFlag()){
-                                    broker.NotifyClients(pClient->will_topic);
-                                }
-                            }  
-                        }
-                    }
-                }
-                if (!fd_to_delete.empty()){
-					broker.lg->warn("close connections"); broker.lg->flush();
-                    broker.SetState(broker_states::started);
-                    for(const auto &it : fd_to_delete){
-						auto pClient = broker.clients[it];
-						broker.lg->warn("close connection fd:{} ID:{}", it, pClient->GetID()); broker.lg->flush();
-                        broker.CloseConnection(it);
-                    }
-                }
-                broker.Notify();
-                broker.lg->flush();
+bool Broker::DispatchPacket(const int fd, const shared_ptr<Client>& pClient, FixedHeader& f_head, const shared_ptr<uint8_t>& buf){
+    lg->info("[{}] {} <------", pClient->GetIP(), GetControlPacketTypeName(f_head.GetType()));
+    lg->debug("remaining_len:{}", f_head.remaining_len);
+    lg->flush();
+
+    int handle_stat = HandlePacket(f_head, buf, this, fd);
+    if (handle_stat != mqtt_err::ok){
+        HandleError(handle_stat, *this, fd);
+        return false;
+    }
+    lg->debug("handle_stat OK");
+    lg->flush();
+    //a reconnected session or a QoS 2 PUBLISH may leave packets waiting for retransmission
+    const uint8_t type = f_head.GetType();
+    if ((type == CONNECT || type == PUBLISH) && !pClient->retransmit_armed && CheckIfMoreMessages(pClient->GetID())){
+        ArmRetransmit(fd, pClient);
+    }
+    return true;
+}
+
+//Only the timers that are due are visited
+void Broker::HandleTimers(Shard& shard, const time_t current_time, unordered_set<int>& fd_to_delete){
+    shard.timers.Advance(current_time, [&](ShardTimer& timer){
+        switch (timer.type){
+            case timer_type::keep_alive : CheckKeepAlive(shard, timer, current_time, fd_to_delete); break;
+            case timer_type::qos_retransmit : Retransmit(shard, timer, current_time); break;
+            case timer_type::will_delay : {
+                if (!IsSessionCurrent(timer.client_id, timer.session_gen)) lg->debug("[{}] reconnected, will message is cancelled", timer.client_id);
+                else NotifyClients(timer.will, timer.client_id);
             }; break;
+            case timer_type::session_expiry : ExpireSession(timer.client_id, timer.session_gen); break;
         }
+    });
+}
+
+//The keep-alive timer is not moved on every packet: when it fires for an active connection it is
+//re-armed at the deadline computed from the last packet time
+void Broker::CheckKeepAlive(Shard& shard, ShardTimer& timer, const time_t current_time, unordered_set<int>& fd_to_delete){
+    auto pClient = timer.client.lock();
+    auto it_cli = shard.clients.find(timer.fd);
+    if (pClient == nullptr || it_cli == shard.clients.end() || it_cli->second != pClient) return;
+    if (fd_to_delete.count(timer.fd)) return;
+
+    const time_t deadline = pClient->GetPacketLastTime() + pClient->GetAlive() + DEFAULT_KEEP_ALIVE_GRACE;
+    if (current_time < deadline){
+        shard.timers.Add(deadline, std::move(timer));
+        return;
+    }
+    const int fd = timer.fd;
+    lg->warn("[{}] time out, disconnect", pClient->GetIP());
+    VariableHeader answer_vh{shared_ptr<IVariableHeader>(new DisconnectVH(keep_alive_timeout, MqttPropertyChain()))};
+    uint32_t answer_size;
+    AddCommand(fd, tuple{answer_size, CreateMqttPacket(FHBuilder().PacketType(DISCONNECT).Build(), answer_vh, answer_size)});
+    lg->info("[{}] {} ------>", pClient->GetIP(), GetControlPacketTypeName(DISCONNECT));
+    fd_to_delete.insert(fd);
+    PublishWill(pClient);
+}
+
+void Broker::ArmRetransmit(const int fd, const shared_ptr<Client>& pClient){
+    if (current_shard == nullptr || pClient->retransmit_armed) return;
+    pClient->retransmit_armed = true;
+    current_shard->timers.Add(time(nullptr) + DEFAULT_QOS_RETRANSMIT, ShardTimer{timer_type::qos_retransmit, fd, pClient});
+}
+
+//Resends the oldest unacknowledged packet while the client has postponed events
+void Broker::Retransmit(Shard& shard, ShardTimer& timer, const time_t current_time){
+    auto pClient = timer.client.lock();
+    if (pClient == nullptr) return;
+    pClient->retransmit_armed = false;
+    auto it_cli = shard.clients.find(timer.fd);
+    if (it_cli == shard.clients.end() || it_cli->second != pClient) return;
+
+    shared_lock lock{qos_mutex};
+    auto it = postponed_events.find(pClient->GetID());
+    if (it == postponed_events.end() || it->second.empty()) return;
+    AddCommand(timer.fd, tuple{it->second.front().data_len, it->second.front().pData});
+    lock.unlock();
+
+    pClient->retransmit_armed = true;
+    shard.timers.Add(current_time + DEFAULT_QOS_RETRANSMIT, std::move(timer));
+}
+
+//The will is published at once or, with a will delay interval, by a timer unless the client reconnects first
+void Broker::PublishWill(const shared_ptr<Client>& pClient){
+    if (!pClient->isWillFlag()) return;
+    uint32_t delay = 0;
+    if (pClient->GetClientMQTTVersion() == MQTT_VERSION_5){
+        auto property = pClient->will_properties.GetProperty(will_delay_interval);
+        if (property != nullptr) delay = property->GetUint();
+    }
+    if (delay == 0 || current_shard == nullptr){
+        NotifyClients(pClient->will_topic, pClient->GetID());
+        return;
+    }
+    lg->debug("[{}] will message is delayed for {}s", pClient->GetID(), delay);
+    current_shard->timers.Add(time(nullptr) + delay, ShardTimer{timer_type::will_delay, -1, {}, pClient->GetID(), pClient->will_topic, pClient->session_gen});
+}
+
+//Postponed events of a v5 session with a finite expiry interval are dropped when it expires.
+//Without the property (or with 0xFFFFFFFF) the session is kept as before.
+void Broker::ArmSessionExpiry(Shard& shard, const shared_ptr<Client>& pClient){
+    if (pClient->GetClientMQTTVersion() != MQTT_VERSION_5) return;
+    auto property = pClient->conn_properties.GetProperty(session_expiry_interval);
+    if (property == nullptr) return;
+    const uint32_t interval = property->GetUint();
+    if (interval == 0 || interval == UINT32_MAX) return;
+    shard.timers.Add(time(nullptr) + interval, ShardTimer{timer_type::session_expiry, -1, {}, pClient->GetID(), {}, pClient->session_gen});
+}
+
+//The wheel has no cancel: a timer of a connection whose id was claimed again since it was armed is ignored
+bool Broker::IsSessionCurrent(const string& client_id, const uint64_t gen){
+    lock_guard lock{client_id_mtx};
+    if (CheckClientID(client_id)) return false;
+    if (gen == 0) return true;
+    auto it = session_gen.find(client_id);
+    return it != session_gen.end() && it->second == gen;
+}
+
+void Broker::ExpireSession(const string& client_id, const uint64_t gen){
+    if (!IsSessionCurrent(client_id, gen)) return;
+    unique_lock lock{qos_mutex};
+    if (postponed_events.erase(client_id) != 0) lg->info("[{}] session expired", client_id);
+}
+
+void Broker::HandleControlCommand(){
+    broker_err ret = broker_err::ok;
+    while(ret == broker_err::ok){
+        int data_socket = accept(control_sock, nullptr, nullptr);
+        if (data_socket == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) lg->error("control socket accept error");
+            return;
+        }
+        lg->debug("Got control command");
+        char c_buf[16] = "";
+        if (read(data_socket, c_buf, sizeof(c_buf)) > 0){
+            if (strncmp(c_buf, "stats", 5) == 0){
+                string reply = metrics.Format() + "clients:" + to_string(current_clients.load()) + "\n";
+                reply += "zerocopy_sent:"    + to_string(zerocopy_stats.sent.load(memory_order_relaxed)) + "\n";
+                reply += "zerocopy_avoided:" + to_string(zerocopy_stats.avoided.load(memory_order_relaxed)) + "\n";
+                reply += "zerocopy_copied:"  + to_string(zerocopy_stats.copied.load(memory_order_relaxed)) + "\n";
+                reply += "uring_sqe_full:"   + to_string(Uring::GetSqeFull()) + "\n";
+                reply += "subscriptions:"    + to_string(GetSubscriptionCount()) + "\n";
+                if (write(data_socket, reply.data(), reply.size()) < 0) lg->error("data_socket write error");
+            } else if (strncmp(c_buf, "queues", 6) == 0){
+                //per client queue depth: id fd bytes messages dropped
+                string reply;
+                EpochGuard guard;
+                clients.ForEach([this, &reply](const int fd, const ClientEntry& entry){
+                    OutboundDepth depth{};
+                    if (!GetOutboundDepth(fd, depth)) return;
+                    reply += entry.id + " " + to_string(fd) + " " + to_string(depth.bytes) + " " + to_string(depth.messages) + " " + to_string(depth.dropped) + "\n";
+                });
+                if (write(data_socket, reply.data(), reply.size()) < 0) lg->error("data_socket write error");
+            } else lg->warn("Ignore command. Unknown command in command socket.");
+        } else {
+            lg->error("data_socket read error");
+            ret = broker_err::read_err;
+        }
+        close(data_socket);
     }
 }
 
@@ -212,30 +401,73 @@ Broker::Broker() : Commands(), current_clients(0), state(0), control_sock(-1), p
     AddErrorHandler(make_shared<MqttDuplicateIDErr>());
 }
 
-broker_err Broker::AddClient(int sock, const string &_ip){
-    current_clients++;
+//Drains the listen queue. The batch is limited so a reconnect storm does not starve the shard's
+//established connections, the level-triggered listener reports the rest on the next wakeup.
+void Broker::AcceptClients(Shard& shard, const Listener& listener){
+    uint64_t accepted = 0;
+    for(unsigned int i=0; i<DEFAULT_ACCEPT_BATCH; i++){
+        struct sockaddr_storage cli_addr;
+        socklen_t c_len = sizeof(cli_addr);
+        int newsock_fd = accept4(listener.GetFd(), (struct sockaddr *) &cli_addr, &c_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (newsock_fd < 0){
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            lg->error("Error accept socket: {}", strerror(errno));
+            metrics.accept_errors.fetch_add(1, memory_order_relaxed);
+            break;
+        }
+        char ip[INET6_ADDRSTRLEN] = "";
+        if (cli_addr.ss_family == AF_INET6) inet_ntop(AF_INET6, &((struct sockaddr_in6*) &cli_addr)->sin6_addr, ip, sizeof(ip));
+        else                                inet_ntop(AF_INET, &((struct sockaddr_in*) &cli_addr)->sin_addr, ip, sizeof(ip));
+        lg->info("New client has connected: {}", ip);
+        //the listener already reported the options the kernel refuses
+        listener.Tune(newsock_fd, false);
+        if (AddClient(shard, newsock_fd, ip) != broker_err::ok){
+            lg->error("Insertion error, close connection");
+            close(newsock_fd);
+            continue;
+        }
+        accepted++;
+        lg->info("New client has been added: fd:{} shard:{}", newsock_fd, shard.GetId());
+    }
+    if (accepted > 0) metrics.accepted.fetch_add(accepted, memory_order_relaxed);
+}
+
+//The accepting shard owns the connection: it is registered in its reactor (or ring) right away
+broker_err Broker::AddClient(Shard& shard, const int sock, const string &_ip){
     shared_ptr<Client> new_client = std::make_shared<Client>(_ip);
 
-    unique_lock lock{clients_mtx};
-    auto ret = clients.insert(make_pair(sock, new_client));
-    lock.unlock();
+    if (!clients.Insert(sock, ClientEntry{new_client, {}})) return broker_err::add_error;
 
-    if (ret.second == true) {
-        if (state == broker_states::wait_state) SendCommand("ADD", 3);
-        return broker_err::ok;
-    } else return broker_err::add_error;
+    current_clients++;
+    shard.clients.insert(make_pair(sock, new_client));
+    shard.timers.Add(new_client->GetPacketLastTime() + new_client->GetAlive() + DEFAULT_KEEP_ALIVE_GRACE, ShardTimer{timer_type::keep_alive, sock, new_client});
+    //in io_uring mode the fd stays in epoll only to report writability
+    if (!shard.reactor.Add(sock, shard.uring ? 0u : uint32_t(EPOLLIN))){
+        lg->error("Can't register fd:{} in reactor: {}", sock, strerror(errno));
+        shard.clients.erase(sock);
+        DelClient(sock);
+        return broker_err::add_error;
+    }
+    if (shard.uring) shard.AttachRecv(sock);
+    OpenOutbound(sock, shard.GetId());
+    return broker_err::ok;
 }
 
 void Broker::DelClient(int sock){
     lg->debug("DelClient fd:{}", sock); lg->flush();
     current_clients--;
+    clients.Erase(sock);
+}
 
-    unique_lock lock{clients_mtx};
-    clients.erase(sock);
+shared_ptr<Client> Broker::GetClient(const int fd){
+    EpochGuard guard;
+    auto entry = clients.Find(fd);
+    return entry != nullptr ? entry->client : nullptr;
 }
 
 uint32_t Broker::GetClientCount() noexcept {
-    return clients.size();
+    return clients.Size();
 }
 
 int Broker::GetState() const noexcept {
@@ -244,19 +476,17 @@ int Broker::GetState() const noexcept {
 
 void Broker::Start() {
     if (state == broker_states::init) {
-        thread thread_broker(ServerThread);
-        thread_broker.detach();
-
         state = broker_states::started;
 
-        if (!qos_thread_started) {
-            qos_thread = std::thread(QoSThread);
-            thread thread1(SenderThread, 1);
-            thread thread2(SenderThread, 2);
-            thread1.detach();
-            thread2.detach();
+        for(unsigned int i=0; i<shards.size(); i++){
+            thread thread_broker(ServerThread, i);
+            thread_broker.detach();
+        }
+
+        if (!senders_started) {
+            for(unsigned int i=0; i<GetSenderCount(); i++) thread(SenderThread, i).detach();
 
-            qos_thread_started = true;
+            senders_started = true;
         }
         lg->debug("Broker has started {}");
     } else {
@@ -269,11 +499,39 @@ void Broker::SetState(int _state) noexcept {
     state = _state;
 }
 
+broker_err Broker::InitShards(unsigned int count, const bool edge_triggered, io_backend backend, const bool sqpoll){
+    if (backend == io_backend::io_uring && !Uring::Probe(sqpoll)){
+        lg->warn("io_uring multishot recv is not supported by the kernel, fall back to epoll");
+        backend = io_backend::epoll;
+    }
+    if (count == 0) count = max(1u, thread::hardware_concurrency());
+    shards.clear();
+    for(unsigned int i=0; i<count; i++){
+        shards.push_back(make_unique<Shard>(i, count, count, edge_triggered));
+        if (!shards.back()->isValid()){
+            lg->error("Error creating shard {}: {}", i, strerror(errno));
+            return broker_err::sock_create_err;
+        }
+        shards.back()->subscriber_cache.SetCapacity(subscriber_cache_size);
+        if (backend == io_backend::io_uring && !shards.back()->EnableUring(sqpoll)){
+            lg->error("Error creating io_uring for shard {}: {}", i, strerror(errno));
+            return broker_err::sock_create_err;
+        }
+    }
+    if (backend == io_backend::io_uring){
+        SetWriter(make_shared<UringWriter>(sqpoll));
+        lg->info("Reactor mode: io_uring{} shards:{}", sqpoll ? " (sqpoll)" : "", count);
+    } else {
+        lg->info("Reactor mode: {} shards:{}", edge_triggered ? "edge-triggered" : "level-triggered", count);
+    }
+    return broker_err::ok;
+}
+
 broker_err Broker::InitControlSocket(const string& sock_path) {
     struct sockaddr_un serv_addr;
     unlink(sock_path.c_str());
     control_sock_path = sock_path;
-    control_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    control_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
     if (control_sock < 0) {
         lg->error("Error opening control socket: {}", strerror(errno));
         return broker_err::sock_create_err;
@@ -289,92 +547,70 @@ broker_err Broker::InitControlSocket(const string& sock_path) {
         lg->error("Error listening control socket: {}", strerror(errno));
         return broker_err::sock_listen_err;
     }
+    if (!shards.front()->reactor.Add(control_sock)){
+        lg->error("Error registering control socket: {}", strerror(errno));
+        return broker_err::add_error;
+    }
     return broker_err::ok;
 }
 
-int Broker::InitSocket(){
-    int sock_fd;
-    struct sockaddr_in serv_addr;
-
-    sock_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock_fd < 0) {
-        lg->error("Error opening socket: {}", strerror(errno));lg->flush();
-        return 0;
-    }
-	int on = 1;
-	ioctl(sock_fd, FIONBIO, &on);
-
-    bzero((char *) &serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = INADDR_ANY;
-    serv_addr.sin_port = htons(port);
-    while(true) {
-        if (bind(sock_fd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
-            lg->error("Error binding socket: {}", strerror(errno)); lg->flush();
-            sleep(5);
-            continue;
+broker_err Broker::InitListeners(const vector<ListenerCfg>& cfg){
+    for(const auto& it : cfg){
+        auto listener = make_unique<Listener>(it);
+        const char* failed_option = nullptr;
+        listener_err ret = listener->Open(failed_option);
+        if (failed_option != nullptr) lg->warn("Listener {}:{} can't set {}: {}", it.address, it.port, failed_option, strerror(errno));
+        switch (ret){
+            case listener_err::ok : break;
+            case listener_err::bind_err : {
+                lg->error("Error binding listener {}:{} {}", it.address, it.port, strerror(errno)); lg->flush();
+                return broker_err::sock_bind_err;
+            };
+            case listener_err::listen_err : {
+                lg->error("Error listening {}:{} {}", it.address, it.port, strerror(errno)); lg->flush();
+                return broker_err::sock_listen_err;
+            };
+            default : {
+                lg->error("Error opening listener {}:{} {}", it.address, it.port, strerror(errno)); lg->flush();
+                return broker_err::sock_create_err;
+            };
         }
-        break;
-    }
-    if (listen(sock_fd, 40) < 0){
-        lg->error("Error listening socket: {}", strerror(errno)); lg->flush();
-        return 0;
+        //every shard waits on the listen socket, a new connection wakes one of them
+        for(auto& shard : shards){
+            if (!shard->reactor.AddListener(listener->GetFd())){
+                lg->error("Error registering listen socket: {}", strerror(errno)); lg->flush();
+                return broker_err::sock_listen_err;
+            }
+        }
+        lg->info("Listening {}:{} backlog:{} defer_accept:{} nodelay:{} quickack:{} sndbuf:{} rcvbuf:{} user_timeout:{} busy_poll:{} fastopen:{}",
+                 it.address, it.port, it.backlog, it.defer_accept, it.tcp_nodelay, it.tcp_quickack, it.sndbuf, it.rcvbuf, it.user_timeout, it.busy_poll, it.fastopen);
+        listeners.push_back(std::move(listener));
     }
-    main_socket = sock_fd;
-    return sock_fd;
+    return listeners.empty() ? broker_err::sock_create_err : broker_err::ok;
 }
 
-int Broker::WaitForClient(char* _ip){
-    struct pollfd fds;
-    fds.fd = main_socket;
-    fds.events = POLLIN;
-
-    struct sockaddr_in cli_addr;
-    socklen_t c_len = sizeof(cli_addr);
-    if (poll(&fds, 1, -1) == -1) {
-        lg->error("Error poll(): {}", strerror(errno));
-        return -1;
+const Listener* Broker::FindListener(const int fd) const noexcept {
+    for(const auto& it : listeners){
+        if (it->GetFd() == fd) return it.get();
     }
-	
-    int newsock_fd = accept(fds.fd, (struct sockaddr *) &cli_addr, &c_len);
-    if (newsock_fd < 0){
-        lg->error("Error accept socket: {}", strerror(errno));
-        return -2;
-    }
-    strcpy(_ip, inet_ntoa(cli_addr.sin_addr));
-    return newsock_fd;
+    return nullptr;
 }
 
-void Broker::SetPort(int _port) noexcept {
-    port = _port;
+void Broker::OnWriteBlocked(const int fd, const unsigned int owner){
+    if (owner < shards.size()) shards[owner]->WantWrite(fd, true);
 }
 
-broker_err Broker::SendCommand(const char *buf, const int buf_size) {
-    struct sockaddr_un addr;
-    int ret;
-
-    int data_socket = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (data_socket == -1) {
-        lg->error("Error opening socket: {}", strerror(errno));
+void Broker::SampleMetrics(){
+    metrics.Sample();
+    Epoch::Reclaim();
+    if (metrics.GetAcceptRate() > 0){
+        lg->info("accepts/sec:{} clients:{}", metrics.GetAcceptRate(), current_clients.load());
+        lg->flush();
     }
-    memset(&addr, 0, sizeof(addr));
-    addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, control_sock_path.c_str(), sizeof(addr.sun_path) - 1);
+}
 
-    ret = connect(data_socket, (const struct sockaddr *) &addr,sizeof(addr));
-    if (ret == -1) {
-        lg->error("Control socket is down: {}", strerror(errno));
-        return broker_err::connect_err;
-    }
-    ret = write(data_socket, buf, buf_size);
-    if (ret == -1) {
-        lg->error("write error: {}", strerror(errno));
-        close(data_socket);
-        return broker_err::write_err;
-    }
-    lg->debug("sent control command: {}", buf);
-    close(data_socket);
-    return broker_err::ok;
+void Broker::SetPort(int _port) noexcept {
+    port = _port;
 }
 
 void    Broker::InitLogger(const string & _path, const size_t  _size, const size_t _max_files, const int _level){
@@ -383,132 +619,268 @@ void    Broker::InitLogger(const string & _path, const size_t  _size, const size
     SetLogLevel(lg, _level);
 }
 
-broker_err Broker::ReadFixedHeader(const int fd, FixedHeader &f_hed){
-    int ret = read(fd, &f_hed.first, 1);
-    if (ret != 1) {
-        lg->error("read error: {} {}", ret, strerror(errno));
-        return broker_err::read_err;
-    }
-    ret = ReadVariableInt(fd, reinterpret_cast<int &>(f_hed.remaining_len));
-    if (ret != mqtt_err::ok){
-        lg->error("read variable value error");
-        if (ret == mqtt_err::read_err) return broker_err::read_err;
-        else                           return broker_err::mqtt_err;
-    }
-    lg->debug("Fixed header type:0x{0:X} len:{1}", f_hed.first, f_hed.remaining_len);
-    return broker_err::ok;
-}
-
 string Broker::GetControlPacketTypeName(const uint8_t _packet){
     return pack_type_names[_packet];
 }
 void Broker::CloseConnection(int fd){
     lg->debug("Close connection fd:{}", fd); lg->flush();
+    auto pClient = GetClient(fd);
+    if (pClient != nullptr) UnsubscribeAll(fd, pClient);
+    if (current_shard != nullptr){
+        auto it_cli = current_shard->clients.find(fd);
+        if (it_cli != current_shard->clients.end()) ArmSessionExpiry(*current_shard, it_cli->second);
+        if (current_shard->uring) current_shard->DetachRecv(fd);
+        current_shard->reactor.Del(fd);
+        current_shard->clients.erase(fd);
+    }
+    CloseOutbound(fd);
     close(fd);
     DelClient(fd);
 }
 
-int Broker::NotifyClients(MqttTopic& topic){
+//The client map and the subscription index are changed together by the shard owning the connection.
+//Every change publishes a new snapshot of the index with its own generation, the matching shards keep
+//reading the previous one until they leave their EpochGuard.
+bool Broker::Subscribe(const int fd, const shared_ptr<Client>& pClient, const string& filter, const uint8_t options){
+    if (!TopicTrie::isValidFilter(filter)) return false;
+    pClient->AddSubscription(filter, options);
+    const Subscriber sub{fd, current_shard != nullptr ? current_shard->GetId() : 0u, pClient->GetConnId(), options};
+    subscriptions.Update([&filter, &sub](TopicTrie& trie){
+        trie.Subscribe(filter, sub);
+        return true;
+    });
+    return true;
+}
+
+bool Broker::Unsubscribe(const int fd, const shared_ptr<Client>& pClient, const string& filter){
+    if (pClient->DelSubscription(filter) == 0) return false;
+    subscriptions.Update([&filter, fd, conn_id = pClient->GetConnId()](TopicTrie& trie){
+        return trie.Unsubscribe(filter, fd, conn_id);
+    });
+    return true;
+}
+
+void Broker::UnsubscribeAll(const int fd, const shared_ptr<Client>& pClient){
+    const auto& filters = pClient->GetSubscriptions();
+    if (filters.empty()) return;
+    subscriptions.Update([&filters, fd, conn_id = pClient->GetConnId()](TopicTrie& trie){
+        bool changed = false;
+        for(const auto& it : filters) changed |= trie.Unsubscribe(it.first, fd, conn_id);
+        return changed;
+    });
+}
+
+size_t Broker::GetSubscriptionCount(){
+    EpochGuard guard;
+    return subscriptions.Load()->Size();
+}
+
+//The publishing shard matches the topic once: it serves its own subscribers, every other shard with
+//a match gets one event and serves its subscribers from its own thread. The member of a shared group
+//is picked here, once per message, and a remote one gets an event addressed to it.
+int Broker::NotifyClients(MqttTopic& topic, const string& publisher){
     lg->debug("NotifyClients()"); lg->flush();
-    for(const auto& it : clients){
-        string topic_name_str = topic.GetName();
-        uint8_t options;
-        if(it.second->MyTopic(topic_name_str, options)){
-            topic.SetQos(options & 0x03);
-            if (topic.GetQoS() == mqtt_QoS::QoS_0) topic.SetPacketID(0);
-            else topic.SetPacketID(it.second->GenPacketID());
-            lg->debug("Add topic to send :{} QoS:{} packet_id:{}", topic_name_str, topic.GetQoS(), topic.GetID()); lg->flush();
-
-            uint32_t answer_size;
-			
-			if (it.second->GetClientMQTTVersion() == MQTT_VERSION_5){
-				VariableHeader answer_vh{shared_ptr<IVariableHeader>(new PublishVH(MqttStringEntity(topic.GetName()), topic.GetID(), MqttPropertyChain()))};
-				if (topic.GetQoS() > mqtt_QoS::QoS_0){
-				    if (!CheckIfMoreMessages(it.second->GetID())){
-				        auto data = CreateMqttPacket(FHBuilder().PacketType(PUBLISH).WithQoS(topic.GetQoS()).Build(), answer_vh, topic.GetPtr(), answer_size);
-				        AddCommand(it.first, tuple{answer_size, data});
-				    } else {
-				        auto data = CreateMqttPacket(FHBuilder().PacketType(PUBLISH).WithQoS(topic.GetQoS()).WithDup().Build(), answer_vh, topic.GetPtr(), answer_size);
-				        AddQosEvent(it.second->GetID(), mqtt_packet{answer_size, data, topic.GetID()});
-				    }
-				} else {
-				    auto data = CreateMqttPacket(FHBuilder().PacketType(PUBLISH).WithQoS(topic.GetQoS()).Build(), answer_vh, topic.GetPtr(), answer_size);
-				    AddCommand(it.first, tuple{answer_size, data});
-				}
-			} else {
-				VariableHeader answer_vh{shared_ptr<IVariableHeader>(new PublishV3VH(MqttStringEntity(topic.GetName()), topic.GetID()))};
-				if (topic.GetQoS() > mqtt_QoS::QoS_0){
-				    if (!CheckIfMoreMessages(it.second->GetID())){
-				        auto data = CreateMqttPacket(FHBuilder().PacketType(PUBLISH).WithQoS(topic.GetQoS()).Build(), answer_vh, topic.GetPtr(), answer_size);
-				        AddCommand(it.first, tuple{answer_size, data});
-				    } else {
-				        auto data = CreateMqttPacket(FHBuilder().PacketType(PUBLISH).WithQoS(topic.GetQoS()).WithDup().Build(), answer_vh, topic.GetPtr(), answer_size);
-				        AddQosEvent(it.second->GetID(), mqtt_packet{answer_size, data, topic.GetID()});
-				    }
-				} else {
-				    auto data = CreateMqttPacket(FHBuilder().PacketType(PUBLISH).WithQoS(topic.GetQoS()).Build(), answer_vh, topic.GetPtr(), answer_size);
-				    AddCommand(it.first, tuple{answer_size, data});
-				}			
-			}
-            lg->info("[{}] fd:{} {} ------>", it.second->GetIP(), it.first, GetControlPacketTypeName(PUBLISH));
+    if (current_shard == nullptr){
+        lg->error("NotifyClients() called outside of a shard thread");
+        return mqtt_err::handle_error;
+    }
+    static thread_local vector<Subscriber> matched;
+    static thread_local vector<Subscriber> picked;
+    static thread_local vector<uint8_t> targets;
+    if (topic.GetTopicName() == nullptr) return mqtt_err::ok;
+    const uint64_t share_key = shared_strategy == share_strategy::sticky_publisher ? hash<string>{}(publisher) : topic.GetTopicName()->hash;
+    MatchSubscribers(*current_shard, topic, matched, &picked, share_key);
+    targets.assign(shards.size(), 0);
+    for(const auto& it : matched) targets[it.shard] = 1;
+    for(unsigned int i = 0; i < shards.size(); i++){
+        if (targets[i] && shards[i].get() != current_shard) current_shard->writer.Send(*shards[i], ShardEvent{shard_event_type::publish, -1, topic});
+    }
+    for(const auto& it : picked){
+        if (it.shard == current_shard->GetId()){
+            matched.push_back(it);
+            targets[it.shard] = 1;
+        } else {
+            current_shard->writer.Send(*shards[it.shard], ShardEvent{shard_event_type::publish, it.fd, topic, it.conn_id, it.options});
         }
     }
+    if (!targets[current_shard->GetId()]) return mqtt_err::ok;
+    return NotifyLocalClients(*current_shard, topic, matched);
+}
+
+//picked == nullptr - the shared groups are skipped, share_key selects the member for the hashed strategies.
+//A topic resolved since the last subscription change is taken from the shard cache without matching.
+void Broker::MatchSubscribers(Shard& shard, const MqttTopic& topic, vector<Subscriber>& matched, vector<Subscriber>* picked, const uint64_t share_key){
+    if (picked != nullptr) picked->clear();
+    const auto& name = topic.GetTopicName();
+    if (name == nullptr){
+        matched.clear();
+        return;
+    }
+    EpochGuard guard;
+    const TopicTrie* trie = subscriptions.Load();
+    const uint64_t generation = trie->Generation();
+    auto entry = shard.subscriber_cache.Find(*name, generation);
+    if (entry != nullptr){
+        metrics.subscriber_cache_hits.fetch_add(1, memory_order_relaxed);
+    } else {
+        metrics.subscriber_cache_misses.fetch_add(1, memory_order_relaxed);
+        auto& fresh = shard.subscriber_cache.Insert(name, generation);
+        trie->Match(name->name, [&fresh](const Subscriber& sub){ fresh.subscribers.push_back(sub); },
+                                        [&fresh](const ShareGroup& group){ fresh.groups.push_back(&group); });
+        entry = &fresh;
+    }
+    matched.assign(entry->subscribers.begin(), entry->subscribers.end());
+    if (picked == nullptr) return;
+    for(const auto group : entry->groups){
+        picked->push_back(group->Pick(shared_strategy, share_key, [this](const Subscriber& sub){
+            OutboundDepth depth{};
+            GetOutboundDepth(sub.fd, depth);
+            return depth.messages;
+        }));
+        picked->back().shared = true;
+    }
+}
+
+void Broker::SetShareStrategy(const share_strategy strategy){
+    shared_strategy = strategy;
+}
+
+void Broker::SetSubscriberCacheSize(const size_t size){
+    subscriber_cache_size = size;
+}
+
+//A connection with several matching filters gets one copy with the highest granted QoS. A pick of a
+//shared group is a copy of its own (MQTT 5 4.8.2), it is not merged with the other matches.
+int Broker::NotifyLocalClients(Shard& shard, MqttTopic& topic, vector<Subscriber>& matched){
+    sort(matched.begin(), matched.end(), [](const Subscriber& l, const Subscriber& r){
+        if (l.fd != r.fd) return l.fd < r.fd;
+        return l.conn_id != r.conn_id ? l.conn_id < r.conn_id : l.shared < r.shared;
+    });
+    PublishVariants variants;
+    for(size_t i = 0; i < matched.size(); i++){
+        const auto& sub = matched[i];
+        uint8_t qos = sub.options & 0x03;
+        while (!sub.shared && i + 1 < matched.size() && !matched[i + 1].shared && matched[i + 1].fd == sub.fd && matched[i + 1].conn_id == sub.conn_id){
+            qos = max<uint8_t>(qos, matched[++i].options & 0x03);
+        }
+        if (sub.shard != shard.GetId()) continue;
+        //the connection may have been closed and its fd reused since the match
+        auto it = shard.clients.find(sub.fd);
+        if (it == shard.clients.end() || it->second->GetConnId() != sub.conn_id) continue;
+        topic.SetQos(qos);
+        Deliver(sub.fd, it->second, topic, variants);
+    }
     return mqtt_err::ok;
 }
 
 int Broker::NotifyClient(const int fd, MqttTopic& topic){
     lg->debug("NotifyClient()"); lg->flush();
-    auto pClient = clients[fd];
+    auto pClient = GetClient(fd);
+    if (pClient == nullptr) return mqtt_err::handle_error;
+    PublishVariants variants;
+    return Deliver(fd, pClient, topic, variants);
+}
 
+int Broker::Deliver(const int fd, const shared_ptr<Client>& pClient, MqttTopic& topic, PublishVariants& variants){
+    //QoS 3 in the subscription options is not rejected
+    if (topic.GetQoS() > mqtt_QoS::QoS_2) topic.SetQos(mqtt_QoS::QoS_2);
     if (topic.GetQoS() == mqtt_QoS::QoS_0) topic.SetPacketID(0);
     else topic.SetPacketID(pClient->GenPacketID());
 
-    //lg->debug("NotifyClient(): {} {}", topic.GetID(), topic.GetQoS()); lg->flush();
-
-	if (pClient->GetClientMQTTVersion() == MQTT_VERSION_5){
-		VariableHeader answer_vh{shared_ptr<IVariableHeader>(new PublishVH(MqttStringEntity(topic.GetName()), topic.GetID(), MqttPropertyChain()))};
-		uint32_t answer_size;
-		lg->debug("Add topic to send :{}", topic.GetName()); lg->flush();
-
-		if (topic.GetQoS() > mqtt_QoS::QoS_0){
-		    if (!CheckIfMoreMessages(pClient->GetID())) {
-		        auto data = CreateMqttPacket(FHBuilder().PacketType(PUBLISH).WithQoS(topic.GetQoS()).Build(), answer_vh, topic.GetPtr(), answer_size);
-		        AddCommand(fd, tuple{answer_size, data});
-		    } else {
-		        auto data = CreateMqttPacket(FHBuilder().PacketType(PUBLISH).WithQoS(topic.GetQoS()).WithDup().Build(), answer_vh, topic.GetPtr(), answer_size);
-		        AddQosEvent(pClient->GetID(), mqtt_packet{answer_size, data, topic.GetID()});
-		    }
-		} else {
-		    auto data = CreateMqttPacket(FHBuilder().PacketType(PUBLISH).WithQoS(topic.GetQoS()).Build(), answer_vh, topic.GetPtr(), answer_size);
-		    AddCommand(fd, tuple{answer_size, data});
-		}
-	} else {
-		VariableHeader answer_vh{shared_ptr<IVariableHeader>(new PublishV3VH(MqttStringEntity(topic.GetName()), topic.GetID()))};
-		uint32_t answer_size;
-		lg->debug("Add topic to send :{}", topic.GetName()); lg->flush();	
-		if (topic.GetQoS() > mqtt_QoS::QoS_0){
-		    if (!CheckIfMoreMessages(pClient->GetID())) {
-		        auto data = CreateMqttPacket(FHBuilder().PacketType(PUBLISH).WithQoS(topic.GetQoS()).Build(), answer_vh, topic.GetPtr(), answer_size);
-		        AddCommand(fd, tuple{answer_size, data});
-		    } else {
-		        auto data = CreateMqttPacket(FHBuilder().PacketType(PUBLISH).WithQoS(topic.GetQoS()).WithDup().Build(), answer_vh, topic.GetPtr(), answer_size);
-		        AddQosEvent(pClient->GetID(), mqtt_packet{answer_size, data, topic.GetID()});
-		    }
-		} else {
-		    auto data = CreateMqttPacket(FHBuilder().PacketType(PUBLISH).WithQoS(topic.GetQoS()).Build(), answer_vh, topic.GetPtr(), answer_size);
-		    AddCommand(fd, tuple{answer_size, data});
-		}
-	}
+    //lg->debug("Deliver(): {} {}", topic.GetID(), topic.GetQoS()); lg->flush();
+    const uint8_t version = pClient->GetClientMQTTVersion();
+    auto& encoded = variants[version == MQTT_VERSION_5][topic.GetQoS()];
+    if (encoded.data == nullptr){
+        const uint32_t payload_size = topic.GetPtr()->Size() - sizeof(uint16_t);
+        encoded = EncodePublish(version, topic.GetQoS(), topic.GetName(), topic.GetPtr(), zerocopy_threshold == 0 || payload_size < zerocopy_threshold);
+    }
+    lg->debug("Add topic to send :{}", topic.GetName());
+    if (topic.GetQoS() > mqtt_QoS::QoS_0 && CheckIfMoreMessages(pClient->GetID())){
+        //kept until the earlier messages are acknowledged, so it is copied out with DUP set
+        uint32_t answer_size;
+        auto data = CreateMqttPacket(encoded, topic.GetID(), topic.GetPtr(), answer_size);
+        data.get()[0] = FHBuilder().PacketType(PUBLISH).WithQoS(topic.GetQoS()).WithDup().Build();
+        AddQosEvent(pClient->GetID(), mqtt_packet{answer_size, data, topic.GetID()});
+        ArmRetransmit(fd, pClient);
+    } else {
+        QueuePublish(fd, topic, encoded);
+    }
     lg->info("[{}] fd:{} {} ------>", pClient->GetIP(), fd, GetControlPacketTypeName(PUBLISH));
     return mqtt_err::ok;
 }
 
+//The subscriber's packet points into the shared encoding, only its packet id is copied into the queue.
+//A payload from the zero-copy threshold up is a separate piece aliasing the topic buffer, the sender
+//may pass it with MSG_ZEROCOPY.
+void Broker::QueuePublish(const int fd, MqttTopic& topic, const EncodedPublish& encoded){
+    size_t evicted;
+    const auto& limits = queue_limits.Find(topic.GetName());
+    const bool droppable = topic.GetQoS() == mqtt_QoS::QoS_0;
+    const uint16_t packet_id = htons(topic.GetID());
+    OutboundPiece pieces[4];    //shared head, packet id, shared rest, payload
+    unsigned int count = 0;
+    pieces[count++] = OutboundPiece{encoded.data, nullptr, encoded.id_offset};
+    if (encoded.id_offset != encoded.size){
+        pieces[count++] = OutboundPiece{nullptr, reinterpret_cast<const uint8_t*>(&packet_id), sizeof(packet_id)};
+        const uint32_t rest = encoded.id_offset + sizeof(packet_id);
+        if (rest != encoded.size) pieces[count++] = OutboundPiece{shared_ptr<uint8_t>(encoded.data, encoded.data.get() + rest), nullptr, encoded.size - rest};
+    }
+    if (!encoded.with_payload){
+        auto message = topic.GetPtr();
+        const uint32_t payload_size = message->Size() - sizeof(uint16_t);
+        pieces[count++] = OutboundPiece{shared_ptr<uint8_t>(message, message->GetData()), nullptr, payload_size, true};
+    }
+    auto ret = AddCommand(fd, pieces, count, limits, droppable, evicted);
+    metrics.publish_dropped += evicted;
+    if (ret == push_status::dropped){
+        metrics.publish_dropped++;
+        lg->debug("fd:{} outbound queue is full, drop topic:{}", fd, topic.GetName());
+    } else if (ret == push_status::overflow){
+        QuotaExceeded(fd);
+    }
+}
+
+//Slow consumer with the disconnect policy: DISCONNECT(quota exceeded) replaces the queued data,
+//the owning shard closes the connection when it sees the read side shut down
+void Broker::QuotaExceeded(const int fd){
+    auto pClient = GetClient(fd);
+    if (pClient == nullptr) return;
+    uint32_t answer_size{0};
+    shared_ptr<uint8_t> data;
+    if (pClient->GetClientMQTTVersion() == MQTT_VERSION_5){
+        VariableHeader answer_vh{shared_ptr<IVariableHeader>(new DisconnectVH(quota_exceeded, MqttPropertyChain()))};
+        data = CreateMqttPacket(FHBuilder().PacketType(DISCONNECT).Build(), answer_vh, answer_size);
+    }
+    if (AbortOutbound(fd, tuple{answer_size, data})){
+        metrics.quota_disconnects++;
+        lg->warn("[{}] fd:{} outbound queue quota exceeded, disconnect", pClient->GetID(), fd);
+    }
+}
+
+void Broker::SetZerocopyThreshold(const uint32_t threshold){
+    zerocopy_threshold = threshold;
+    SetZerocopy(threshold != 0);
+}
+
+void Broker::SetQueueLimits(const QueueLimits& global, const vector<pair<string, QueueLimits>>& topics){
+    queue_limits.SetGlobal(global);
+    for(const auto& it : topics) queue_limits.AddPrefix(it.first, it.second);
+}
+
 void Broker::AddQosEvent(const string& client_id, const mqtt_packet& mqtt_message) {
     unique_lock lock{qos_mutex};
 
     if (postponed_events.find(client_id) == postponed_events.end()){
         postponed_events.insert(make_pair(client_id, list<mqtt_packet>{}));
     }
+    const auto& limits = queue_limits.GetGlobal();
+    if (limits.max_messages != 0 && postponed_events[client_id].size() >= limits.max_messages){
+        lock.unlock();
+        metrics.publish_dropped++;
+        lg->warn("[{}] postponed events limit:{} reached, drop packet_id:{}", client_id, limits.max_messages, mqtt_message.packet_id);
+        if (limits.policy == overflow_policy::disconnect) QuotaExceeded(GetClientFd(client_id));
+        return;
+    }
     postponed_events[client_id].push_back(mqtt_message);
 
     lg->debug("Add posteponed event for client_id:{} packet_id:{}", client_id, mqtt_message.packet_id);
@@ -531,37 +903,53 @@ void Broker::SetEraseOldValues(const bool val) noexcept {
     erase_old_values_in_queue = val;
 }
 
+//postponed_events is shared by the shards, every access takes qos_mutex
 bool Broker::CheckIfMoreMessages(const string& client_id){
-    //lg->debug("CheckIfMoreMessages {}", client_id); lg->flush();
+    shared_lock lock{qos_mutex};
     auto it = postponed_events.find(client_id);
-    if (it != postponed_events.end() && !it->second.empty()) return true;
-
-    return false;
+    return it != postponed_events.end() && !it->second.empty();
 }
 
+//The oldest postponed packet, found is false when the client has none
 pair<uint32_t, shared_ptr<uint8_t>> Broker::GetPacket(const string& client_id, bool &found){
-    found = false;
+    shared_lock lock{qos_mutex};
     auto it = postponed_events.find(client_id);
+    found = it != postponed_events.end() && !it->second.empty();
+    if (!found) return make_pair(0, nullptr);
+    return make_pair(it->second.front().data_len, it->second.front().pData);
+}
 
-    if (it != postponed_events.end()){
-        found = true;
-        return make_pair(it->second.front().data_len, it->second.front().pData);
-    }
-    return make_pair(0, nullptr);
+//Queues the oldest postponed packet of the client, returns false when there is none
+bool Broker::SendPostponed(const int fd, const string& client_id){
+    bool found;
+    auto packet = GetPacket(client_id, found);
+    if (found) AddCommand(fd, tuple{packet.first, packet.second});
+    return found;
 }
 
-bool Broker::CheckClientID(const std::string& client_id) const noexcept {
-    for (const auto& it : clients){
-        if (it.second->GetID() == client_id) return true;
-    }
-    return false;
+bool Broker::CheckClientID(const std::string& client_id) noexcept {
+    return GetClientFd(client_id) != -1;
 }
 
-int Broker::GetClientFd(const std::string& client_id) const noexcept {
-    for (const auto& it : clients){
-        if (it.second->GetID() == client_id) return it.first;
-    }
-    return -1;
+//The claimed id goes into a new table entry, so the readers on other shards see either the old entry
+//or the new one and never an id being written
+bool Broker::ClaimClientID(const int fd, const shared_ptr<Client>& pClient, const string& client_id, const bool unique){
+    lock_guard lock{client_id_mtx};
+    if (unique && CheckClientID(client_id)) return false;
+    pClient->SetID(client_id);
+    //a generated id is never claimed again, only the ids the clients chose are tracked
+    if (unique) pClient->session_gen = ++session_gen[client_id];
+    clients.Replace(fd, ClientEntry{pClient, client_id});
+    return true;
+}
+
+int Broker::GetClientFd(const std::string& client_id) noexcept {
+    EpochGuard guard;
+    int found = -1;
+    clients.ForEach([&client_id, &found](const int fd, const ClientEntry& entry){
+        if (found == -1 && entry.id == client_id) found = fd;
+    });
+    return found;
 }
 
 
@@ -1,8 +1,12 @@
 #include "client.h"
 
+#include <atomic>
+
 using namespace std;
 
-Client::Client(string _ip) : ip(std::move(_ip)), client_id(string{}), flags(0), alive(0), packet_id_gen(1) {
+static atomic<uint64_t> conn_id_gen{1};
+
+Client::Client(string _ip) : ip(std::move(_ip)), client_id(string{}), conn_id(conn_id_gen++), flags(0), alive(0), packet_id_gen(1) {
     time_t _cur_time;
     time(&_cur_time);
     SetPacketLastTime(_cur_time);
@@ -67,7 +71,7 @@ uint16_t Client::GetAlive() const{
 }
 
 void  Client::AddSubscription(const string &_topic_name, uint8_t options){
-    subscribed_topics.insert(make_pair(_topic_name, options));
+    subscribed_topics[_topic_name] = options;
 }
 
 unordered_map<string, uint8_t>::const_iterator Client::CFind(const string &_topic_name) {
@@ -78,6 +82,14 @@ unordered_map<string, uint8_t>::const_iterator Client::CEnd(){
     return subscribed_topics.cend();
 }
 
+const unordered_map<string, uint8_t>& Client::GetSubscriptions() const noexcept {
+    return subscribed_topics;
+}
+
+uint64_t Client::GetConnId() const noexcept {
+    return conn_id;
+}
+
 bool Client::MyTopic(const string &_topic, uint8_t& options){
     auto it = subscribed_topics.find(_topic);
     if (it != subscribed_topics.end()) {
@@ -1,38 +1,309 @@
 #include "command.h"
+#include "uring.h"
+
+#include <sys/socket.h>
+#include <thread>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 using namespace std;
 
-int Writer::Write(const int fd, const shared_ptr<uint8_t>& buf, const uint32_t buf_len){
-    return WriteData(fd, buf.get(), buf_len);
+void Writer::Flush(vector<shared_ptr<OutboundQueue>>& batch, vector<outbound_status>& status){
+    for(size_t i=0; i<batch.size(); i++){
+        lock_guard guard{batch[i]->mtx};
+        if (batch[i]->isClosed()){
+            status[i] = outbound_status::closed;
+            continue;
+        }
+        status[i] = batch[i]->Finish(batch[i]->WriteV(OUTBOUND_FLUSH_LIMIT));
+    }
+}
+
+struct PendingSend{
+    struct msghdr msg;
+    struct iovec iov[OUTBOUND_MAX_IOV];
+    size_t written;
+    bool zerocopy;
+    bool inflight;      //the kernel may still read msg, it is not touched until the completion is reaped
+};
+
+//every sender thread submits to its own ring
+static thread_local unique_ptr<Uring> writer_ring;
+static thread_local bool writer_ring_failed = false;
+//user_data: flush number(32 bits) | batch index(32 bits), a completion of an earlier flush is ignored
+static thread_local uint32_t writer_flush_seq = 0;
+
+void UringWriter::Flush(vector<shared_ptr<OutboundQueue>>& batch, vector<outbound_status>& status){
+    if (!writer_ring && !writer_ring_failed){
+        writer_ring = make_unique<Uring>(COMMANDS_BATCH_SIZE * 2, sqpoll);
+        if (!writer_ring->isValid()){
+            writer_ring.reset();
+            writer_ring_failed = true;
+        }
+    }
+    if (!writer_ring){
+        Writer::Flush(batch, status);
+        return;
+    }
+
+    //a sender owns the queues of its batch exclusively, so holding all the locks can't deadlock
+    static thread_local vector<unique_lock<mutex>> locks;
+    static thread_local vector<PendingSend> sends;
+    static thread_local vector<size_t> active, next;
+    locks.clear();
+    active.clear();
+    if (sends.size() < batch.size()) sends.resize(batch.size());
+    for(size_t i=0; i<batch.size(); i++){
+        locks.emplace_back(batch[i]->mtx);
+        sends[i].written = 0;
+        sends[i].inflight = false;
+        if (!batch[i]->isClosed() && batch[i]->isPinned()) batch[i]->ReapLocked();
+        if (batch[i]->isClosed())     status[i] = outbound_status::closed;
+        else if (batch[i]->isEmpty()) status[i] = outbound_status::drained;
+        else {
+            status[i] = outbound_status::more;
+            active.push_back(i);
+        }
+    }
+
+    const uint64_t seq = static_cast<uint64_t>(++writer_flush_seq) << 32;
+    size_t inflight = 0;
+    auto reap = [&](uint64_t user_data, int32_t res, uint32_t){
+        const uint64_t i = user_data & 0xFFFFFFFF;
+        if ((user_data & ~uint64_t(0xFFFFFFFF)) != seq || i >= batch.size() || !sends[i].inflight) return;
+        sends[i].inflight = false;
+        inflight--;
+        if (res > 0){
+            //the sent bytes are accounted even on the error path, zerocopy pages stay pinned until released
+            if (sends[i].zerocopy) batch[i]->Pin(sends[i].msg.msg_iovlen, res);
+            batch[i]->Consume(res);
+            sends[i].written += res;
+            if (status[i] == outbound_status::more && batch[i]->isEmpty()) status[i] = outbound_status::drained;
+        } else if (status[i] != outbound_status::more){
+            return;
+        } else if (res == -EAGAIN){
+            status[i] = outbound_status::blocked;
+        } else if (res != -EINTR){
+            status[i] = outbound_status::error;
+        }
+    };
+
+    //MSG_DONTWAIT makes a full socket complete with -EAGAIN instead of waiting inside the kernel
+    while (!active.empty()){
+        for(const auto& i : active){
+            auto& send = sends[i];
+            memset(&send.msg, 0, sizeof(send.msg));
+            send.msg.msg_iov    = send.iov;
+            send.msg.msg_iovlen = batch[i]->Gather(send.iov, OUTBOUND_MAX_IOV, send.zerocopy);
+            //without a free SQE the rest of the round waits for the next one
+            if (!writer_ring->PrepSendmsg(batch[i]->fd, &send.msg, MSG_DONTWAIT | MSG_NOSIGNAL | (send.zerocopy ? MSG_ZEROCOPY : 0), seq | i)) break;
+            send.inflight = true;
+            inflight++;
+        }
+        if (inflight == 0) break;
+        bool failed = false;
+        while (inflight > 0){
+            if (writer_ring->SubmitAndWait(1, -1) < 0 && errno != EAGAIN && errno != EBUSY){
+                failed = true;
+                break;
+            }
+            writer_ring->ForEachCompletion(reap);
+        }
+        if (failed){
+            //the sends the kernel still owns fail their connection and are reaped before the queues are finished
+            for(const auto& i : active){
+                if (sends[i].inflight) status[i] = outbound_status::error;
+            }
+            for(unsigned int attempt=0; attempt<URING_DRAIN_ATTEMPTS && inflight > 0; attempt++){
+                writer_ring->SubmitAndWait(1, URING_DRAIN_TIMEOUT_MS);
+                writer_ring->ForEachCompletion(reap);
+            }
+            if (inflight > 0){
+                //closing the ring cancels what is left, the sender falls back to plain writes
+                writer_ring.reset();
+                writer_ring_failed = true;
+            }
+            break;
+        }
+        next.clear();
+        for(const auto& i : active){
+            if (status[i] == outbound_status::more && sends[i].written < OUTBOUND_FLUSH_LIMIT) next.push_back(i);
+        }
+        active.swap(next);
+    }
+
+    for(size_t i=0; i<batch.size(); i++){
+        if (status[i] != outbound_status::closed) status[i] = batch[i]->Finish(status[i]);
+    }
+    locks.clear();
+}
+
+static void FutexWait(atomic<uint32_t>& word, const uint32_t value){
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT_PRIVATE, value, nullptr, nullptr, 0);
+}
+
+static void FutexWake(atomic<uint32_t>& word){
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+}
+
+Commands::Commands(const unsigned int sender_count){
+    stream = make_shared<Writer>();
+    SetSenderCount(sender_count);
+}
+
+//called before the senders are started, 0 - one per core
+void Commands::SetSenderCount(unsigned int count){
+    if (count == 0) count = max(1u, thread::hardware_concurrency());
+    senders.clear();
+    for(unsigned int i=0; i<count; i++) senders.push_back(make_unique<SenderSlot>());
+}
+
+//called before the senders are started
+void Commands::SetWriter(shared_ptr<Writer> _stream){
+    atomic_store(&stream, std::move(_stream));
+}
+
+void Commands::SetZerocopy(const bool on) noexcept {
+    zerocopy = on;
+}
+
+void Commands::OpenOutbound(const int fd, const unsigned int owner){
+    auto queue = make_shared<OutboundQueue>(fd, owner, static_cast<unsigned int>(fd) % senders.size());
+    if (zerocopy) queue->EnableZerocopy(&zerocopy_stats);
+    if (!outbound.Insert(fd, queue)) outbound.Replace(fd, std::move(queue));
+}
+
+//A producer that found the queue before it left the table sees it closed and drops its data
+void Commands::CloseOutbound(const int fd){
+    auto queue = GetOutbound(fd);
+    if (queue == nullptr || !outbound.Erase(fd)) return;
+    if (queue->Close()){
+        lock_guard guard{linger_mtx};
+        lingering.push_back(std::move(queue));
+    }
 }
 
-void FdWriteCommand::Execute() {   
-	uint32_t len;
-    shared_ptr<uint8_t> ptr = nullptr;
-    tie(len, ptr) = cmd;   
-	stream->Write(fd, ptr, len);
-    ptr.reset();
-    count--;
+shared_ptr<OutboundQueue> Commands::GetOutbound(const int fd){
+    EpochGuard guard;
+    auto queue = outbound.Find(fd);
+    return queue != nullptr ? *queue : nullptr;
 }
 
+//The scheduled flag guarantees a queue is linked in one list at a time
+void Commands::Schedule(shared_ptr<OutboundQueue> queue){
+    auto& slot = *senders[queue->sender];
+    auto raw = queue.get();
+    raw->ready_ref = std::move(queue);
+    slot.ready.Push(raw);
+    if (slot.sleeping.load(memory_order_seq_cst) != 0 && slot.sleeping.exchange(0) != 0) FutexWake(slot.sleeping);
+}
+
+void Commands::OnWriteBlocked(const int, const unsigned int){}
+
+//Data for an fd without an outbound queue belongs to a connection that is already closed
 void Commands::AddCommand(const int fd, tuple<uint32_t, shared_ptr<uint8_t>> _cmd){
-    lock_guard guard{com_mutex};
-    commands.emplace(new FdWriteCommand(stream, fd, std::move(_cmd)));
-    //cond.notify_all();
+    auto queue = GetOutbound(fd);
+    if (queue == nullptr) return;
+    if (queue->Push(std::move(get<1>(_cmd)), get<0>(_cmd))) Schedule(std::move(queue));
+}
+
+void Commands::AddCommand(const int fd, const uint8_t* data, const uint32_t len){
+    auto queue = GetOutbound(fd);
+    if (queue == nullptr) return;
+    if (queue->Push(data, len)) Schedule(std::move(queue));
+}
+
+push_status Commands::AddCommand(const int fd, tuple<uint32_t, shared_ptr<uint8_t>> _cmd, const QueueLimits& limits, const bool droppable, size_t& evicted){
+    evicted = 0;
+    auto queue = GetOutbound(fd);
+    if (queue == nullptr) return push_status::dropped;
+    auto ret = queue->Push(std::move(get<1>(_cmd)), get<0>(_cmd), limits, droppable, evicted);
+    if (ret == push_status::scheduled) Schedule(std::move(queue));
+    return ret;
+}
+
+push_status Commands::AddCommand(const int fd, OutboundPiece* pieces, const unsigned int count, const QueueLimits& limits, const bool droppable, size_t& evicted){
+    evicted = 0;
+    auto queue = GetOutbound(fd);
+    if (queue == nullptr) return push_status::dropped;
+    auto ret = queue->Push(pieces, count, limits, droppable, evicted);
+    if (ret == push_status::scheduled) Schedule(std::move(queue));
+    return ret;
+}
+
+bool Commands::AbortOutbound(const int fd, tuple<uint32_t, shared_ptr<uint8_t>> _last){
+    auto queue = GetOutbound(fd);
+    if (queue == nullptr) return false;
+    bool wake;
+    if (!queue->Abort(std::move(get<1>(_last)), get<0>(_last), wake)) return false;
+    if (wake) Schedule(std::move(queue));
+    return true;
 }
 
-void Commands::Execute(){
-    unique_lock lock{com_mutex};
-    while(commands.empty()) cond.wait(lock);
+bool Commands::GetOutboundDepth(const int fd, OutboundDepth& depth){
+    auto queue = GetOutbound(fd);
+    if (queue == nullptr) return false;
+    depth = queue->GetDepth();
+    return true;
+}
+
+void Commands::OnWritable(const int fd){
+    auto queue = GetOutbound(fd);
+    if (queue != nullptr && queue->Wake()) Schedule(std::move(queue));
+}
 
-    auto p = commands.front();
-    commands.pop();
-    lock.unlock();
-    p->Execute();
+void Commands::ReapOutbound(const int fd){
+    auto queue = GetOutbound(fd);
+    if (queue != nullptr) queue->Reap();
 }
 
-void Commands::Notify(){
-    if (commands.size() > 0) cond.notify_all();
+void Commands::ReapLingering(const time_t now){
+    vector<shared_ptr<OutboundQueue>> queues;
+    {
+        lock_guard guard{linger_mtx};
+        if (lingering.empty()) return;
+        queues.swap(lingering);
+    }
+    vector<shared_ptr<OutboundQueue>> left;
+    for(auto& it : queues){
+        if (it->Linger(now)) left.push_back(std::move(it));
+    }
+    lock_guard guard{linger_mtx};
+    for(auto& it : left) lingering.push_back(std::move(it));
 }
 
-int FdWriteCommand::count = 0;
+void Commands::Execute(const unsigned int sender){
+    auto& slot = *senders[sender % senders.size()];
+    auto& batch = slot.batch;
+    auto& status = slot.status;
+    batch.clear();
+    while (true){
+        while (batch.size() < COMMANDS_BATCH_SIZE){
+            auto raw = slot.ready.Pop();
+            if (raw == nullptr) break;
+            batch.push_back(std::move(raw->ready_ref));
+        }
+        if (!batch.empty()) break;
+        //a producer that pushed after the check sees the flag and wakes us, the wait returns at once if it already did
+        slot.sleeping.store(1, memory_order_seq_cst);
+        if (slot.ready.Empty()) FutexWait(slot.sleeping, 1);
+        slot.sleeping.store(0, memory_order_relaxed);
+    }
+    auto writer = atomic_load(&stream);
+
+    status.assign(batch.size(), outbound_status::drained);
+    writer->Flush(batch, status);
+
+    for(size_t i=0; i<batch.size(); i++){
+        switch (status[i]){
+            case outbound_status::blocked : OnWriteBlocked(batch[i]->fd, batch[i]->owner); break;
+            case outbound_status::more    : Schedule(batch[i]); break;
+            default : break;
+        }
+    }
+    batch.clear();
+}
+
+unsigned int Commands::GetSenderCount() const noexcept {
+    return senders.size();
+}
@@ -0,0 +1,105 @@
+#include "epoch.h"
+
+#include <vector>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace std;
+
+namespace {
+    struct alignas(CACHE_LINE_SIZE) EpochSlot{
+        atomic<uint64_t> epoch{0};      //0 - outside of a read section
+        atomic<bool> used{false};
+    };
+
+    struct Retired{
+        void* ptr;
+        void (*deleter)(void*);
+        uint64_t epoch;
+    };
+
+    EpochSlot slots[EPOCH_MAX_THREADS];
+    atomic<uint64_t> global_epoch{1};
+    mutex limbo_mtx;
+    vector<Retired> limbo;
+
+    //the slot is taken on the first read section of a thread and given back when the thread exits
+    struct ThreadRecord{
+        EpochSlot* slot{nullptr};
+        unsigned int depth{0};
+
+        ~ThreadRecord(){
+            if (slot == nullptr) return;
+            slot->epoch.store(0, memory_order_release);
+            slot->used.store(false, memory_order_release);
+        }
+    };
+    thread_local ThreadRecord record;
+
+    //A reader without a slot can't be told apart from one that has left, so running out of slots is fatal
+    EpochSlot* AcquireSlot(){
+        for(unsigned int attempt = 0; attempt < EPOCH_SLOT_RETRIES; attempt++){
+            for(auto& it : slots){
+                bool expected = false;
+                if (!it.used.load(memory_order_relaxed) && it.used.compare_exchange_strong(expected, true, memory_order_acquire)) return &it;
+            }
+            this_thread::yield();
+        }
+        fprintf(stderr, "epoch: no free reader slot, more than %d live threads use read sections\n", EPOCH_MAX_THREADS);
+        abort();
+    }
+
+    //limbo_mtx is held
+    size_t ReclaimLocked(){
+        uint64_t epoch = global_epoch.load(memory_order_seq_cst);
+        atomic_thread_fence(memory_order_seq_cst);
+        bool advance = true;
+        for(const auto& it : slots){
+            auto local = it.epoch.load(memory_order_acquire);
+            if (local != 0 && local != epoch){
+                advance = false;
+                break;
+            }
+        }
+        if (advance && global_epoch.compare_exchange_strong(epoch, epoch + 1, memory_order_seq_cst)) epoch++;
+        //whoever could see an object retired at e has left once the epoch reached e + 2
+        size_t freed = 0;
+        for(size_t i = 0; i < limbo.size();){
+            if (limbo[i].epoch + 2 <= epoch){
+                limbo[i].deleter(limbo[i].ptr);
+                limbo[i] = limbo.back();
+                limbo.pop_back();
+                freed++;
+            } else i++;
+        }
+        return freed;
+    }
+}
+
+EpochGuard::EpochGuard() noexcept {
+    if (record.depth++ != 0) return;
+    if (record.slot == nullptr) record.slot = AcquireSlot();
+    record.slot->epoch.store(global_epoch.load(memory_order_acquire), memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+EpochGuard::~EpochGuard(){
+    if (--record.depth == 0) record.slot->epoch.store(0, memory_order_release);
+}
+
+void Epoch::Retire(void* ptr, void (*deleter)(void*)){
+    lock_guard lock{limbo_mtx};
+    limbo.push_back(Retired{ptr, deleter, global_epoch.load(memory_order_seq_cst)});
+    if (limbo.size() % EPOCH_RECLAIM_BATCH == 0) ReclaimLocked();
+}
+
+size_t Epoch::Reclaim(){
+    lock_guard lock{limbo_mtx};
+    return ReclaimLocked();
+}
+
+size_t Epoch::Pending(){
+    lock_guard lock{limbo_mtx};
+    return limbo.size();
+}
@@ -0,0 +1,85 @@
+#include "frame_decoder.h"
+
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+
+using namespace mqtt_protocol;
+using namespace std;
+
+//Makes room for at least size bytes after tail, moving the undecoded data to the front first
+void FrameDecoder::Reserve(const size_t size){
+    if (head == tail){
+        head = tail = 0;
+        //give back the memory of an oversized frame once it is consumed
+        if (want == 0 && buf.size() > 16 * DEFAULT_DECODER_CHUNK){
+            buf.resize(DEFAULT_DECODER_CHUNK);
+            buf.shrink_to_fit();
+        }
+    } else if (head > 0 && buf.size() - tail < size){
+        memmove(buf.data(), buf.data() + head, tail - head);
+        tail -= head;
+        head = 0;
+    }
+    size_t need = tail + size;
+    if (head + want > need) need = head + want;
+    if (buf.size() < need) buf.resize(need);
+}
+
+//One recv() normally takes everything the socket has: a short read means it is drained.
+//Without drain the amount read per call is limited, level-triggered polling reports the rest later.
+decoder_status FrameDecoder::ReadFrom(const int fd, const bool drain){
+    size_t total = 0;
+    while (true){
+        Reserve(DEFAULT_DECODER_CHUNK);
+        const size_t room = buf.size() - tail;
+        ssize_t ret = recv(fd, buf.data() + tail, room, MSG_DONTWAIT);
+        if (ret > 0){
+            tail += ret;
+            total += ret;
+            if ((size_t) ret < room) return decoder_status::ok;
+            if (!drain && total >= DEFAULT_DECODER_READ_LIMIT) return decoder_status::ok;
+            continue;
+        }
+        if (ret == 0) return decoder_status::closed;
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return total > 0 ? decoder_status::ok : decoder_status::would_block;
+        return decoder_status::read_err;
+    }
+}
+
+void FrameDecoder::Append(const uint8_t* data, const size_t size){
+    Reserve(size);
+    memcpy(buf.data() + tail, data, size);
+    tail += size;
+}
+
+decoder_status FrameDecoder::Next(FixedHeader& f_head, shared_ptr<uint8_t>& payload){
+    const size_t avail = tail - head;
+    if (avail < 2) return decoder_status::need_more;
+
+    const uint8_t* data = buf.data() + head;
+    uint32_t remaining_len;
+    uint8_t len_size;
+    const uint8_t status = DecodeVarInt(data + 1, avail - 1, remaining_len, len_size);
+    if (status != mqtt_err::ok) return status == mqtt_err::read_err ? decoder_status::need_more : decoder_status::malformed;
+    const size_t pos = 1 + len_size;
+    if (avail - pos < remaining_len){
+        want = pos + remaining_len;
+        return decoder_status::need_more;
+    }
+
+    f_head = FixedHeader(data[0]);
+    f_head.remaining_len = remaining_len;
+    payload = shared_ptr<uint8_t>(new uint8_t[remaining_len], default_delete<uint8_t[]>());
+    if (remaining_len > 0) memcpy(payload.get(), data + pos, remaining_len);
+
+    head += pos + remaining_len;
+    if (head == tail) head = tail = 0;
+    want = 0;
+    return decoder_status::ok;
+}
+
+size_t FrameDecoder::Pending() const noexcept {
+    return tail - head;
+}
@@ -15,6 +15,38 @@ void PrintType [[maybe_unused]](T) {
     cout << __PRETTY_FUNCTION__ << endl;
 }
 
+//Fields missing in the group keep the values of listener
+static void ReadListener(const Setting &group, ListenerCfg &listener){
+    group.lookupValue("address", listener.address);
+    group.lookupValue("port", listener.port);
+    if (group.lookupValue("backlog", listener.backlog) && listener.backlog <= 0) listener.backlog = DEFAULT_LISTEN_BACKLOG;
+    group.lookupValue("defer_accept", listener.defer_accept);
+    group.lookupValue("tcp_nodelay", listener.tcp_nodelay);
+    group.lookupValue("tcp_quickack", listener.tcp_quickack);
+    group.lookupValue("sndbuf", listener.sndbuf);
+    group.lookupValue("rcvbuf", listener.rcvbuf);
+    group.lookupValue("tcp_user_timeout", listener.user_timeout);
+    group.lookupValue("busy_poll", listener.busy_poll);
+    group.lookupValue("tcp_fastopen", listener.fastopen);
+}
+
+//Fields missing in the group keep the values of limits
+static bool ReadQueueLimits(const Setting &group, QueueLimits &limits){
+    long long val;
+    if (group.lookupValue("max_bytes", val)) limits.max_bytes = val > 0 ? val : 0;
+    if (group.lookupValue("max_messages", val)) limits.max_messages = val > 0 ? val : 0;
+    string policy;
+    if (!group.lookupValue("policy", policy)) return true;
+    if (policy == "drop_oldest_qos0")   limits.policy = overflow_policy::drop_oldest_qos0;
+    else if (policy == "drop_newest")   limits.policy = overflow_policy::drop_newest;
+    else if (policy == "disconnect")    limits.policy = overflow_policy::disconnect;
+    else {
+        std::cerr << "outbound_limits unknown policy: " << policy << std::endl;
+        return false;
+    }
+    return true;
+}
+
 ServerCfgData ReadConfig(const char *cfg_path, cfg_err &err){
     Config cfg;
 
@@ -67,8 +99,89 @@ ServerCfgData ReadConfig(const char *cfg_path, cfg_err &err){
         control_socket_path = CONTROL_SOCKET_NAME;
     }
 
+    ServerCfgData cfg_data{path, size, max_file, port, log_level, control_socket_path};
+    if (!broker_cfg.lookupValue("edge_triggered", cfg_data.edge_triggered)){
+        std::cerr << "edge_triggered arg error. Set default (level-triggered)" << std::endl;
+    }
+    if (!broker_cfg.lookupValue("shards", cfg_data.shards)){
+        std::cerr << "shards arg error. Set default (" << cfg_data.shards << ")" << std::endl;
+    }
+    if (!broker_cfg.lookupValue("writers", cfg_data.writers)){
+        std::cerr << "writers arg error. Set default (" << cfg_data.writers << ")" << std::endl;
+    }
+    string backend;
+    if (!broker_cfg.lookupValue("io_backend", backend)){
+        std::cerr << "io_backend arg error. Set default (epoll)" << std::endl;
+    } else if (backend == "io_uring"){
+        cfg_data.backend = io_backend::io_uring;
+    } else if (backend != "epoll"){
+        std::cerr << "io_backend unknown value: " << backend << ". Set default (epoll)" << std::endl;
+    }
+    if (!broker_cfg.lookupValue("io_uring_sqpoll", cfg_data.io_uring_sqpoll)){
+        std::cerr << "io_uring_sqpoll arg error. Set default (false)" << std::endl;
+    }
+    if (!broker_cfg.lookupValue("zerocopy_threshold", cfg_data.zerocopy_threshold)){
+        std::cerr << "zerocopy_threshold arg error. Set default (off)" << std::endl;
+    }
+    unsigned int cache_size;
+    if (!broker_cfg.lookupValue("subscriber_cache", cache_size)){
+        std::cerr << "subscriber_cache arg error. Set default (" << cfg_data.subscriber_cache_size << ")" << std::endl;
+    } else cfg_data.subscriber_cache_size = cache_size;
+    string strategy;
+    if (!broker_cfg.lookupValue("shared_strategy", strategy)){
+        std::cerr << "shared_strategy arg error. Set default (round_robin)" << std::endl;
+    } else if (strategy == "least_inflight"){
+        cfg_data.shared_strategy = share_strategy::least_inflight;
+    } else if (strategy == "sticky_publisher"){
+        cfg_data.shared_strategy = share_strategy::sticky_publisher;
+    } else if (strategy == "hash_topic"){
+        cfg_data.shared_strategy = share_strategy::hash_topic;
+    } else if (strategy != "round_robin"){
+        std::cerr << "shared_strategy unknown value: " << strategy << ". Set default (round_robin)" << std::endl;
+    }
+    if (!broker_cfg.lookupValue("listen_backlog", cfg_data.listen_backlog) || cfg_data.listen_backlog <= 0){
+        std::cerr << "listen_backlog arg error. Set default (" << DEFAULT_LISTEN_BACKLOG << ")" << std::endl;
+        cfg_data.listen_backlog = DEFAULT_LISTEN_BACKLOG;
+    }
+    if (!broker_cfg.lookupValue("defer_accept", cfg_data.defer_accept)){
+        std::cerr << "defer_accept arg error. Set default (off)" << std::endl;
+    }
+    //without the listeners list the broker listens on port with listen_backlog and defer_accept
+    ListenerCfg default_listener;
+    default_listener.port = cfg_data.port;
+    default_listener.backlog = cfg_data.listen_backlog;
+    default_listener.defer_accept = cfg_data.defer_accept;
+    if (broker_cfg.exists("listeners")){
+        const Setting &listeners_cfg = broker_cfg["listeners"];
+        for(int i=0; i<listeners_cfg.getLength(); i++){
+            ListenerCfg listener = default_listener;
+            ReadListener(listeners_cfg[i], listener);
+            cfg_data.listeners.push_back(listener);
+        }
+    }
+    if (cfg_data.listeners.empty()) cfg_data.listeners.push_back(default_listener);
+
+    if (!broker_cfg.exists("outbound_limits")){
+        std::cerr << "outbound_limits not found. Set default" << std::endl;
+    } else {
+        const Setting &limits_cfg = broker_cfg["outbound_limits"];
+        ReadQueueLimits(limits_cfg, cfg_data.outbound_limits);
+        if (limits_cfg.exists("topics")){
+            const Setting &topics_cfg = limits_cfg["topics"];
+            for(int i=0; i<topics_cfg.getLength(); i++){
+                string prefix;
+                QueueLimits limits = cfg_data.outbound_limits;
+                if (!topics_cfg[i].lookupValue("prefix", prefix) || prefix.empty()){
+                    std::cerr << "outbound_limits topic prefix error. Skip" << std::endl;
+                    continue;
+                }
+                if (ReadQueueLimits(topics_cfg[i], limits)) cfg_data.topic_limits.emplace_back(prefix, limits);
+            }
+        }
+    }
+
     err = cfg_err::ok;
-    return (ServerCfgData{path, size, max_file, port, log_level, control_socket_path});
+    return cfg_data;
 }
 
 void SetLogLevel(const shared_ptr<logger>& lg, int _level) noexcept {
@@ -84,11 +197,18 @@ void SetLogLevel(const shared_ptr<logger>& lg, int _level) noexcept {
     }
 }
 
+//client sockets are non-blocking: a full send buffer is waited out instead of cutting the packet
 int WriteData(int fd, uint8_t* data, unsigned int size) {
     int res = 0;
     unsigned int sent_bytes = 0;
     while (sent_bytes < size) {
         res = write(fd, data + sent_bytes, size - sent_bytes);
+        if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            struct pollfd pfd{fd, POLLOUT, 0};
+            if (poll(&pfd, 1, DEFAULT_WRITE_TIMEOUT) <= 0) return -1;
+            continue;
+        }
+        if (res < 0 && errno == EINTR) continue;
         if (res <= 0) return -1;
         sent_bytes += res;
     }
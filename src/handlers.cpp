@@ -3,7 +3,7 @@
 using namespace spdlog;
 using namespace std;
 
-int HandleMqttConnect(shared_ptr<Client>& pClient, const shared_ptr<uint8_t>& buf, shared_ptr<logger>& lg, Broker *broker){
+int HandleMqttConnect(const int fd, shared_ptr<Client>& pClient, const FixedHeader &fh, const shared_ptr<uint8_t>& buf, shared_ptr<logger>& lg, Broker *broker){
     ConnectVH con_vh;
     uint32_t offset = 0;
     con_vh.ReadFromBuf(buf.get(), offset);
@@ -25,7 +25,7 @@ int HandleMqttConnect(shared_ptr<Client>& pClient, const shared_ptr<uint8_t>& bu
     //read properties
     if (pClient->GetClientMQTTVersion() == MQTT_VERSION_5) {
         uint32_t property_size;
-        int create_status = pClient->conn_properties.Create(buf.get() + offset, property_size);
+        int create_status = pClient->conn_properties.Create(buf.get() + offset, property_size, mqtt_pack_type::CONNECT);
         if (create_status != mqtt_err::ok) {
             lg->error("Read properties error!");
             return create_status;
@@ -34,51 +34,51 @@ int HandleMqttConnect(shared_ptr<Client>& pClient, const shared_ptr<uint8_t>& bu
     }
 
     //read ClientID
-    uint8_t id_len;
-    auto id = CreateMqttStringEntity(buf.get() + offset, id_len);
-    if (id != nullptr){
+    string_view id;
+    uint32_t id_size;
+    if (offset > fh.remaining_len || ReadString(buf.get() + offset, fh.remaining_len - offset, id, id_size) != mqtt_err::ok) return mqtt_err::read_err;
+    if (!id.empty()){
 		//auto check_fd = broker->GetClientFd(id->GetString());	
-		if (broker->CheckClientID(id->GetString()) == true){        
-    		lg->warn("[{}] client sent already existing id client {}", pClient->GetIP(), id->GetString());
+		if (!broker->ClaimClientID(fd, pClient, string(id), true)){
+    		lg->warn("[{}] client sent already existing id client {}", pClient->GetIP(), id);
 			//broker->CloseConnection(check_fd);            
 			return mqtt_err::duplicate_client_id;
         }
-        pClient->SetID(id->GetString());
         lg->debug("[{}] ID: {}", pClient->GetIP(), pClient->GetID());
     } else {
-        pClient->SetID(GenRandom(23));
+        broker->ClaimClientID(fd, pClient, GenRandom(23), false);
         lg->info("[{}] No ClientID provided, create new ID:{}", pClient->GetIP(), pClient->GetID());
         pClient->SetRandomID();
     }
-
-    if (id_len) offset += id_len;
-    else offset += 2;
+    offset += id_size;
 
     if (pClient->isWillFlag()){
-        uint32_t will_property_size;
-        int will_create_status = pClient->will_properties.Create(buf.get() + offset, will_property_size);
-        if (will_create_status != mqtt_err::ok){
-            lg->error("Read will properties error!");
-            return will_create_status;
+        //MQTT 3.1.1 has no will properties
+        if (pClient->GetClientMQTTVersion() == MQTT_VERSION_5){
+            uint32_t will_property_size;
+            int will_create_status = pClient->will_properties.Create(buf.get() + offset, will_property_size, PROPERTIES_OF_WILL);
+            if (will_create_status != mqtt_err::ok){
+                lg->error("Read will properties error!");
+                return will_create_status;
+            }
+            offset += will_property_size;
+            lg->debug("will properties count: {} ", pClient->will_properties.Count());
+            lg->flush();
         }
-        offset += will_property_size;
-        lg->debug("will properties count: {} ", pClient->will_properties.Count());
-        lg->flush();
 
-        uint16_t str_len = ConvertToHost2Bytes(buf.get() + offset);
-        offset += sizeof(str_len);
-        string will_topic_name = string((char *) (buf.get() + offset), str_len);
-        offset += str_len;
+        string_view will_topic_name, will_message;
+        uint32_t size;
+        if (offset > fh.remaining_len || ReadString(buf.get() + offset, fh.remaining_len - offset, will_topic_name, size) != mqtt_err::ok) return mqtt_err::read_err;
+        offset += size;
         lg->debug("will topic: {} WillQoS:{}", will_topic_name, pClient->WillQoSFlag());
         lg->flush();
 
-        uint16_t data_len = ConvertToHost2Bytes(buf.get() + offset);
-        offset += sizeof(data_len);
-
-        auto pMessage = make_shared<MqttBinaryDataEntity>(MqttBinaryDataEntity(data_len, buf.get() + offset));
+        if (ReadString(buf.get() + offset, fh.remaining_len - offset, will_message, size) != mqtt_err::ok) return mqtt_err::read_err;
+        //the will outlives the packet, so the message is copied
+        auto pMessage = make_shared<MqttBinaryDataEntity>(will_message.size(), reinterpret_cast<const uint8_t*>(will_message.data()));
 
         pClient->will_topic = MqttTopic(pClient->WillQoSFlag(), 1, will_topic_name, pMessage);
-        offset += data_len;
+        offset += size;
         lg->debug("will message len: {} ", pClient->will_topic.GetSize());
         lg->flush();
     }
@@ -86,53 +86,40 @@ int HandleMqttConnect(shared_ptr<Client>& pClient, const shared_ptr<uint8_t>& bu
     return mqtt_err::ok;
 }
 
-int HandleMqttPublish(std::shared_ptr<Client>& pClient, const FixedHeader &fh, const shared_ptr<uint8_t>& buf, shared_ptr<logger>& lg, PublishVH &vh, shared_ptr<MqttBinaryDataEntity> &message){
+//The topic name and the properties are read in place. The payload is not copied: the message shares
+//the packet buffer, which stays alive as long as the message is queued or retained.
+int HandleMqttPublish(std::shared_ptr<Client>& pClient, const FixedHeader &fh, const shared_ptr<uint8_t>& buf, shared_ptr<logger>& lg, PublishView &vh, shared_ptr<MqttBinaryDataEntity> &message){
     lg->debug("HandleMqttPublish");
-    uint32_t offset = 0;
-    PublishVH p_vh;
-
-    if (pClient->GetClientMQTTVersion() == MQTT_VERSION_5){
-        PublishVH tmp_vh(fh.QoS(), buf, offset);
-        p_vh = tmp_vh;
-    } else {
-        p_vh.topic_name = MqttStringEntity(ConvertToHost2Bytes(buf.get()), buf.get() + sizeof(uint16_t));
-        offset = p_vh.topic_name.Size();
-        if (fh.QoS() > mqtt_QoS::QoS_0){
-            p_vh.packet_id = ConvertToHost2Bytes(buf.get() + offset);
-            offset += sizeof(p_vh.packet_id);
-        }
-    }
+    const int status = vh.Read(fh, buf.get(), pClient->GetClientMQTTVersion());
+    if (status != mqtt_err::ok) return status;
 
-    lg->info("topic name:'{}' packet_id:{} property_count:{}", p_vh.topic_name.GetString(), p_vh.packet_id, p_vh.p_chain.Count());
-    vh = std::move(p_vh);
+    lg->info("topic name:'{}' packet_id:{} property_count:{}", vh.topic, vh.packet_id, vh.properties.Count());
 
     //read Payload
-    lg->debug("message:{} retained:{}", string((char *)(buf.get() + offset), fh.remaining_len - offset), fh.isRETAIN() ? true : false);
-    *message = MqttBinaryDataEntity(fh.remaining_len - offset, buf.get() + offset);
+    lg->debug("message:{} retained:{}", string_view(reinterpret_cast<const char*>(buf.get() + vh.payload_offset), vh.payload_len), fh.isRETAIN() ? true : false);
+    *message = MqttBinaryDataEntity(vh.payload_len, shared_ptr<uint8_t>(buf, buf.get() + vh.payload_offset));
 
     return mqtt_err::ok;
 }
 
 int HandleMqttSubscribe(shared_ptr<Client>& pClient, const FixedHeader &fh, const shared_ptr<uint8_t>& buf, shared_ptr<logger>& lg,
-                        SubscribeVH &vh, vector<uint8_t> &_reason_codes, list<pair<string, uint8_t>>& subscribe_topics){
+                        SubscribeView &vh, vector<uint8_t> &_reason_codes, list<pair<string, uint8_t>>& subscribe_topics){
     lg->debug("HandleMqttSubscribe");
-    uint32_t offset = 0;
-    vh = SubscribeVH(buf, offset, pClient->GetClientMQTTVersion());
-
-    while(offset < fh.remaining_len){
-        uint8_t options;
-        uint16_t name_len = ConvertToHost2Bytes(buf.get() + offset);
-        offset += sizeof(name_len);
-        string topic_name((char *) (buf.get() + offset), name_len);
-        offset += name_len;
-        memcpy(&options, buf.get() + offset, sizeof(options));
-        offset += sizeof(options);
-
-        pClient->AddSubscription(topic_name, options);
+    const int status = vh.Read(fh, buf.get(), pClient->GetClientMQTTVersion());
+    if (status != mqtt_err::ok) return status;
+
+    //only the accepted filters are copied, the subscription outlives the packet
+    vh.ForEach([&](const string_view topic_name, const uint8_t options){
+        if (!TopicTrie::isValidFilter(topic_name)){
+            //MQTT 3.1.1 has a single failure code
+            _reason_codes.push_back(pClient->GetClientMQTTVersion() == MQTT_VERSION_5 ? mqtt_reason_code::topic_filter_invalid : mqtt_reason_code::unspecified_error);
+            lg->warn("[{}] invalid topic filter:'{}'", pClient->GetIP(), topic_name);
+            return;
+        }
         _reason_codes.push_back(mqtt_QoS::QoS_2);
         subscribe_topics.emplace_back(topic_name, options);
         lg->info("[{}] subscribed to topic:'{}' QoS:{}", pClient->GetIP(), topic_name, options);
-    }
+    });
     lg->flush();
     return mqtt_err::ok;
 }
@@ -146,18 +133,14 @@ int HandleMqttPuback(const shared_ptr<uint8_t>& buf, shared_ptr<logger>& lg, Pub
 }
 
 int HandleMqttUnsubscribe(shared_ptr<Client>& pClient, const shared_ptr<uint8_t>& buf, const FixedHeader &fh,
-                          shared_ptr<logger>& lg, UnsubscribeVH&  p_vh, list<string> &topics_to_unsubscribe){
+                          shared_ptr<logger>& lg, SubscribeView&  p_vh, list<string> &topics_to_unsubscribe){
     lg->debug("HandleMqttUnsubscribe");
-    uint32_t offset = 0;
-    p_vh.ReadFromBuf(buf.get(), offset);
-    while(offset < fh.remaining_len){
-        uint16_t name_len = ConvertToHost2Bytes(buf.get() + offset);
-        offset += sizeof(name_len);
-        string topic_name((char *) buf.get() + offset, name_len);
-        offset += name_len;
-        topics_to_unsubscribe.push_back(topic_name);
+    const int status = p_vh.Read(fh, buf.get(), pClient->GetClientMQTTVersion());
+    if (status != mqtt_err::ok) return status;
+    p_vh.ForEach([&](const string_view topic_name, uint8_t){
+        topics_to_unsubscribe.emplace_back(topic_name);
         lg->info("{}: Unsubscribe topic:'{}'", pClient->GetIP(), topic_name);
-    }
+    });
     lg->flush();
     return mqtt_err::ok;
 }
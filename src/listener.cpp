@@ -0,0 +1,75 @@
+#include "listener.h"
+
+#include <cerrno>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+using namespace std;
+
+Listener::Listener(ListenerCfg _cfg) : cfg(std::move(_cfg)) {}
+
+Listener::~Listener(){
+    if (fd >= 0) close(fd);
+}
+
+//The address is numeric (IPv4 or IPv6): no resolver in a static binary
+listener_err Listener::Open(const char*& failed_option){
+    struct sockaddr_storage addr{};
+    socklen_t addr_len;
+    auto addr4 = (struct sockaddr_in*) &addr;
+    auto addr6 = (struct sockaddr_in6*) &addr;
+    if (inet_pton(AF_INET, cfg.address.c_str(), &addr4->sin_addr) == 1){
+        addr4->sin_family = AF_INET;
+        addr4->sin_port = htons(cfg.port);
+        addr_len = sizeof(*addr4);
+    } else if (inet_pton(AF_INET6, cfg.address.c_str(), &addr6->sin6_addr) == 1){
+        addr6->sin6_family = AF_INET6;
+        addr6->sin6_port = htons(cfg.port);
+        addr_len = sizeof(*addr6);
+    } else {
+        errno = EINVAL;
+        return listener_err::address_err;
+    }
+
+    fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return listener_err::socket_err;
+    failed_option = Tune(fd, true);
+    //the address may still be held by the previous run
+    while (bind(fd, (struct sockaddr*) &addr, addr_len) < 0){
+        if (errno != EADDRINUSE) return listener_err::bind_err;
+        sleep(5);
+    }
+    if (listen(fd, cfg.backlog) < 0) return listener_err::listen_err;
+    return listener_err::ok;
+}
+
+//Returns the name of the last option the kernel refused, nullptr if all were applied
+const char* Listener::Tune(const int sock, const bool listen_socket) const {
+    const char* failed = nullptr;
+    auto set = [sock, &failed](int level, int name, int val, const char* opt_name){
+        if (setsockopt(sock, level, name, &val, sizeof(val)) < 0) failed = opt_name;
+    };
+    if (cfg.tcp_nodelay)        set(IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    if (cfg.tcp_quickack)       set(IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+    if (cfg.sndbuf > 0)         set(SOL_SOCKET, SO_SNDBUF, cfg.sndbuf, "SO_SNDBUF");
+    if (cfg.rcvbuf > 0)         set(SOL_SOCKET, SO_RCVBUF, cfg.rcvbuf, "SO_RCVBUF");
+    if (cfg.user_timeout > 0)   set(IPPROTO_TCP, TCP_USER_TIMEOUT, (int) cfg.user_timeout, "TCP_USER_TIMEOUT");
+    if (cfg.busy_poll > 0)      set(SOL_SOCKET, SO_BUSY_POLL, cfg.busy_poll, "SO_BUSY_POLL");
+    if (listen_socket){
+        //the connection is queued for accept only when the first data (CONNECT) has arrived
+        if (cfg.defer_accept > 0)   set(IPPROTO_TCP, TCP_DEFER_ACCEPT, cfg.defer_accept, "TCP_DEFER_ACCEPT");
+        if (cfg.fastopen > 0)       set(IPPROTO_TCP, TCP_FASTOPEN, cfg.fastopen, "TCP_FASTOPEN");
+    }
+    return failed;
+}
+
+int Listener::GetFd() const noexcept {
+    return fd;
+}
+
+const ListenerCfg& Listener::GetCfg() const noexcept {
+    return cfg;
+}
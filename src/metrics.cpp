@@ -0,0 +1,25 @@
+#include "metrics.h"
+
+using namespace std;
+
+void Metrics::Sample(){
+    const uint64_t cur_accepted = accepted.load(memory_order_relaxed);
+    accept_rate.store(cur_accepted - last_accepted, memory_order_relaxed);
+    last_accepted = cur_accepted;
+}
+
+uint64_t Metrics::GetAcceptRate() const noexcept {
+    return accept_rate.load(memory_order_relaxed);
+}
+
+string Metrics::Format() const {
+    string res;
+    res += "accepted:"          + to_string(accepted.load(memory_order_relaxed)) + "\n";
+    res += "accept_errors:"     + to_string(accept_errors.load(memory_order_relaxed)) + "\n";
+    res += "accepts_per_sec:"   + to_string(GetAcceptRate()) + "\n";
+    res += "publish_dropped:"   + to_string(publish_dropped.load(memory_order_relaxed)) + "\n";
+    res += "quota_disconnects:" + to_string(quota_disconnects.load(memory_order_relaxed)) + "\n";
+    res += "subscriber_cache_hits:"   + to_string(subscriber_cache_hits.load(memory_order_relaxed)) + "\n";
+    res += "subscriber_cache_misses:" + to_string(subscriber_cache_misses.load(memory_order_relaxed)) + "\n";
+    return res;
+}
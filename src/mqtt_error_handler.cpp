@@ -7,6 +7,15 @@ IMqttErrorHandler::IMqttErrorHandler(const int _err) : error(_err) {}
 
 int IMqttErrorHandler::GetErr() {return error;}
 
+//The refusing CONNACK goes through the outbound queue in order and without blocking the shard,
+//the queue is flushed once more when the connection is closed right after
+static void RefuseConnect(Broker& broker, const int fd, const uint8_t reason_code){
+    uint32_t answer_size;
+    VariableHeader answer_vh{unique_ptr<IVariableHeader>(new ConnactVH(0, reason_code, MqttPropertyChain{}))};
+    auto data = CreateMqttPacket(FHBuilder().PacketType(mqtt_pack_type::CONNACK).Build(), answer_vh, answer_size);
+    broker.AbortOutbound(fd, tuple{answer_size, data});
+}
+
 //Disconnect
 MqttDisconnectErr::MqttDisconnectErr() : IMqttErrorHandler(mqtt_err::disconnect) {}
 
@@ -19,23 +28,15 @@ MqttProtocolVersionErr::MqttProtocolVersionErr() : IMqttErrorHandler(mqtt_err::p
 
 void MqttProtocolVersionErr::HandleError(Broker& broker, const int fd){
     broker.lg->error("Protocol version err");
-    uint32_t answer_size;
-    VariableHeader answer_vh{unique_ptr<IVariableHeader>(new ConnactVH(0, unsupported_protocol_version, MqttPropertyChain{}))};
-    auto data = CreateMqttPacket(FHBuilder().PacketType(mqtt_pack_type::CONNACK).Build(), answer_vh, answer_size);
-
-    WriteData(fd, data.get(), answer_size);
+    RefuseConnect(broker, fd, unsupported_protocol_version);
 }
 
 //unsupported_protocol_version
 MqttDuplicateIDErr::MqttDuplicateIDErr() : IMqttErrorHandler(mqtt_err::duplicate_client_id) {}
 
 void MqttDuplicateIDErr::HandleError(Broker& broker, const int fd){
-    broker.lg->error("Protocol version err");
-    uint32_t answer_size;
-    VariableHeader answer_vh{unique_ptr<IVariableHeader>(new ConnactVH(0, client_identifier_not_valid, MqttPropertyChain{}))};
-    auto data = CreateMqttPacket(FHBuilder().PacketType(mqtt_pack_type::CONNACK).Build(), answer_vh, answer_size);
-
-    WriteData(fd, data.get(), answer_size);
+    broker.lg->error("Duplicate client id err");
+    RefuseConnect(broker, fd, client_identifier_not_valid);
 }
 
 //handle error
@@ -16,30 +16,30 @@ MqttConnectPacketHandler::MqttConnectPacketHandler() : IMqttPacketHandler(mqtt_p
 
 int MqttConnectPacketHandler::HandlePacket([[maybe_unused]] const FixedHeader& f_header, const shared_ptr<uint8_t> &data, Broker *broker, const int fd){
     broker->lg->debug("handleConnect");
-    auto pClient = broker->clients[fd];
+    auto pClient = broker->GetClient(fd);
 	
 	if (pClient == nullptr){
 		broker->lg->error("handleConnect error, pClient is nullptr"); 
 		return 	mqtt_err::handle_error;
 	}
 
-    int handle_stat = HandleMqttConnect(pClient, data, broker->lg, broker);
+    int handle_stat = HandleMqttConnect(fd, pClient, f_header, data, broker->lg, broker);
     if (handle_stat != mqtt_err::ok){
         broker->lg->error("[{}] handleConnect error, handle_stat: {}", pClient->GetIP(), handle_stat);
         return handle_stat;
     }
 
-    for(auto it = pClient->conn_properties.Cbegin(); it != pClient->conn_properties.Cend(); ++it) {
-        broker->lg->debug("[{}] property id:{} val:{}", pClient->GetIP(), it->first, it->second->GetUint());
+    for(const auto& property : pClient->conn_properties) {
+        broker->lg->debug("[{}] property id:{} val:{}", pClient->GetIP(), property.GetId(), property.GetUint());
     }
 
     uint32_t answer_size;
     MqttPropertyChain p_chain;
-    if (pClient->isRandomID()) p_chain.AddProperty(make_shared<MqttProperty>(assigned_client_identifier, shared_ptr<MqttEntity>(new MqttStringEntity(pClient->GetID()))));
-    p_chain.AddProperty(make_shared<MqttProperty>(retain_available, shared_ptr<MqttEntity>(new MqttByteEntity(1))));
-    p_chain.AddProperty(make_shared<MqttProperty>(maximum_packet_size, shared_ptr<MqttEntity>(new MqttFourByteEntity(65535))));
-    p_chain.AddProperty(make_shared<MqttProperty>(wildcard_subscription_available, shared_ptr<MqttEntity>(new MqttByteEntity((uint8_t)0))));
-    p_chain.AddProperty(make_shared<MqttProperty>(shared_subscription_available, shared_ptr<MqttEntity>(new MqttByteEntity((uint8_t)0))));
+    if (pClient->isRandomID()) p_chain.AddProperty(MqttProperty(assigned_client_identifier, MqttStringEntity(pClient->GetID())));
+    p_chain.AddProperty(MqttProperty(retain_available, MqttByteEntity(1)));
+    p_chain.AddProperty(MqttProperty(maximum_packet_size, MqttFourByteEntity(65535)));
+    p_chain.AddProperty(MqttProperty(wildcard_subscription_available, MqttByteEntity((uint8_t)1)));
+    p_chain.AddProperty(MqttProperty(shared_subscription_available, MqttByteEntity((uint8_t)1)));
 
     VariableHeader answer_vh{shared_ptr<IVariableHeader>(new ConnactVH(!pClient->isCleanFlag(),success, std::move(p_chain)))};
     broker->AddCommand(fd, tuple{answer_size, CreateMqttPacket(FHBuilder().PacketType(CONNACK).Build(), answer_vh, answer_size)});
@@ -51,55 +51,40 @@ int MqttConnectPacketHandler::HandlePacket([[maybe_unused]] const FixedHeader& f
 MqttPublishPacketHandler::MqttPublishPacketHandler(): IMqttPacketHandler(mqtt_pack_type::PUBLISH) {}
 
 int MqttPublishPacketHandler::HandlePacket(const FixedHeader& f_header, const shared_ptr<uint8_t> &data, Broker *broker, int fd){
-    PublishVH vh;
+    PublishView vh;
     auto pMessage = make_shared<MqttBinaryDataEntity>();
-    auto pClient = broker->clients[fd];
+    auto pClient = broker->GetClient(fd);
 
     int handle_stat = HandleMqttPublish(pClient, f_header, data, broker->lg, vh, pMessage);
     if (handle_stat != mqtt_err::ok){
         broker->lg->error("[{}] handle PUBLISH error", pClient->GetIP());
         return handle_stat;
     }
-    broker->lg->info("[{}] topic name:'{}' packet_id:{} property_count:{}",pClient->GetIP(), vh.topic_name.GetString(), vh.packet_id, vh.p_chain.Count());
+    broker->lg->info("[{}] topic name:'{}' packet_id:{} property_count:{}",pClient->GetIP(), vh.topic, vh.packet_id, vh.properties.Count());
+    //the name is interned once, the retained store and the routing share it
+    auto topic = MqttTopic(f_header.QoS(), vh.packet_id, vh.topic, pMessage);
     if (f_header.isRETAIN()){
-        broker->lg->info("[{}] Store topic:{}",pClient->GetIP(), vh.topic_name.GetString());
-        broker->StoreTopicValue(f_header.QoS(), vh.packet_id, vh.topic_name.GetString(), pMessage);
+        broker->lg->info("[{}] Store topic:{}",pClient->GetIP(), topic.GetName());
+        broker->StoreTopicValue(topic);
     }
     if (f_header.QoS() == mqtt_QoS::QoS_1){
-        uint32_t answer_size;
-        if (pClient->GetClientMQTTVersion() == MQTT_VERSION_5) {
-            VariableHeader answer_vh{shared_ptr<IVariableHeader>(new PubackVH(vh.packet_id, success, MqttPropertyChain()))};
-            broker->AddCommand(fd, tuple{answer_size, CreateMqttPacket(FHBuilder().PacketType(PUBACK).Build(), answer_vh, answer_size)});
-        } else {
-            VariableHeader answer_vh{shared_ptr<IVariableHeader>(new TypicalV3VH(vh.packet_id))};
-            broker->AddCommand(fd, tuple{answer_size, CreateMqttPacket(FHBuilder().PacketType(PUBACK).Build(), answer_vh, answer_size)});
-        }
+        uint8_t answer[ACK_MAX_SIZE];
+        broker->AddCommand(fd, answer, EncodeAck(answer, PUBACK, pClient->GetClientMQTTVersion(), vh.packet_id));
     } else if (f_header.QoS() == mqtt_QoS::QoS_2){
-        uint32_t answer_size;
-        if (pClient->GetClientMQTTVersion() == MQTT_VERSION_5){
-            VariableHeader answer_vh{shared_ptr<IVariableHeader>(new TypicalVH(vh.packet_id, success, MqttPropertyChain()))};
-            if (!broker->CheckIfMoreMessages(pClient->GetID())){
-                auto data_packet = CreateMqttPacket(FHBuilder().PacketType(PUBREC).Build(), answer_vh, answer_size);
-                broker->AddCommand(fd, tuple{answer_size, data_packet});
-            } else {
-                auto data_packet = CreateMqttPacket(FHBuilder().PacketType(PUBREC).WithDup().Build(), answer_vh, answer_size);
-                broker->AddQosEvent(pClient->GetID(), mqtt_packet{answer_size, data_packet, vh.packet_id});
-            }
+        uint8_t answer[ACK_MAX_SIZE];
+        const uint32_t answer_size = EncodeAck(answer, PUBREC, pClient->GetClientMQTTVersion(), vh.packet_id);
+        if (!broker->CheckIfMoreMessages(pClient->GetID())){
+            broker->AddCommand(fd, answer, answer_size);
         } else {
-            VariableHeader answer_vh{shared_ptr<IVariableHeader>(new TypicalV3VH(vh.packet_id))};
-            if (!broker->CheckIfMoreMessages(pClient->GetID())){
-                auto data_packet = CreateMqttPacket(FHBuilder().PacketType(PUBREC).Build(), answer_vh, answer_size);
-                broker->AddCommand(fd, tuple{answer_size, data_packet});
-            } else {
-                auto data_packet = CreateMqttPacket(FHBuilder().PacketType(PUBREC).WithDup().Build(), answer_vh, answer_size);
-                broker->AddQosEvent(pClient->GetID(), mqtt_packet{answer_size, data_packet, vh.packet_id});
-            }
+            //kept until the earlier messages are acknowledged, so it needs its own buffer
+            auto data_packet = shared_ptr<uint8_t>(new uint8_t[answer_size], default_delete<uint8_t[]>());
+            memcpy(data_packet.get(), answer, answer_size);
+            data_packet.get()[0] = FHBuilder().PacketType(PUBREC).WithDup().Build();
+            broker->AddQosEvent(pClient->GetID(), mqtt_packet{answer_size, data_packet, vh.packet_id});
         }
         broker->lg->info("[{}] {} ------>", pClient->GetIP(), broker->GetControlPacketTypeName(PUBREC));
     }
-    auto topic = MqttTopic(f_header.QoS(), vh.packet_id, vh.topic_name.GetString(), pMessage);
-
-    if (f_header.QoS() != mqtt_QoS::QoS_2) broker->NotifyClients(topic);
+    if (f_header.QoS() != mqtt_QoS::QoS_2) broker->NotifyClients(topic, pClient->GetID());
     else broker->AddQoSTopic(pClient->GetID(), topic);
 
     return mqtt_err::ok;
@@ -109,35 +94,48 @@ int MqttPublishPacketHandler::HandlePacket(const FixedHeader& f_header, const sh
 MqttSubscribePacketHandler::MqttSubscribePacketHandler() : IMqttPacketHandler(mqtt_pack_type::SUBSCRIBE){}
 
 int MqttSubscribePacketHandler::HandlePacket(const FixedHeader& f_header, const shared_ptr<uint8_t> &data, Broker *broker, int fd){
-    SubscribeVH vh;
+    SubscribeView vh;
     vector<uint8_t> reason_codes;
     list<pair<string, uint8_t>> tpcs;
-    auto pClient = broker->clients[fd];
+    auto pClient = broker->GetClient(fd);
 
     int handle_stat = HandleMqttSubscribe(pClient, f_header, data, broker->lg, vh, reason_codes, tpcs);
     if (handle_stat != mqtt_err::ok){
-        broker->lg->error("[{}] handle SUBSCRIBE error", broker->clients[fd]->GetIP());
+        broker->lg->error("[{}] handle SUBSCRIBE error", broker->GetClient(fd)->GetIP());
         return handle_stat;
     }
+    for (const auto& it : tpcs) broker->Subscribe(fd, pClient, it.first, it.second);
 
-    //broker->lg->info("[{}] Subscribe. id:{} property count:{}", broker->clients[fd]->GetIP(), vh.packet_id, vh.p_chain.Count());
-    for(auto it = vh.p_chain.Cbegin(); it != vh.p_chain.Cend(); ++it) {
-        broker->lg->debug("[{}] property id:{} val:{}", pClient->GetIP(), it->first,
-                         it->second->GetUint());
-    }
+    //broker->lg->info("[{}] Subscribe. id:{} property count:{}", broker->GetClient(fd)->GetIP(), vh.packet_id, vh.p_chain.Count());
+    vh.properties.ForEach([&](const PropertyView& property){
+        broker->lg->debug("[{}] property id:{} val:{}", pClient->GetIP(), property.id, property.value);
+    });
     VariableHeader answer_vh{shared_ptr<IVariableHeader>(new SubackVH(vh.packet_id, MqttPropertyChain(), reason_codes))};
     uint32_t answer_size;
     broker->AddCommand(fd, tuple{answer_size, CreateMqttPacket(FHBuilder().PacketType(SUBACK).Build(), answer_vh, answer_size)});
     broker->lg->info("[{}] {} ------>", pClient->GetIP(), broker->GetControlPacketTypeName(SUBACK));
 
     for (const auto& it : tpcs){
+        //retained messages are not sent for a shared subscription
+        string_view group, filter;
+        if (TopicTrie::isShared(it.first, group, filter)) continue;
         broker->lg->info("[{}] serach for topic name:'{}' among retained", pClient->GetIP(), it.first);
+        if (TopicTrie::isWildcard(it.first)){
+            vector<MqttTopic> retained;
+            broker->GetMatchingTopics(it.first, retained);
+            for (auto& retain_topic : retained){
+                broker->lg->debug("[{}] Found retain topic:{}",  pClient->GetIP(), retain_topic.GetName()); broker->lg->flush();
+                retain_topic.SetQos(it.second & 0x03);
+                broker->NotifyClient(fd, retain_topic);
+            }
+            continue;
+        }
         bool found;
         auto retain_topic = broker->GetTopic(it.first, found);
 
         if(found){
             broker->lg->debug("[{}] Found retain topic:{}",  pClient->GetIP(), it.first); broker->lg->flush();
-            retain_topic.SetQos(it.second);
+            retain_topic.SetQos(it.second & 0x03);
             broker->NotifyClient(fd, retain_topic);
         }
     }
@@ -149,20 +147,14 @@ MqttPubAckPacketHandler::MqttPubAckPacketHandler() : IMqttPacketHandler(mqtt_pac
 
 int MqttPubAckPacketHandler::HandlePacket([[maybe_unused]] const FixedHeader& f_header, const shared_ptr<uint8_t> &data, Broker *broker, int fd){
     PubackVH p_vh;
-    auto pClient = broker->clients[fd];
+    auto pClient = broker->GetClient(fd);
 
     HandleMqttPuback(data, broker->lg, p_vh);
-    broker->lg->debug("[{}] puback: id:{}",  broker->clients[fd]->GetIP(), p_vh.packet_id); broker->lg->flush();
+    broker->lg->debug("[{}] puback: id:{}",  broker->GetClient(fd)->GetIP(), p_vh.packet_id); broker->lg->flush();
     broker->DelQosEvent(pClient->GetID(), p_vh.packet_id);
 
-    if (broker->CheckIfMoreMessages(pClient->GetID())){
-        //broker->lg->debug("[{}] There are more messages", broker->clients[fd]->GetIP()); broker->lg->flush();
-        bool found;
-        auto data_mes = broker->GetPacket(pClient->GetID(), found);
-        if (found){
-            broker->lg->debug("[{}] found kept message", pClient->GetIP()); broker->lg->flush();
-            broker->AddCommand(fd, tuple{data_mes.first, data_mes.second});
-        }
+    if (broker->SendPostponed(fd, pClient->GetID())){
+        broker->lg->debug("[{}] found kept message", pClient->GetIP()); broker->lg->flush();
     }
     broker->lg->flush();
     return mqtt_err::ok;
@@ -172,9 +164,9 @@ int MqttPubAckPacketHandler::HandlePacket([[maybe_unused]] const FixedHeader& f_
 MqttDisconnectPacketHandler::MqttDisconnectPacketHandler() : IMqttPacketHandler(mqtt_pack_type::DISCONNECT){}
 
 int MqttDisconnectPacketHandler::HandlePacket([[maybe_unused]] const FixedHeader& f_header, [[maybe_unused]] const shared_ptr<uint8_t> &data, Broker *broker, int fd){
-    broker->lg->info("[{}] Client has disconnected", broker->clients[fd]->GetIP());
+    broker->lg->info("[{}] Client has disconnected", broker->GetClient(fd)->GetIP());
     if (data && f_header.remaining_len > 0) {
-        broker->lg->info("[{}] reason code: {}", broker->clients[fd]->GetIP(), data.get()[0]);
+        broker->lg->info("[{}] reason code: {}", broker->GetClient(fd)->GetIP(), data.get()[0]);
     }
     return mqtt_err::disconnect;
 }
@@ -183,10 +175,10 @@ int MqttDisconnectPacketHandler::HandlePacket([[maybe_unused]] const FixedHeader
 MqttPingPacketHandler::MqttPingPacketHandler() : IMqttPacketHandler(mqtt_pack_type::PINGREQ){}
 
 int MqttPingPacketHandler::HandlePacket([[maybe_unused]] const FixedHeader& f_header, [[maybe_unused]] const shared_ptr<uint8_t> &data, Broker *broker, int fd){
-	auto pClient = broker->clients[fd];   
+	auto pClient = broker->GetClient(fd);   
 	broker->lg->info("[{}] PINGREQ", pClient->GetIP());
-    uint32_t answer_size;
-    broker->AddCommand(fd, tuple{answer_size, CreateMqttPacket(FHBuilder().PacketType(PINGRESP).Build(), answer_size)});
+    uint8_t answer[ACK_MAX_SIZE];
+    broker->AddCommand(fd, answer, EncodeAck(answer, PINGRESP, pClient->GetClientMQTTVersion(), 0));
     broker->lg->info("[{}] {} ------>", pClient->GetIP(), broker->GetControlPacketTypeName(PINGRESP));
     return mqtt_err::ok;
 }
@@ -195,15 +187,16 @@ int MqttPingPacketHandler::HandlePacket([[maybe_unused]] const FixedHeader& f_he
 MqttUnsubscribePacketHandler::MqttUnsubscribePacketHandler() : IMqttPacketHandler(mqtt_pack_type::UNSUBSCRIBE){}
 
 int MqttUnsubscribePacketHandler::HandlePacket(const FixedHeader& f_header, const shared_ptr<uint8_t> &data, Broker *broker, int fd){
-    auto pClient = broker->clients[fd];
+    auto pClient = broker->GetClient(fd);
     broker->lg->info("[{}] UNSUBSCRIBE", pClient->GetIP());
-    UnsubscribeVH u_vh;
+    SubscribeView u_vh;
     list<string> topics_to_unsubscribe;
-    HandleMqttUnsubscribe(pClient, data, f_header, broker->lg, u_vh, topics_to_unsubscribe);
+    int handle_stat = HandleMqttUnsubscribe(pClient, data, f_header, broker->lg, u_vh, topics_to_unsubscribe);
+    if (handle_stat != mqtt_err::ok) return handle_stat;
 
     vector<uint8_t> reason_codes;
     for(const auto& it : topics_to_unsubscribe){
-        if (pClient->DelSubscription(it)) reason_codes.push_back(mqtt_reason_code::success);
+        if (broker->Unsubscribe(fd, pClient, it)) reason_codes.push_back(mqtt_reason_code::success);
         else reason_codes.push_back(mqtt_reason_code::no_subscription_existed);
     }
 
@@ -219,36 +212,25 @@ MqttPubRelPacketHandler::MqttPubRelPacketHandler() : IMqttPacketHandler(mqtt_pac
 
 int MqttPubRelPacketHandler::HandlePacket([[maybe_unused]] const FixedHeader& f_header, const shared_ptr<uint8_t> &data, Broker *broker, int fd){
     TypicalVH t_vh;
-    auto pClient = broker->clients[fd];
+    auto pClient = broker->GetClient(fd);
 
     HandleMqttPubrel(data, broker->lg, t_vh);
     broker->lg->debug("[{}] pubrel: id:{}", pClient->GetIP(), t_vh.packet_id);
 
-    uint32_t answer_size;
-    if (pClient->GetClientMQTTVersion() == MQTT_VERSION_5){
-        VariableHeader answer_vh{shared_ptr<IVariableHeader>(new TypicalVH(t_vh.packet_id, success, MqttPropertyChain()))};
-        broker->AddCommand(fd, tuple{answer_size, CreateMqttPacket(FHBuilder().PacketType(PUBCOMP).Build(), answer_vh, answer_size)});
-    } else {
-        VariableHeader answer_vh{shared_ptr<IVariableHeader>(new TypicalV3VH(t_vh.packet_id))};
-        broker->AddCommand(fd, tuple{answer_size, CreateMqttPacket(FHBuilder().PacketType(PUBCOMP).Build(), answer_vh, answer_size)});
-    }
+    uint8_t answer[ACK_MAX_SIZE];
+    broker->AddCommand(fd, answer, EncodeAck(answer, PUBCOMP, pClient->GetClientMQTTVersion(), t_vh.packet_id));
     broker->DelQosEvent(pClient->GetID(), t_vh.packet_id);
     broker->lg->info("[{}] {} ------>", pClient->GetIP(), broker->GetControlPacketTypeName(PUBCOMP));
 
-    if (broker->CheckIfMoreMessages(pClient->GetID())){
-        bool found;
-        auto data_mes = broker->GetPacket(pClient->GetID(), found);
-        if (found){
-            broker->lg->debug("[{}] found kept message", pClient->GetIP()); broker->lg->flush();
-            broker->AddCommand(fd, tuple{data_mes.first, data_mes.second});
-        }
+    if (broker->SendPostponed(fd, pClient->GetID())){
+        broker->lg->debug("[{}] found kept message", pClient->GetIP()); broker->lg->flush();
     }
 
     bool found;
     auto topic = broker->GetQoSTopic(pClient->GetID(), t_vh.packet_id, found);
     if (found){
         broker->lg->debug("[{}] Have found packet_id", pClient->GetIP());
-        broker->NotifyClients(topic);
+        broker->NotifyClients(topic, pClient->GetID());
         broker->DelQoSTopic(pClient->GetID(), t_vh.packet_id);
         broker->lg->debug("[{}] Delete from storage. topic count:{}",  pClient->GetIP(), broker->GetQoSTopicCount());
     } else {
@@ -265,18 +247,12 @@ MqttPubRecPacketHandler::MqttPubRecPacketHandler() : IMqttPacketHandler(mqtt_pac
 int MqttPubRecPacketHandler::HandlePacket([[maybe_unused]] const FixedHeader& f_header, const shared_ptr<uint8_t> &data, Broker *broker, int fd){
     TypicalVH t_vh;
     HandleMqttPuback(data, broker->lg, t_vh);
-    broker->lg->debug("[{}] pubrec: id:{}",  broker->clients[fd]->GetIP(), t_vh.packet_id);
-    auto pClient = broker->clients[fd];
+    broker->lg->debug("[{}] pubrec: id:{}",  broker->GetClient(fd)->GetIP(), t_vh.packet_id);
+    auto pClient = broker->GetClient(fd);
     broker->DelQosEvent(pClient->GetID(), t_vh.packet_id);
 
-    uint32_t answer_size;
-    if (pClient->GetClientMQTTVersion() == MQTT_VERSION_5) {
-        VariableHeader answer_vh{shared_ptr<IVariableHeader>(new TypicalVH(t_vh.packet_id, success, MqttPropertyChain()))};
-        broker->AddCommand(fd, tuple{answer_size, CreateMqttPacket(FHBuilder().PacketType(PUBREL).Build() | 1 << 1, answer_vh, answer_size)});
-    } else {
-        VariableHeader answer_vh{shared_ptr<IVariableHeader>(new TypicalV3VH(t_vh.packet_id))};
-        broker->AddCommand(fd, tuple{answer_size, CreateMqttPacket(FHBuilder().PacketType(PUBREL).Build() | 1 << 1, answer_vh, answer_size)});
-    }
+    uint8_t answer[ACK_MAX_SIZE];
+    broker->AddCommand(fd, answer, EncodeAck(answer, PUBREL, pClient->GetClientMQTTVersion(), t_vh.packet_id));
 
     broker->lg->info("[{}] {} ------>", pClient->GetIP(), broker->GetControlPacketTypeName(PUBREL));
     return mqtt_err::ok;
@@ -288,16 +264,11 @@ MqttPubCompPacketHandler::MqttPubCompPacketHandler() : IMqttPacketHandler(mqtt_p
 int MqttPubCompPacketHandler::HandlePacket([[maybe_unused]] const FixedHeader& f_header, const shared_ptr<uint8_t> &data, Broker *broker, int fd){
     TypicalVH t_vh;
     HandleMqttPuback(data, broker->lg, t_vh);
-    broker->lg->debug("[{}] pubcomp: id:{} reason_code:{}",  broker->clients[fd]->GetIP(), t_vh.packet_id, t_vh.reason_code);
+    broker->lg->debug("[{}] pubcomp: id:{} reason_code:{}",  broker->GetClient(fd)->GetIP(), t_vh.packet_id, t_vh.reason_code);
 
-    auto pClient = broker->clients[fd];
-    if (broker->CheckIfMoreMessages(pClient->GetID())){
-        bool found;
-        auto data_mes = broker->GetPacket(pClient->GetID(), found);
-        if (found){
-            broker->lg->debug("[{}] found kept message", broker->clients[fd]->GetIP()); broker->lg->flush();
-            broker->AddCommand(fd, tuple{data_mes.first, data_mes.second});
-        }
+    auto pClient = broker->GetClient(fd);
+    if (broker->SendPostponed(fd, pClient->GetID())){
+        broker->lg->debug("[{}] found kept message", pClient->GetIP()); broker->lg->flush();
     }
 
     broker->lg->flush();
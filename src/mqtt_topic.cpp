@@ -3,16 +3,22 @@
 using namespace mqtt_protocol;
 using namespace std;
 
-MqttTopic::MqttTopic(uint8_t _qos, uint16_t _id, const string &_name, const shared_ptr<MqttBinaryDataEntity> &_data) : qos(_qos), id(_id), name(_name), data(_data){
+static const string empty_name{};
+
+MqttTopic::MqttTopic(uint8_t _qos, uint16_t _id, string_view _name, const shared_ptr<MqttBinaryDataEntity> &_data) : qos(_qos), id(_id), name(TopicNames::Intern(_name)), data(_data){
+    if (qos > 2) qos = 0;
+}
+
+MqttTopic::MqttTopic(uint8_t _qos, uint16_t _id, shared_ptr<const TopicName> _name, const shared_ptr<MqttBinaryDataEntity> &_data) : qos(_qos), id(_id), name(std::move(_name)), data(_data){
     if (qos > 2) qos = 0;
 }
 
 bool MqttTopic::operator==(const string &str){
-    return name == str;
+    return GetName() == str;
 }
 
 bool MqttTopic::operator <(const MqttTopic& _topic) const{
-    return name < _topic.name;
+    return GetName() < _topic.GetName();
 }
 
 uint32_t MqttTopic::GetSize(){
@@ -43,10 +49,19 @@ uint8_t MqttTopic::GetQoS() const{
     return qos;
 }
 
-string MqttTopic::GetName() const{
+const string& MqttTopic::GetName() const{
+    return name != nullptr ? name->name : empty_name;
+}
+
+const shared_ptr<const TopicName>& MqttTopic::GetTopicName() const noexcept {
     return name;
 }
 
+//0 - no name
+uint32_t MqttTopic::GetNameID() const noexcept {
+    return name != nullptr ? name->id : 0;
+}
+
 void MqttTopic::SetPacketID(uint16_t new_id){
     id = new_id;
 }
@@ -56,5 +71,5 @@ void MqttTopic::SetQos(uint8_t _qos){
 }
 
 void MqttTopic::SetName(const string& _name){
-    name = _name;
+    name = TopicNames::Intern(_name);
 }
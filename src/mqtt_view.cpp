@@ -0,0 +1,148 @@
+#include "mqtt_view.h"
+
+using namespace mqtt_protocol;
+using namespace std;
+
+int mqtt_protocol::ReadString(const uint8_t* buf, const uint32_t avail, string_view& str, uint32_t& size){
+    if (avail < sizeof(uint16_t)) return mqtt_err::read_err;
+    const uint16_t len = ConvertToHost2Bytes(buf);
+    if (avail - sizeof(uint16_t) < len) return mqtt_err::read_err;
+    str = string_view(reinterpret_cast<const char*>(buf + sizeof(uint16_t)), len);
+    size = sizeof(uint16_t) + len;
+    return mqtt_err::ok;
+}
+
+//reads the value of a property of the wire type, value points after the property id
+template <uint8_t Type>
+static int ReadValue(const uint8_t* value, const uint32_t left, PropertyView& property, uint32_t& size){
+    if constexpr (Type == mqtt_data_type::byte){
+        if (left < 1) return mqtt_err::mqtt_property_err;
+        property.value = value[0];
+        size = 1;
+    } else if constexpr (Type == mqtt_data_type::two_byte){
+        if (left < 2) return mqtt_err::mqtt_property_err;
+        property.value = ConvertToHost2Bytes(value);
+        size = 2;
+    } else if constexpr (Type == mqtt_data_type::four_byte){
+        if (left < 4) return mqtt_err::mqtt_property_err;
+        property.value = ConvertToHost4Bytes(value);
+        size = 4;
+    } else if constexpr (Type == mqtt_data_type::mqtt_string || Type == mqtt_data_type::binary_data){
+        if (ReadString(value, left, property.str, size) != mqtt_err::ok) return mqtt_err::mqtt_property_err;
+    } else if constexpr (Type == mqtt_data_type::mqtt_string_pair){
+        uint32_t name_size, value_size;
+        if (ReadString(value, left, property.str, name_size) != mqtt_err::ok) return mqtt_err::mqtt_property_err;
+        if (ReadString(value + name_size, left - name_size, property.str2, value_size) != mqtt_err::ok) return mqtt_err::mqtt_property_err;
+        size = name_size + value_size;
+    } else if constexpr (Type == mqtt_data_type::variable_int){
+        uint8_t vint_size;
+        if (DecodeVarInt(value, left, property.value, vint_size) != mqtt_err::ok) return mqtt_err::mqtt_property_err;
+        size = vint_size;
+    } else {
+        return mqtt_err::mqtt_property_err;
+    }
+    return mqtt_err::ok;
+}
+
+//indexed by mqtt_data_type
+using ValueReader = int (*)(const uint8_t*, uint32_t, PropertyView&, uint32_t&);
+static constexpr ValueReader value_readers[] = {
+    ReadValue<mqtt_data_type::undefined>,
+    ReadValue<mqtt_data_type::byte>,
+    ReadValue<mqtt_data_type::two_byte>,
+    ReadValue<mqtt_data_type::four_byte>,
+    ReadValue<mqtt_data_type::mqtt_string>,
+    ReadValue<mqtt_data_type::binary_data>,
+    ReadValue<mqtt_data_type::mqtt_string_pair>,
+    ReadValue<mqtt_data_type::variable_int>
+};
+static_assert(sizeof(value_readers) / sizeof(value_readers[0]) == mqtt_data_type::variable_int + 1);
+
+int mqtt_protocol::ReadProperty(const uint8_t* buf, const uint32_t avail, PropertyView& property, uint32_t& size){
+    if (avail < 1) return mqtt_err::mqtt_property_err;
+    property.id = buf[0];
+    property.type = GetPropertyDescriptor(property.id).type;
+    uint32_t value_size = 0;
+    const int status = value_readers[property.type](buf + 1, avail - 1, property, value_size);
+    size = 1 + value_size;
+    return status;
+}
+
+int PropertiesView::Read(const uint8_t* buf, const uint32_t avail, uint32_t& size, const uint8_t packet){
+    uint32_t properties_len;
+    uint8_t len_size;
+    if (DecodeVarInt(buf, avail, properties_len, len_size) != mqtt_err::ok) return mqtt_err::var_int_err;
+    if (avail - len_size < properties_len) return mqtt_err::mqtt_property_err;
+
+    data = buf + len_size;
+    len = properties_len;
+    count = 0;
+    PropertyView property;
+    uint64_t seen = 0;
+    for(uint32_t offset = 0, p_size = 0; offset < len; offset += p_size, count++){
+        if (ReadProperty(data + offset, len - offset, property, p_size) != mqtt_err::ok) return mqtt_err::mqtt_property_err;
+        if (!isPropertyAllowed(property.id, packet, seen)) return mqtt_err::mqtt_property_err;
+    }
+    size = len_size + len;
+    return mqtt_err::ok;
+}
+
+bool PropertiesView::Find(const uint8_t id, PropertyView& property) const {
+    bool found = false;
+    ForEach([id, &property, &found](const PropertyView& it){
+        if (found || it.id != id) return;
+        property = it;
+        found = true;
+    });
+    return found;
+}
+
+uint32_t PropertiesView::Count() const noexcept {
+    return count;
+}
+
+int PublishView::Read(const FixedHeader& fh, const uint8_t* buf, const uint8_t version){
+    const uint32_t avail = fh.remaining_len;
+    uint32_t offset;
+    if (ReadString(buf, avail, topic, offset) != mqtt_err::ok) return mqtt_err::read_err;
+    packet_id = 0;
+    if (fh.QoS() > mqtt_QoS::QoS_0){
+        if (avail - offset < sizeof(packet_id)) return mqtt_err::read_err;
+        packet_id = ConvertToHost2Bytes(buf + offset);
+        offset += sizeof(packet_id);
+    }
+    properties = PropertiesView{};
+    if (version == MQTT_VERSION_5){
+        uint32_t size;
+        const int status = properties.Read(buf + offset, avail - offset, size, mqtt_pack_type::PUBLISH);
+        if (status != mqtt_err::ok) return status;
+        offset += size;
+    }
+    payload_offset = offset;
+    payload_len = avail - offset;
+    return mqtt_err::ok;
+}
+
+int SubscribeView::Read(const FixedHeader& fh, const uint8_t* buf, const uint8_t version){
+    const uint32_t avail = fh.remaining_len;
+    if (avail < sizeof(packet_id)) return mqtt_err::read_err;
+    packet_id = ConvertToHost2Bytes(buf);
+    uint32_t offset = sizeof(packet_id);
+    properties = PropertiesView{};
+    if (version == MQTT_VERSION_5){
+        uint32_t size;
+        const int status = properties.Read(buf + offset, avail - offset, size, fh.GetType());
+        if (status != mqtt_err::ok) return status;
+        offset += size;
+    }
+    //every filter has to be complete, so ForEach() does not check the bounds again
+    options = fh.GetType() == mqtt_pack_type::SUBSCRIBE;
+    filters = buf + offset;
+    len = avail - offset;
+    string_view filter;
+    for(uint32_t pos = 0, size = 0; pos < len; pos += size + options){
+        if (ReadString(filters + pos, len - pos, filter, size) != mqtt_err::ok) return mqtt_err::read_err;
+        if (options && pos + size >= len) return mqtt_err::read_err;
+    }
+    return mqtt_err::ok;
+}
@@ -0,0 +1,375 @@
+#include "outbound_queue.h"
+
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+using namespace std;
+
+void QueueLimitTable::SetGlobal(const QueueLimits& limits) noexcept {
+    global = limits;
+}
+
+void QueueLimitTable::AddPrefix(const string& prefix, const QueueLimits& limits){
+    auto it = prefixes.begin();
+    while (it != prefixes.end() && it->first.size() >= prefix.size()) ++it;
+    prefixes.insert(it, make_pair(prefix, limits));
+}
+
+const QueueLimits& QueueLimitTable::Find(const string& topic_name) const noexcept {
+    for(const auto& it : prefixes){
+        if (topic_name.compare(0, it.first.size(), it.first) == 0) return it.second;
+    }
+    return global;
+}
+
+const QueueLimits& QueueLimitTable::GetGlobal() const noexcept {
+    return global;
+}
+
+bool OutboundQueue::Fits(const QueueLimits& limits, const uint32_t len) const noexcept {
+    if (limits.max_bytes != 0 && bytes + len > limits.max_bytes) return false;
+    if (limits.max_messages != 0 && messages + 1 > limits.max_messages) return false;
+    return true;
+}
+
+OutboundQueue::~OutboundQueue(){
+    Erase(nullptr, nullptr);
+}
+
+void OutboundQueue::Append(OutboundPiece& piece, const bool droppable, const bool last){
+    auto desc = SendPool::Allocate();
+    desc->next      = nullptr;
+    desc->data      = std::move(piece.data);
+    desc->len       = piece.len;
+    desc->offset    = 0;
+    desc->droppable = droppable;
+    desc->last      = last;
+    desc->zerocopy  = piece.zerocopy && zc_stats != nullptr;
+    if (piece.bytes != nullptr){
+        if (piece.len > SEND_INLINE_SIZE) desc->data = shared_ptr<uint8_t>(new uint8_t[piece.len], default_delete<uint8_t[]>());
+        memcpy(desc->Bytes(), piece.bytes, piece.len);
+    }
+    if (back != nullptr) back->next = desc;
+    else front = desc;
+    back = desc;
+}
+
+//Unlinks and releases the descriptors after prev (from the front if nullptr) up to end
+void OutboundQueue::Erase(SendDescriptor* prev, SendDescriptor* end){
+    auto it = prev != nullptr ? prev->next : front;
+    while (it != end){
+        auto next = it->next;
+        SendPool::Release(it);
+        it = next;
+    }
+    if (prev != nullptr) prev->next = end;
+    else front = end;
+    if (end == nullptr) back = prev;
+}
+
+//Queues one packet, returns true when the queue has to be handed to a sender
+bool OutboundQueue::Enqueue(OutboundPiece* pieces, const unsigned int count, const bool droppable){
+    for(unsigned int i=0; i<count; i++){
+        bytes += pieces[i].len;
+        Append(pieces[i], droppable, i == count - 1);
+    }
+    messages++;
+    if (scheduled || blocked) return false;
+    scheduled = true;
+    return true;
+}
+
+//Control packets are never limited
+bool OutboundQueue::Push(shared_ptr<uint8_t> data, const uint32_t len){
+    lock_guard guard{mtx};
+    if (closed || aborted || len == 0) return false;
+    OutboundPiece piece{std::move(data), nullptr, len};
+    return Enqueue(&piece, 1, false);
+}
+
+bool OutboundQueue::Push(const uint8_t* data, const uint32_t len){
+    lock_guard guard{mtx};
+    if (closed || aborted || len == 0) return false;
+    OutboundPiece piece{nullptr, data, len};
+    return Enqueue(&piece, 1, false);
+}
+
+push_status OutboundQueue::Push(shared_ptr<uint8_t> data, const uint32_t len, const QueueLimits& limits, const bool droppable, size_t& evicted,
+                                shared_ptr<uint8_t> payload, const uint32_t payload_len){
+    OutboundPiece pieces[] = {{std::move(data), nullptr, len}, {std::move(payload), nullptr, payload_len, true}};
+    return Push(pieces, payload_len != 0 ? 2 : 1, limits, droppable, evicted);
+}
+
+//PUBLISH within the limits. drop_oldest_qos0 evicts queued QoS 0 packets, except a partially written one,
+//and drops the new packet if that is not enough
+push_status OutboundQueue::Push(OutboundPiece* pieces, const unsigned int count, const QueueLimits& limits, const bool droppable, size_t& evicted){
+    lock_guard guard{mtx};
+    evicted = 0;
+    uint32_t total = 0;
+    for(unsigned int i=0; i<count; i++) total += pieces[i].len;
+    if (closed || aborted || count == 0 || pieces[0].len == 0) return push_status::dropped;
+    if (!Fits(limits, total)){
+        if (limits.policy == overflow_policy::disconnect) return push_status::overflow;
+        if (limits.policy == overflow_policy::drop_oldest_qos0){
+            //prev is the last descriptor of the packets kept so far
+            SendDescriptor* prev = nullptr;
+            if (in_message){
+                prev = front;
+                while (!prev->last) prev = prev->next;
+            }
+            auto it = prev != nullptr ? prev->next : front;
+            while (it != nullptr && !Fits(limits, total)){
+                auto tail = it;
+                size_t size = tail->len;
+                while (!tail->last){
+                    tail = tail->next;
+                    size += tail->len;
+                }
+                if (it->droppable){
+                    Erase(prev, tail->next);
+                    bytes -= size;
+                    messages--;
+                    evicted++;
+                } else prev = tail;
+                it = prev != nullptr ? prev->next : front;
+            }
+            dropped += evicted;
+        }
+        if (!Fits(limits, total)){
+            dropped++;
+            return push_status::dropped;
+        }
+    }
+    return Enqueue(pieces, count, droppable) ? push_status::scheduled : push_status::queued;
+}
+
+//Replaces everything not yet started with the last packet (DISCONNECT) and shuts the reading side down,
+//so the owning shard sees EOF and closes the connection. Returns false if the queue is already gone.
+bool OutboundQueue::Abort(shared_ptr<uint8_t> data, const uint32_t len, bool& wake){
+    lock_guard guard{mtx};
+    wake = false;
+    if (closed || aborted) return false;
+    aborted = true;
+    SendDescriptor* prev = nullptr;
+    bytes = 0;
+    if (in_message){
+        prev = front;
+        bytes += prev->len - prev->offset;
+        while (!prev->last){
+            prev = prev->next;
+            bytes += prev->len;
+        }
+    }
+    dropped += messages - (in_message ? 1 : 0);
+    messages = in_message ? 1 : 0;
+    Erase(prev, nullptr);
+    OutboundPiece piece{std::move(data), nullptr, len};
+    if (len != 0) wake = Enqueue(&piece, 1, false);
+    shutdown(fd, SHUT_RD);
+    return true;
+}
+
+//The socket became writable again. Returns true when the queue has to be handed to a sender
+bool OutboundQueue::Wake(){
+    lock_guard guard{mtx};
+    blocked = false;
+    if (closed || scheduled || front == nullptr) return false;
+    scheduled = true;
+    return true;
+}
+
+//Last non-blocking attempt to deliver what is queued (e.g. DISCONNECT), then the queue is dropped.
+//Holding the lock guarantees no sender writes to the fd after it is closed. Returns true when the
+//kernel still sends from pinned buffers: the socket is kept open by a duplicate and has to Linger().
+bool OutboundQueue::Close(){
+    lock_guard guard{mtx};
+    if (!closed && front != nullptr) WriteV(OUTBOUND_FLUSH_LIMIT);
+    closed = true;
+    Erase(nullptr, nullptr);
+    bytes = 0;
+    messages = 0;
+    ReapLocked();
+    if (zc_pins.empty()) return false;
+    zc_fd = dup(fd);
+    if (zc_fd < 0){
+        zc_pins.clear();
+        return false;
+    }
+    shutdown(zc_fd, SHUT_RDWR);
+    zc_deadline = time(nullptr) + OUTBOUND_ZEROCOPY_LINGER;
+    return true;
+}
+
+//Returns false when the closed socket is released. A peer that does not read within the linger time
+//is reset, so the kernel drops the data instead of sending freed buffers.
+bool OutboundQueue::Linger(const time_t now){
+    lock_guard guard{mtx};
+    if (zc_fd < 0) return false;
+    ReapLocked();
+    if (!zc_pins.empty() && now < zc_deadline) return true;
+    if (!zc_pins.empty()){
+        struct linger reset{1, 0};
+        setsockopt(zc_fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+    }
+    close(zc_fd);
+    zc_fd = -1;
+    zc_pins.clear();
+    return false;
+}
+
+bool OutboundQueue::EnableZerocopy(ZerocopyStats* stats){
+    int on = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) < 0) return false;
+    lock_guard guard{mtx};
+    zc_stats = stats;
+    return true;
+}
+
+//Called by the owning shard when the socket reports EPOLLERR
+void OutboundQueue::Reap(){
+    lock_guard guard{mtx};
+    if (!closed) ReapLocked();
+}
+
+OutboundDepth OutboundQueue::GetDepth(){
+    lock_guard guard{mtx};
+    return OutboundDepth{bytes, messages, dropped};
+}
+
+//zerocopy is set when a gathered chunk is a payload to be sent with MSG_ZEROCOPY
+unsigned int OutboundQueue::Gather(struct iovec* iov, const unsigned int max_iov, bool& zerocopy) const {
+    unsigned int count = 0;
+    zerocopy = false;
+    bool inline_bytes = false;
+    for(auto it = front; it != nullptr && count < max_iov; it = it->next, ++count){
+        //inline bytes return to the pool once consumed, the kernel must not keep pointing at them
+        if (it->data == nullptr ? zerocopy : it->zerocopy && inline_bytes) break;
+        inline_bytes |= it->data == nullptr;
+        iov[count].iov_base = it->Bytes() + it->offset;
+        iov[count].iov_len  = it->len - it->offset;
+        zerocopy |= it->zerocopy;
+    }
+    return count;
+}
+
+//Keeps the buffers of a successful MSG_ZEROCOPY send alive, the kernel numbers such sends from 0
+void OutboundQueue::Pin(const unsigned int count, const size_t sent){
+    auto it = front;
+    for(unsigned int i=0; i<count && it != nullptr; i++, it = it->next){
+        zc_pins.push_back(ZerocopyPin{zc_seq, i == 0 ? (uint32_t) sent : 0, it->data});
+    }
+    zc_seq++;
+    if (zc_stats != nullptr) zc_stats->sent.fetch_add(sent, memory_order_relaxed);
+}
+
+void OutboundQueue::Release(const uint32_t lo, const uint32_t hi, const bool copied){
+    uint64_t released = 0;
+    while (!zc_pins.empty() && int32_t(zc_pins.front().seq - lo) >= 0 && int32_t(zc_pins.front().seq - hi) <= 0){
+        released += zc_pins.front().bytes;
+        zc_pins.pop_front();
+    }
+    if (zc_stats == nullptr) return;
+    if (copied) zc_stats->copied.fetch_add(released, memory_order_relaxed);
+    else        zc_stats->avoided.fetch_add(released, memory_order_relaxed);
+}
+
+//Completions are reported in order as ranges of send numbers
+void OutboundQueue::ReapLocked(){
+    if (zc_stats == nullptr) return;
+    char control[128];
+    while (true){
+        struct msghdr msg{};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(zc_fd < 0 ? fd : zc_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) return;
+        for(auto cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm)){
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) continue;
+            auto err = (struct sock_extended_err*) CMSG_DATA(cm);
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+            Release(err->ee_info, err->ee_data, err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED);
+        }
+    }
+}
+
+void OutboundQueue::Consume(size_t size){
+    bytes -= size;
+    while (size > 0){
+        const size_t left = front->len - front->offset;
+        if (size < left){
+            front->offset += size;
+            in_message = true;
+            return;
+        }
+        size -= left;
+        in_message = !front->last;
+        if (front->last) messages--;
+        Erase(nullptr, front->next);
+    }
+}
+
+//Writes until the queue is empty, the socket would block or limit bytes are sent
+outbound_status OutboundQueue::WriteV(const size_t limit){
+    struct iovec iov[OUTBOUND_MAX_IOV];
+    size_t written = 0;
+    if (!zc_pins.empty()) ReapLocked();
+    while (front != nullptr){
+        if (written >= limit) return outbound_status::more;
+        bool zerocopy;
+        unsigned int count = Gather(iov, OUTBOUND_MAX_IOV, zerocopy);
+        struct msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t ret = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL | (zerocopy ? MSG_ZEROCOPY : 0));
+        if (ret < 0){
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return outbound_status::blocked;
+            //out of optmem for pinned pages, copy the queued payloads instead
+            if (errno == ENOBUFS && zerocopy){
+                for(auto it = front; it != nullptr; it = it->next) it->zerocopy = false;
+                continue;
+            }
+            return outbound_status::error;
+        }
+        if (zerocopy) Pin(count, ret);
+        Consume(ret);
+        written += ret;
+    }
+    return outbound_status::drained;
+}
+
+outbound_status OutboundQueue::Finish(const outbound_status status){
+    if (closed) return outbound_status::closed;
+    switch (status){
+        case outbound_status::more : return status;
+        case outbound_status::blocked : blocked = true; break;
+        case outbound_status::error : {
+            //the reading side sees the broken connection and closes it
+            Erase(nullptr, nullptr);
+            bytes = 0;
+            messages = 0;
+        }; break;
+        default : break;
+    }
+    scheduled = false;
+    return status;
+}
+
+bool OutboundQueue::isEmpty() const noexcept {
+    return front == nullptr;
+}
+
+bool OutboundQueue::isClosed() const noexcept {
+    return closed;
+}
+
+bool OutboundQueue::isPinned() const noexcept {
+    return !zc_pins.empty();
+}
+
+size_t OutboundQueue::GetBytes() const noexcept {
+    return bytes;
+}
@@ -0,0 +1,68 @@
+#include "reactor.h"
+
+#include <unistd.h>
+#include <errno.h>
+
+using namespace std;
+
+Reactor::Reactor(const bool _edge_triggered, const unsigned int max_events) : epoll_fd(-1), edge_triggered(_edge_triggered), mode_flags(EPOLLRDHUP), events(max_events) {
+    if (edge_triggered) mode_flags |= EPOLLET;
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+}
+
+Reactor::~Reactor(){
+    if (epoll_fd >= 0) close(epoll_fd);
+}
+
+bool Reactor::Add(const int fd, const uint32_t _events){
+    struct epoll_event ev{};
+    ev.events = _events | mode_flags;
+    ev.data.fd = fd;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+//A listen socket shared by several reactors wakes only one of them per connection.
+//It is always level-triggered: the accept loop may stop before the queue is drained.
+bool Reactor::AddListener(const int fd){
+    struct epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.fd = fd;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+bool Reactor::Modify(const int fd, const uint32_t _events){
+    struct epoll_event ev{};
+    ev.events = _events | mode_flags;
+    ev.data.fd = fd;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == 0;
+}
+
+void Reactor::Del(const int fd){
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+int Reactor::Wait(const int timeout_ms){
+    int ready = epoll_wait(epoll_fd, events.data(), static_cast<int>(events.size()), timeout_ms);
+    if (ready == -1 && errno == EINTR) return 0;
+    return ready;
+}
+
+int Reactor::GetFd(const int index) const noexcept {
+    return events[index].data.fd;
+}
+
+int Reactor::GetEpollFd() const noexcept {
+    return epoll_fd;
+}
+
+uint32_t Reactor::GetEvents(const int index) const noexcept {
+    return events[index].events;
+}
+
+bool Reactor::isEdgeTriggered() const noexcept {
+    return edge_triggered;
+}
+
+bool Reactor::isValid() const noexcept {
+    return epoll_fd >= 0;
+}
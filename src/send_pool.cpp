@@ -0,0 +1,41 @@
+#include "send_pool.h"
+
+using namespace std;
+
+static thread_local SendPool* local_pool = nullptr;
+
+SendPool::SendPool(const size_t capacity) : slab(make_unique<SendDescriptor[]>(capacity)) {
+    for(size_t i=0; i<capacity; i++){
+        slab[i].pool = this;
+        slab[i].next = free_list;
+        free_list = &slab[i];
+    }
+}
+
+SendDescriptor* SendPool::Allocate(){
+    if (local_pool == nullptr) local_pool = new SendPool(SEND_POOL_CAPACITY);
+    SendPool& pool = *local_pool;
+    if (pool.free_list == nullptr){
+        while (auto desc = pool.remote.Pop()){
+            desc->next = pool.free_list;
+            pool.free_list = desc;
+        }
+    }
+    if (pool.free_list == nullptr) return new SendDescriptor;
+    auto desc = pool.free_list;
+    pool.free_list = desc->next;
+    desc->next = nullptr;
+    return desc;
+}
+
+void SendPool::Release(SendDescriptor* desc){
+    desc->data.reset();
+    if (desc->pool == nullptr){
+        delete desc;
+    } else if (desc->pool == local_pool){
+        desc->next = local_pool->free_list;
+        local_pool->free_list = desc;
+    } else {
+        desc->pool->remote.Push(desc);
+    }
+}
@@ -0,0 +1,187 @@
+#include "shard.h"
+
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+using namespace std;
+
+//MailboxWriter
+MailboxWriter::MailboxWriter(const unsigned int _producer_id, const unsigned int shard_count) : producer_id(_producer_id), backlog(shard_count) {}
+
+void MailboxWriter::Send(Shard& dst, ShardEvent&& event){
+    auto& pending = backlog[dst.GetId()];
+    if (!pending.empty() || !dst.Post(producer_id, std::move(event))){
+        pending.push_back(std::move(event));
+        return;
+    }
+    dst.Wake();
+}
+
+void MailboxWriter::Flush(vector<unique_ptr<Shard>>& shards){
+    for(auto& dst : shards){
+        auto& pending = backlog[dst->GetId()];
+        if (pending.empty()) continue;
+        while (!pending.empty() && dst->Post(producer_id, std::move(pending.front()))){
+            pending.pop_front();
+        }
+        dst->Wake();
+    }
+}
+
+unsigned int MailboxWriter::GetProducerId() const noexcept {
+    return producer_id;
+}
+
+//Shard
+Shard::Shard(const unsigned int _id, const unsigned int shard_count, const unsigned int producer_count, const bool edge_triggered)
+            : id(_id), wake_fd(-1), reactor(edge_triggered), writer(_id, shard_count) {
+    inbox.reserve(producer_count);
+    for(unsigned int i=0; i<producer_count; i++){
+        inbox.push_back(make_unique<SpscQueue<ShardEvent>>(DEFAULT_MAILBOX_SIZE));
+    }
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd >= 0 && !reactor.Add(wake_fd)){
+        close(wake_fd);
+        wake_fd = -1;
+    }
+}
+
+Shard::~Shard(){
+    if (wake_fd >= 0) close(wake_fd);
+}
+
+bool Shard::Post(const unsigned int producer, ShardEvent&& event){
+    return inbox[producer]->Push(std::move(event));
+}
+
+//The consumer announces that it is about to sleep before it checks the mailboxes for the last time,
+//and the producer checks the flag after publishing, so at least one of them sees the other's write.
+void Shard::Wake(){
+    atomic_thread_fence(memory_order_seq_cst);
+    if (sleeping.exchange(false)){
+        uint64_t one = 1;
+        [[maybe_unused]] auto ret = write(wake_fd, &one, sizeof(one));
+    }
+}
+
+int Shard::Wait(const int timeout_ms){
+    if (uring) RepostRequests();
+    sleeping.store(true);
+    atomic_thread_fence(memory_order_seq_cst);
+    //a request left unposted is retried on the next tick instead of after the full timeout
+    int timeout = HasMail() ? 0 : timeout_ms;
+    if (!unposted.empty() && (timeout < 0 || timeout > SHARD_REPOST_MS)) timeout = SHARD_REPOST_MS;
+    int ready = uring ? uring->SubmitAndWait(1, timeout) : reactor.Wait(timeout);
+    sleeping.store(false);
+    return ready;
+}
+
+void Shard::ClearWake(){
+    uint64_t value;
+    while (read(wake_fd, &value, sizeof(value)) > 0) {}
+}
+
+bool Shard::HasMail() const {
+    for(const auto& it : inbox){
+        if (!it->Empty()) return true;
+    }
+    return false;
+}
+
+bool Shard::EnableUring(const bool sqpoll){
+    uring = make_unique<Uring>(DEFAULT_URING_ENTRIES, sqpoll);
+    if (!uring->isValid() || !uring->SetupBufferRing()){
+        uring.reset();
+        return false;
+    }
+    ArmReactorPoll();
+    return true;
+}
+
+void Shard::ArmReactorPoll(){
+    PostRequest(MakeUserData(uring_op::poll_reactor, 0, reactor.GetEpollFd()));
+}
+
+void Shard::AttachRecv(const int fd){
+    const uint32_t gen = ++next_gen & 0x3FFFFFFF;
+    recv_gen[fd] = gen;
+    PostRequest(MakeUserData(uring_op::recv, gen, fd));
+}
+
+//multishot recv stops after an error or when the buffer ring runs dry, the same request is posted again
+void Shard::RearmRecv(const int fd){
+    auto it = recv_gen.find(fd);
+    if (it == recv_gen.end()) return;
+    PostRequest(MakeUserData(uring_op::recv, it->second, fd));
+}
+
+void Shard::DetachRecv(const int fd){
+    auto it = recv_gen.find(fd);
+    if (it == recv_gen.end()) return;
+    PostRequest(MakeUserData(uring_op::cancel, it->second, fd));
+    uring->Submit();
+    recv_gen.erase(it);
+}
+
+//The request is rebuilt from its user_data, so one that found no free SQE can be kept and posted later
+void Shard::PostRequest(const uint64_t user_data){
+    const int fd = GetUringFd(user_data);
+    bool posted = false;
+    switch (GetUringOp(user_data)){
+        case uring_op::poll_reactor : posted = uring->PrepPoll(fd, POLLIN, user_data); break;
+        case uring_op::recv         : posted = uring->PrepRecvMultishot(fd, user_data); break;
+        case uring_op::cancel       : {
+            const uint64_t target = (user_data & ~(uint64_t(3) << 62)) | (static_cast<uint64_t>(uring_op::recv) << 62);
+            posted = uring->PrepCancel(target, user_data);
+        }; break;
+        default : posted = true; break;
+    }
+    if (!posted) unposted.push_back(user_data);
+}
+
+//A receive of a connection closed in the meantime is dropped, its cancel is still posted
+void Shard::RepostRequests(){
+    if (unposted.empty()) return;
+    vector<uint64_t> requests;
+    requests.swap(unposted);
+    for(const auto& it : requests){
+        if (GetUringOp(it) == uring_op::recv && !isCurrentRecv(it)) continue;
+        PostRequest(it);
+    }
+}
+
+//Called from the sender threads too, epoll_ctl() is thread safe
+bool Shard::WantWrite(const int fd, const bool on){
+    return reactor.Modify(fd, (uring ? 0u : uint32_t(EPOLLIN)) | (on ? uint32_t(EPOLLOUT) : 0u));
+}
+
+bool Shard::isCurrentRecv(const uint64_t user_data) const {
+    auto it = recv_gen.find(GetUringFd(user_data));
+    return it != recv_gen.end() && MakeUserData(uring_op::recv, it->second, it->first) == user_data;
+}
+
+//user_data layout: op(2 bits) | generation(30 bits) | fd(32 bits)
+uint64_t Shard::MakeUserData(const uring_op op, const uint32_t gen, const int fd) noexcept {
+    return (static_cast<uint64_t>(op) << 62) | (static_cast<uint64_t>(gen & 0x3FFFFFFF) << 32) | static_cast<uint32_t>(fd);
+}
+
+uring_op Shard::GetUringOp(const uint64_t user_data) noexcept {
+    return static_cast<uring_op>(user_data >> 62);
+}
+
+int Shard::GetUringFd(const uint64_t user_data) noexcept {
+    return static_cast<int>(user_data & 0xFFFFFFFF);
+}
+
+unsigned int Shard::GetId() const noexcept {
+    return id;
+}
+
+int Shard::GetWakeFd() const noexcept {
+    return wake_fd;
+}
+
+bool Shard::isValid() const noexcept {
+    return reactor.isValid() && wake_fd >= 0;
+}
@@ -0,0 +1,50 @@
+#include "subscriber_cache.h"
+
+using namespace std;
+
+SubscriberCache::SubscriberCache(const size_t _capacity) : capacity(_capacity) {
+    index.reserve(capacity);
+}
+
+void SubscriberCache::SetCapacity(const size_t _capacity){
+    capacity = _capacity;
+    index.clear();
+    entries.clear();
+    index.reserve(capacity);
+}
+
+const SubscriberCache::Entry* SubscriberCache::Find(const TopicName& topic, const uint64_t generation){
+    auto it = index.find(topic.id);
+    if (it == index.end() || it->second->generation != generation) return nullptr;
+    entries.splice(entries.begin(), entries, it->second);
+    return &*it->second;
+}
+
+SubscriberCache::Entry& SubscriberCache::Insert(const shared_ptr<const TopicName>& topic, const uint64_t generation){
+    Entry* entry = &scratch;
+    if (capacity != 0){
+        auto it = index.find(topic->id);
+        if (it != index.end()){
+            entries.splice(entries.begin(), entries, it->second);
+        } else if (entries.size() < capacity){
+            entries.emplace_front();
+            entries.front().topic = topic;
+            index.emplace(topic->id, entries.begin());
+        } else {
+            //the evicted entry keeps its vectors, their capacity is reused
+            entries.splice(entries.begin(), entries, prev(entries.end()));
+            index.erase(entries.front().topic->id);
+            entries.front().topic = topic;
+            index.emplace(topic->id, entries.begin());
+        }
+        entry = &entries.front();
+    }
+    entry->generation = generation;
+    entry->subscribers.clear();
+    entry->groups.clear();
+    return *entry;
+}
+
+size_t SubscriberCache::Size() const noexcept {
+    return entries.size();
+}
@@ -0,0 +1,64 @@
+#include "topic_names.h"
+
+#include <mutex>
+
+using namespace std;
+
+//never destroyed: interned names may be released by static objects at exit
+TopicNames& TopicNames::GetInstance(){
+    static auto instance = new TopicNames;
+    return *instance;
+}
+
+shared_ptr<const TopicName> TopicNames::Intern(const string_view name){
+    auto& table = GetInstance();
+    const size_t hash = std::hash<string_view>{}(name);
+    auto& stripe = table.stripes[hash % TOPIC_NAMES_STRIPES];
+    {
+        shared_lock lock{stripe.mtx};
+        auto it = stripe.names.find(name);
+        if (it != stripe.names.end()){
+            if (auto interned = it->second.name.lock()) return interned;
+        }
+    }
+    unique_lock lock{stripe.mtx};
+    auto it = stripe.names.find(name);
+    if (it != stripe.names.end()){
+        if (auto interned = it->second.name.lock()) return interned;
+        //the last reference is being released, its entry gives way to the new one
+        stripe.names.erase(it);
+    }
+    const uint32_t id = table.id_gen.fetch_add(1, memory_order_relaxed);
+    shared_ptr<const TopicName> interned(new TopicName{string(name), hash, id}, [](const TopicName* released){
+        GetInstance().Release(released);
+    });
+    stripe.names.emplace(string_view(interned->name), Entry{interned, id});
+    return interned;
+}
+
+shared_ptr<const TopicName> TopicNames::Find(const string_view name){
+    auto& stripe = GetInstance().stripes[std::hash<string_view>{}(name) % TOPIC_NAMES_STRIPES];
+    shared_lock lock{stripe.mtx};
+    auto it = stripe.names.find(name);
+    if (it == stripe.names.end()) return nullptr;
+    return it->second.name.lock();
+}
+
+void TopicNames::Release(const TopicName* name) noexcept {
+    auto& stripe = stripes[name->hash % TOPIC_NAMES_STRIPES];
+    {
+        unique_lock lock{stripe.mtx};
+        auto it = stripe.names.find(string_view(name->name));
+        if (it != stripe.names.end() && it->second.id == name->id) stripe.names.erase(it);
+    }
+    delete name;
+}
+
+size_t TopicNames::Size(){
+    size_t size = 0;
+    for(auto& stripe : GetInstance().stripes){
+        shared_lock lock{stripe.mtx};
+        size += stripe.names.size();
+    }
+    return size;
+}
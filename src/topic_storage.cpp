@@ -1,57 +1,59 @@
 #include "topic_storage.h"
+#include "topic_trie.h"
 
 using namespace std;
 
+//A stored topic holds its interned name, so the id stays the key of that name
 void CTopicStorage::StoreTopicValue(const uint8_t qos, const uint16_t id, const string& topic_name, const shared_ptr<MqttBinaryDataEntity>& data){
-    unique_lock lock(mtx);
-    MqttTopic topic(qos, id, topic_name, data);
-    topics.erase(topic);
-    topics.emplace(topic);
+    StoreTopicValue(MqttTopic(qos, id, topic_name, data));
 }
 
 void CTopicStorage::StoreTopicValue(const MqttTopic& topic){
     unique_lock lock(mtx);
-    topics.erase(topic);
-    topics.emplace(topic);
+    topics.insert_or_assign(topic.GetNameID(), topic);
 }
 
 MqttBinaryDataEntity CTopicStorage::GetStoredValue(const string& topic_name, bool& found){
-    shared_lock lock(mtx);
-    found = false;
-    MqttTopic tmp_topic(0, 0, topic_name, nullptr);
-    auto it = topics.find(tmp_topic);
-    if(it != topics.end()) {
-        found = true;
-        return it->GetValue();
-    }
-    return MqttBinaryDataEntity{};
+    auto ptr = GetStoredValuePtr(topic_name);
+    found = ptr != nullptr;
+    return found ? *ptr : MqttBinaryDataEntity{};
 }
 
 shared_ptr<MqttBinaryDataEntity> CTopicStorage::GetStoredValuePtr(const string& topic_name){
+    //a name nobody holds is not retained
+    auto name = TopicNames::Find(topic_name);
+    if (name == nullptr) return nullptr;
     shared_lock lock(mtx);
-    MqttTopic tmp_topic(0, 0, topic_name, nullptr);
-    auto it = topics.find(tmp_topic);
-    if(it != topics.end()) {
-        return it->GetPtr();
-    }
+    auto it = topics.find(name->id);
+    if(it != topics.end()) return it->second.GetPtr();
     return nullptr;
 }
 
 MqttTopic CTopicStorage::GetTopic(const string& topic_name, bool& found) {
-    shared_lock lock(mtx);
     found = false;
-    MqttTopic tmp_topic(0, 0, topic_name, nullptr);
-    auto it = topics.find(tmp_topic);
-    if(it != topics.end()) {
-        found = true;
-        return *it;
+    auto name = TopicNames::Find(topic_name);
+    if (name != nullptr){
+        shared_lock lock(mtx);
+        auto it = topics.find(name->id);
+        if(it != topics.end()) {
+            found = true;
+            return it->second;
+        }
+    }
+    return MqttTopic{};
+}
+
+//Retained topics for a wildcard subscription, a full scan: it runs once per SUBSCRIBE, not per PUBLISH
+void CTopicStorage::GetMatchingTopics(const string& filter, vector<MqttTopic>& found){
+    shared_lock lock(mtx);
+    for(const auto& it : topics){
+        if (TopicTrie::Matches(filter, it.second.GetName())) found.push_back(it.second);
     }
-    return tmp_topic;
 }
 
 void CTopicStorage::DeleteTopicValue(const MqttTopic& _topic){
     unique_lock lock(mtx);
-    topics.erase(_topic);
+    topics.erase(_topic.GetNameID());
 }
 
 
@@ -0,0 +1,140 @@
+#include "topic_trie.h"
+
+#include <algorithm>
+
+using namespace std;
+
+void TopicTrie::Split(string_view name, vector<string_view>& levels){
+    levels.clear();
+    while (true){
+        auto pos = name.find(TOPIC_LEVEL_SEPARATOR);
+        levels.push_back(name.substr(0, pos));
+        if (pos == string_view::npos) return;
+        name.remove_prefix(pos + 1);
+    }
+}
+
+bool TopicTrie::isShared(const string_view filter, string_view& group, string_view& topic_filter){
+    if (filter.compare(0, sizeof(SHARED_PREFIX) - 1, SHARED_PREFIX) != 0) return false;
+    const auto rest = filter.substr(sizeof(SHARED_PREFIX) - 1);
+    const auto pos = rest.find(TOPIC_LEVEL_SEPARATOR);
+    group = rest.substr(0, pos);
+    topic_filter = pos == string_view::npos ? string_view{} : rest.substr(pos + 1);
+    return true;
+}
+
+bool TopicTrie::isValidFilter(string_view filter){
+    string_view group;
+    if (isShared(filter, group, filter) && (group.empty() || isWildcard(group))) return false;
+    if (filter.empty()) return false;
+    vector<string_view> levels;
+    Split(filter, levels);
+    for(size_t i=0; i<levels.size(); i++){
+        const auto& level = levels[i];
+        if (level == TOPIC_MULTI_LEVEL){
+            if (i != levels.size() - 1) return false;
+        } else if (level != TOPIC_SINGLE_LEVEL && level.find_first_of("+#") != string_view::npos){
+            return false;
+        }
+    }
+    return true;
+}
+
+bool TopicTrie::isValidTopic(const string_view topic){
+    return !topic.empty() && topic.find_first_of("+#") == string_view::npos;
+}
+
+bool TopicTrie::isWildcard(const string_view filter){
+    return filter.find_first_of("+#") != string_view::npos;
+}
+
+bool TopicTrie::Matches(const string_view filter, const string_view topic){
+    vector<string_view> f_levels, t_levels;
+    Split(filter, f_levels);
+    Split(topic, t_levels);
+    if (!t_levels[0].empty() && t_levels[0][0] == '$' && (f_levels[0] == TOPIC_SINGLE_LEVEL || f_levels[0] == TOPIC_MULTI_LEVEL)) return false;
+    for(size_t i=0; i<f_levels.size(); i++){
+        if (f_levels[i] == TOPIC_MULTI_LEVEL) return true;
+        if (i == t_levels.size()) return false;
+        if (f_levels[i] != TOPIC_SINGLE_LEVEL && f_levels[i] != t_levels[i]) return false;
+    }
+    return f_levels.size() == t_levels.size();
+}
+
+bool TopicTrie::Subscribe(string_view filter, const Subscriber& subscriber){
+    string_view group;
+    const bool shared = isShared(filter, group, filter);
+    vector<string_view> levels;
+    Split(filter, levels);
+    Node* node = &Own(root);
+    for(const auto& level : levels){
+        auto it = node->children.find(level);
+        if (it == node->children.end()) it = node->children.emplace(string(level), make_shared<Node>()).first;
+        node = &Own(it->second);
+    }
+    auto* subscribers = &node->subscribers;
+    if (shared){
+        auto it = node->groups.find(group);
+        if (it == node->groups.end()) it = node->groups.emplace(string(group), make_shared<ShareGroup>()).first;
+        subscribers = &Own(it->second).members;
+    }
+    generation++;
+    for(auto& it : *subscribers){
+        if (it.fd == subscriber.fd && it.conn_id == subscriber.conn_id){
+            it = subscriber;
+            return false;
+        }
+    }
+    subscribers->push_back(subscriber);
+    count++;
+    return true;
+}
+
+static bool EraseSubscriber(vector<Subscriber>& subscribers, const int fd, const uint64_t conn_id){
+    auto it = find_if(subscribers.begin(), subscribers.end(), [fd, conn_id](const Subscriber& sub){
+        return sub.fd == fd && sub.conn_id == conn_id;
+    });
+    if (it == subscribers.end()) return false;
+    *it = subscribers.back();
+    subscribers.pop_back();
+    return true;
+}
+
+//Returns true when the subscription was found, the groups and branches left empty are removed on the way back.
+//Group members are unordered: the last one takes the place of the removed one.
+//The nodes on the path are copied (Own) when they are shared with another copy of the trie.
+bool TopicTrie::Erase(shared_ptr<Node>& ptr, const vector<string_view>& levels, const size_t level, const string_view group, const int fd, const uint64_t conn_id){
+    auto& node = Own(ptr);
+    if (level == levels.size()){
+        if (group.empty()) return EraseSubscriber(node.subscribers, fd, conn_id);
+        auto it = node.groups.find(group);
+        if (it == node.groups.end() || !EraseSubscriber(Own(it->second).members, fd, conn_id)) return false;
+        if (it->second->members.empty()) node.groups.erase(it);
+        return true;
+    }
+    auto child = node.children.find(levels[level]);
+    if (child == node.children.end()) return false;
+    if (!Erase(child->second, levels, level + 1, group, fd, conn_id)) return false;
+    const auto& next = *child->second;
+    if (next.subscribers.empty() && next.groups.empty() && next.children.empty()) node.children.erase(child);
+    return true;
+}
+
+bool TopicTrie::Unsubscribe(string_view filter, const int fd, const uint64_t conn_id){
+    string_view group;
+    isShared(filter, group, filter);
+    vector<string_view> levels;
+    Split(filter, levels);
+    if (!Erase(root, levels, 0, group, fd, conn_id)) return false;
+    count--;
+    generation++;
+    return true;
+}
+
+size_t TopicTrie::Size() const noexcept {
+    return count;
+}
+
+uint64_t TopicTrie::Generation() const noexcept {
+    return generation;
+}
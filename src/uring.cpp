@@ -0,0 +1,309 @@
+#include "uring.h"
+
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+using namespace std;
+
+atomic<uint64_t> Uring::sqe_full{0};
+
+static int uring_setup(const unsigned entries, struct io_uring_params* params){
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(const int fd, const unsigned to_submit, const unsigned min_complete, const unsigned flags, void* arg, const size_t arg_size){
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int uring_register(const int fd, const unsigned opcode, void* arg, const unsigned nr_args){
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+Uring::Uring(const unsigned entries, const bool _sqpoll) : ring_fd(-1), sqpoll(_sqpoll), sq_ptr(MAP_FAILED), sq_map_size(0),
+            cq_ptr(MAP_FAILED), cq_map_size(0), sqes(nullptr), sqes_map_size(0), sq_head(nullptr), sq_tail(nullptr),
+            sq_flags(nullptr), sq_array(nullptr), sq_mask(0), sq_entries(0), sqe_tail(0),
+            cq_head(nullptr), cq_tail(nullptr), cq_mask(0), cqes(nullptr), buf_ring(nullptr), buf_ring_size(0),
+            buffers(nullptr), buf_count(0), buf_size(0), buf_ring_tail(0) {
+    struct io_uring_params params{};
+    if (sqpoll){
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = 1000;
+    }
+
+    ring_fd = uring_setup(entries, &params);
+    if (ring_fd < 0) return;
+
+    //the completion timeout is passed through io_uring_getevents_arg
+    if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP)){
+        close(ring_fd);
+        ring_fd = -1;
+        return;
+    }
+
+    sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP){
+        if (cq_map_size > sq_map_size) sq_map_size = cq_map_size;
+        cq_map_size = sq_map_size;
+    }
+
+    sq_ptr = mmap(nullptr, sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED){
+        close(ring_fd);
+        ring_fd = -1;
+        return;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP){
+        cq_ptr = sq_ptr;
+    } else {
+        cq_ptr = mmap(nullptr, cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED){
+            munmap(sq_ptr, sq_map_size);
+            sq_ptr = MAP_FAILED;
+            close(ring_fd);
+            ring_fd = -1;
+            return;
+        }
+    }
+
+    sqes_map_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes_ptr = mmap(nullptr, sqes_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes_ptr == MAP_FAILED){
+        if (cq_ptr != sq_ptr) munmap(cq_ptr, cq_map_size);
+        munmap(sq_ptr, sq_map_size);
+        sq_ptr = cq_ptr = MAP_FAILED;
+        close(ring_fd);
+        ring_fd = -1;
+        return;
+    }
+    sqes = static_cast<struct io_uring_sqe*>(sqes_ptr);
+
+    auto* sq = static_cast<uint8_t*>(sq_ptr);
+    sq_head     = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail     = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_flags    = reinterpret_cast<unsigned*>(sq + params.sq_off.flags);
+    sq_array    = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    sq_mask     = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_entries  = params.sq_entries;
+    sqe_tail = *sq_tail;
+
+    auto* cq = static_cast<uint8_t*>(cq_ptr);
+    cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes    = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+}
+
+Uring::~Uring(){
+    if (buf_ring != nullptr){
+        struct io_uring_buf_reg reg{};
+        reg.bgid = URING_BUF_GROUP;
+        uring_register(ring_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        munmap(buf_ring, buf_ring_size);
+        delete[] buffers;
+    }
+    if (sqes != nullptr) munmap(sqes, sqes_map_size);
+    if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_map_size);
+    if (sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_map_size);
+    if (ring_fd >= 0) close(ring_fd);
+}
+
+bool Uring::SetupBufferRing(const unsigned count, const unsigned size){
+    if (ring_fd < 0 || buf_ring != nullptr) return false;
+    //ring size has to be a power of 2
+    if (count == 0 || count > 32768 || (count & (count - 1)) != 0) return false;
+
+    buf_ring_size = count * sizeof(struct io_uring_buf);
+    void* ptr = mmap(nullptr, buf_ring_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ptr == MAP_FAILED) return false;
+
+    struct io_uring_buf_reg reg{};
+    reg.ring_addr    = reinterpret_cast<uint64_t>(ptr);
+    reg.ring_entries = count;
+    reg.bgid         = URING_BUF_GROUP;
+    if (uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0){
+        munmap(ptr, buf_ring_size);
+        return false;
+    }
+
+    buf_ring  = static_cast<struct io_uring_buf_ring*>(ptr);
+    buf_count = count;
+    buf_size  = size;
+    buffers   = new uint8_t[(size_t) count * size];
+    buf_ring_tail = 0;
+    for(unsigned i=0; i<count; i++) RecycleBuffer((uint16_t) i);
+    return true;
+}
+
+//Returns the next free SQE. When the submission queue is full the pending entries are pushed to the kernel first.
+struct io_uring_sqe* Uring::GetSqe(){
+    unsigned head = sqpoll ? __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) : *sq_head;
+    if (sqe_tail - head >= sq_entries){
+        Submit();
+        if (sqpoll) Enter(0, 0, IORING_ENTER_SQ_WAIT, -1);
+        head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (sqe_tail - head >= sq_entries){
+            sqe_full.fetch_add(1, memory_order_relaxed);
+            return nullptr;
+        }
+    }
+    struct io_uring_sqe* sqe = &sqes[sqe_tail & sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[sqe_tail & sq_mask] = sqe_tail & sq_mask;
+    sqe_tail++;
+    return sqe;
+}
+
+bool Uring::PrepRecvMultishot(const int fd, const uint64_t user_data){
+    struct io_uring_sqe* sqe = GetSqe();
+    if (sqe == nullptr) return false;
+    sqe->opcode     = IORING_OP_RECV;
+    sqe->fd         = fd;
+    sqe->ioprio     = IORING_RECV_MULTISHOT;
+    sqe->flags      = IOSQE_BUFFER_SELECT;
+    sqe->buf_group  = URING_BUF_GROUP;
+    sqe->user_data  = user_data;
+    return true;
+}
+
+bool Uring::PrepSendmsg(const int fd, const struct msghdr* msg, const uint32_t msg_flags, const uint64_t user_data){
+    struct io_uring_sqe* sqe = GetSqe();
+    if (sqe == nullptr) return false;
+    sqe->opcode     = IORING_OP_SENDMSG;
+    sqe->fd         = fd;
+    sqe->addr       = reinterpret_cast<uint64_t>(msg);
+    sqe->len        = 1;
+    sqe->msg_flags  = msg_flags;
+    sqe->user_data  = user_data;
+    return true;
+}
+
+bool Uring::PrepPoll(const int fd, const uint32_t poll_events, const uint64_t user_data){
+    struct io_uring_sqe* sqe = GetSqe();
+    if (sqe == nullptr) return false;
+    sqe->opcode         = IORING_OP_POLL_ADD;
+    sqe->fd             = fd;
+    sqe->poll32_events  = poll_events;
+    sqe->user_data      = user_data;
+    return true;
+}
+
+bool Uring::PrepCancel(const uint64_t target_user_data, const uint64_t user_data){
+    struct io_uring_sqe* sqe = GetSqe();
+    if (sqe == nullptr) return false;
+    sqe->opcode     = IORING_OP_ASYNC_CANCEL;
+    sqe->fd         = -1;
+    sqe->addr       = target_user_data;
+    sqe->user_data  = user_data;
+    return true;
+}
+
+//Publishes the prepared SQEs to the kernel and returns how many of them it has not consumed yet.
+//Counting from the kernel's head makes a failed io_uring_enter() submit the same entries again on the next call.
+unsigned Uring::FlushSq(){
+    __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+    return sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+}
+
+int Uring::Enter(const unsigned to_submit, const unsigned min_complete, unsigned flags, const int timeout_ms){
+    int ret;
+    if (min_complete > 0 && timeout_ms >= 0){
+        struct __kernel_timespec ts{};
+        ts.tv_sec  = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        struct io_uring_getevents_arg arg{};
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = reinterpret_cast<uint64_t>(&ts);
+        ret = uring_enter(ring_fd, to_submit, min_complete, flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    } else {
+        ret = uring_enter(ring_fd, to_submit, min_complete, flags, nullptr, 0);
+    }
+    if (ret < 0 && (errno == ETIME || errno == EINTR)) return 0;
+    return ret;
+}
+
+int Uring::Submit(){
+    return SubmitAndWait(0, 0);
+}
+
+//One io_uring_enter() both submits everything prepared since the last call and waits for completions.
+//In SQPOLL mode the kernel thread picks the entries up itself and the syscall is skipped when there is nothing to wait for.
+int Uring::SubmitAndWait(const unsigned wait_nr, const int timeout_ms){
+    unsigned to_submit = FlushSq();
+    unsigned flags = 0;
+
+    if (sqpoll){
+        atomic_thread_fence(memory_order_seq_cst);
+        if (__atomic_load_n(sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP) flags |= IORING_ENTER_SQ_WAKEUP;
+        to_submit = 0;
+    }
+    if (wait_nr > 0) flags |= IORING_ENTER_GETEVENTS;
+    if (to_submit == 0 && flags == 0) return 0;
+
+    return Enter(to_submit, wait_nr, flags, timeout_ms);
+}
+
+const uint8_t* Uring::GetBuffer(const uint16_t bid) const noexcept {
+    return buffers + (size_t) bid * buf_size;
+}
+
+//Gives a consumed buffer back to the kernel.
+//The entries are addressed from the ring start: in C++ the empty struct in __DECLARE_FLEX_ARRAY shifts bufs[] by 8 bytes.
+void Uring::RecycleBuffer(const uint16_t bid){
+    struct io_uring_buf* buf = reinterpret_cast<struct io_uring_buf*>(buf_ring) + (buf_ring_tail & (buf_count - 1));
+    buf->addr = reinterpret_cast<uint64_t>(buffers + (size_t) bid * buf_size);
+    buf->len  = buf_size;
+    buf->bid  = bid;
+    buf_ring_tail++;
+    __atomic_store_n(&buf_ring->tail, buf_ring_tail, __ATOMIC_RELEASE);
+}
+
+bool Uring::isValid() const noexcept {
+    return ring_fd >= 0;
+}
+
+bool Uring::isSqPoll() const noexcept {
+    return sqpoll;
+}
+
+uint64_t Uring::GetSqeFull() noexcept {
+    return sqe_full.load(memory_order_relaxed);
+}
+
+bool Uring::Probe(const bool sqpoll){
+    Uring ring(8, sqpoll);
+    if (!ring.isValid() || !ring.SetupBufferRing(8, 64)) return false;
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv) < 0) return false;
+
+    bool res = false;
+    ring.PrepRecvMultishot(sv[0], 1);
+    if (ring.Submit() >= 0 && write(sv[1], "ping", 4) == 4){
+        for(int attempt=0; attempt<10 && !res; attempt++){
+            if (ring.SubmitAndWait(1, 100) < 0) break;
+            bool failed = false;
+            ring.ForEachCompletion([&](uint64_t user_data, int32_t cqe_res, uint32_t cqe_flags){
+                if (user_data != 1) return;
+                if (cqe_res == 4 && (cqe_flags & IORING_CQE_F_BUFFER) && (cqe_flags & IORING_CQE_F_MORE)
+                    && memcmp(ring.GetBuffer((uint16_t) (cqe_flags >> IORING_CQE_BUFFER_SHIFT)), "ping", 4) == 0) res = true;
+                else failed = true;
+            });
+            if (failed) break;
+        }
+    }
+
+    ring.PrepCancel(1, 2);
+    ring.Submit();
+    close(sv[0]);
+    close(sv[1]);
+    return res;
+}
@@ -0,0 +1,185 @@
+//Variable byte integer microbenchmark: the byte loop the codec used before against the word decoder,
+//and the parsers built on it (fixed header of a frame, a property block). Build in Release:
+//  cmake -DCMAKE_BUILD_TYPE=Release .. && make varint_bench && ./test/varint_bench
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "mqtt_protocol.h"
+#include "mqtt_view.h"
+#include "frame_decoder.h"
+
+using namespace mqtt_protocol;
+using namespace std;
+
+#define BENCH_VALUES    (1 << 16)
+#define BENCH_ROUNDS    200
+
+static volatile uint32_t sink;
+
+static uint8_t LoopDecode(const uint8_t *buf, uint32_t &value, uint8_t &size){
+    uint32_t multiplayer = 1;
+    value = 0;
+    uint8_t offset = 0;
+    while(true){
+        const uint8_t single_byte = buf[offset];
+        value += (single_byte & 0x7F) * multiplayer;
+        if (multiplayer > 128 * 128 * 128) return mqtt_err::var_int_err;
+        multiplayer *= 128;
+        offset++;
+        if ((single_byte & 0x80) == 0) break;
+    }
+    size = offset;
+    return mqtt_err::ok;
+}
+
+static uint8_t LoopSize(uint32_t value){
+    if (value == 0) return 1;
+    uint8_t count = 0;
+    while(value > 0){
+        count++;
+        value /= 0x80;
+    }
+    return count;
+}
+
+static void LoopEncode(uint8_t *buf, uint32_t value, uint8_t &size){
+    uint8_t offset = 0;
+    while(true){
+        uint8_t single_byte = value % 0x80;
+        value /= 0x80;
+        if (value > 0) single_byte |= 0x80;
+        buf[offset++] = single_byte;
+        if (value == 0) break;
+    }
+    size = offset;
+}
+
+template <class F>
+static double Measure(const char* name, const size_t ops, F&& f){
+    const auto start = chrono::steady_clock::now();
+    for(int round = 0; round < BENCH_ROUNDS; round++) f();
+    const double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / (double(ops) * BENCH_ROUNDS);
+    printf("%-34s %7.2f ns/op\n", name, ns);
+    return ns;
+}
+
+int main(){
+    //remaining lengths and property lengths are mostly one or two bytes
+    mt19937 rng(42);
+    vector<uint32_t> values(BENCH_VALUES);
+    for(auto& it : values){
+        const uint32_t pick = rng() % 100;
+        it = pick < 60 ? rng() % 128 : pick < 90 ? rng() % 16384 : pick < 98 ? rng() % 2097152 : rng() % 268435456;
+    }
+    vector<uint8_t> encoded(values.size() * 4 + 4);
+    vector<uint32_t> offsets;
+    size_t len = 0;
+    for(auto it : values){
+        uint8_t size;
+        offsets.push_back(len);
+        CodeVarInt(encoded.data() + len, it, size);
+        len += size;
+    }
+
+    const double loop_decode = Measure("decode, byte loop", values.size(), [&]{
+        uint32_t acc = 0, value;
+        uint8_t size;
+        for(size_t pos = 0; pos < len; pos += size){
+            if (LoopDecode(encoded.data() + pos, value, size) != mqtt_err::ok) break;
+            acc += value;
+        }
+        sink = acc;
+    });
+    const double word_decode = Measure("decode, word", values.size(), [&]{
+        uint32_t acc = 0, value;
+        uint8_t size;
+        for(size_t pos = 0; pos < len; pos += size){
+            if (DecodeVarInt(encoded.data() + pos, len - pos, value, size) != mqtt_err::ok) break;
+            acc += value;
+        }
+        sink = acc;
+    });
+    //independent integers, as the lengths of different packets
+    const double loop_decode_each = Measure("decode each, byte loop", values.size(), [&]{
+        uint32_t acc = 0, value;
+        uint8_t size;
+        for(auto pos : offsets){
+            if (LoopDecode(encoded.data() + pos, value, size) != mqtt_err::ok) break;
+            acc += value;
+        }
+        sink = acc;
+    });
+    const double word_decode_each = Measure("decode each, word", values.size(), [&]{
+        uint32_t acc = 0, value;
+        uint8_t size;
+        for(auto pos : offsets){
+            if (DecodeVarInt(encoded.data() + pos, len - pos, value, size) != mqtt_err::ok) break;
+            acc += value;
+        }
+        sink = acc;
+    });
+    const double loop_size = Measure("size, division loop", values.size(), [&]{
+        uint32_t acc = 0;
+        for(auto it : values) acc += LoopSize(it);
+        sink = acc;
+    });
+    const double clz_size = Measure("size, clz", values.size(), [&]{
+        uint32_t acc = 0;
+        for(auto it : values) acc += GetVarIntSize(it);
+        sink = acc;
+    });
+    uint8_t out[8];
+    const double loop_encode = Measure("encode, division loop", values.size(), [&]{
+        uint32_t acc = 0;
+        uint8_t size;
+        for(auto it : values){
+            LoopEncode(out, it, size);
+            acc += out[0] + size;
+        }
+        sink = acc;
+    });
+    const double shift_encode = Measure("encode, shifts", values.size(), [&]{
+        uint32_t acc = 0;
+        uint8_t size;
+        for(auto it : values){
+            CodeVarInt(out, it, size);
+            acc += out[0] + size;
+        }
+        sink = acc;
+    });
+
+    //fixed headers: a stream of small QoS 0 PUBLISH frames through the frame decoder
+    const uint8_t frame[] = {0x30, 7, 0, 3, 'a', '/', 'b', 'h', 'i'};
+    const size_t frames = 4096;
+    vector<uint8_t> stream;
+    for(size_t i = 0; i < frames; i++) stream.insert(stream.end(), frame, frame + sizeof(frame));
+    FrameDecoder decoder;
+    FixedHeader fh;
+    shared_ptr<uint8_t> payload;
+    const double header = Measure("frame header + copy", frames, [&]{
+        decoder.Append(stream.data(), stream.size());
+        uint32_t acc = 0;
+        while (decoder.Next(fh, payload) == decoder_status::ok) acc += fh.remaining_len;
+        sink = acc;
+    });
+
+    //a PUBLISH property block: message expiry, content type, subscription identifier, two user properties
+    const uint8_t properties[] = {36, 0x02, 0, 0, 0, 60, 0x03, 0, 4, 'j', 's', 'o', 'n', 0x0B, 0x81, 0x01,
+                                  0x26, 0, 2, 'k', '1', 0, 2, 'v', '1', 0x26, 0, 2, 'k', '2', 0, 2, 'v', '2', 0x23, 0, 1};
+    const size_t blocks = 4096;
+    const double property_block = Measure("PUBLISH property block", blocks, [&]{
+        uint32_t acc = 0, size;
+        for(size_t i = 0; i < blocks; i++){
+            PropertiesView view;
+            if (view.Read(properties, sizeof(properties), size, mqtt_pack_type::PUBLISH) != mqtt_err::ok) break;
+            acc += view.Count() + size;
+        }
+        sink = acc;
+    });
+
+    printf("\ndecode x%.2f (in a row) x%.2f (each), size x%.2f, encode x%.2f; frame header %.1f ns, property block %.1f ns\n",
+           loop_decode / word_decode, loop_decode_each / word_decode_each, loop_size / clz_size, loop_encode / shift_encode, header, property_block);
+    return 0;
+}
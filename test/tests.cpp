@@ -7,6 +7,12 @@
 #include "mqtt_broker.h"
 #include "mqtt_protocol.h"
 #include "command.h"
+#include "frame_decoder.h"
+#include "timer_wheel.h"
+#include "topic_trie.h"
+#include "subscriber_cache.h"
+#include "epoch.h"
+#include "mqtt_view.h"
 
 using namespace std;
 using namespace mqtt_protocol;
@@ -50,6 +56,28 @@ TEST(BasicTests, Test_2){
     EXPECT_EQ(val4, val5);
 }
 
+TEST(BasicTests, Test_3){
+    //every size boundary round trips, decoded both with and without the end of the buffer
+    for(uint32_t val : {0u, 127u, 128u, 16383u, 16384u, 2097151u, 2097152u, 268435455u}){
+        uint8_t buf[4];
+        uint8_t size, decoded_size;
+        uint32_t decoded;
+        CodeVarInt(buf, val, size);
+        EXPECT_EQ(size, GetVarIntSize(val));
+        ASSERT_EQ(DecodeVarInt(buf, size, decoded, decoded_size), mqtt_err::ok);
+        EXPECT_EQ(decoded, val);
+        EXPECT_EQ(decoded_size, size);
+        EXPECT_EQ(DecodeVarInt(buf, size - 1, decoded, decoded_size), mqtt_err::read_err);
+        ASSERT_EQ(DeCodeVarInt(buf, decoded, decoded_size), mqtt_err::ok);
+        EXPECT_EQ(decoded, val);
+    }
+    const uint8_t too_long[] = {0xFF, 0xFF, 0xFF, 0xFF, 0x01};
+    uint32_t value;
+    uint8_t size;
+    EXPECT_EQ(DecodeVarInt(too_long, sizeof(too_long), value, size), mqtt_err::var_int_err);
+    EXPECT_EQ(DeCodeVarInt(too_long, value, size), mqtt_err::var_int_err);
+}
+
 TEST(MqttEntity, Test_1){
     uint16_t var = 0xFFFA;
     auto *entity = new MqttTwoByteEntity((uint8_t *) &var);
@@ -166,7 +194,7 @@ TEST(MqttEntity, Test_7){
 TEST(MqttProperties, Test_1){
     uint16_t var = 0xFFFA;
 
-    auto *prop = new MqttProperty(1, shared_ptr<MqttEntity>(new MqttTwoByteEntity((uint8_t *) &var)));
+    auto *prop = new MqttProperty(1, MqttTwoByteEntity((uint8_t *) &var));
     EXPECT_EQ(prop->GetId(), 1);
     EXPECT_EQ(prop->Size(), 2);
     EXPECT_EQ(prop->GetType(), mqtt_data_type::two_byte);
@@ -175,9 +203,29 @@ TEST(MqttProperties, Test_1){
     delete prop;
 }
 
+TEST(MqttProperties, Test_7){
+    static_assert(!std::is_polymorphic_v<MqttTwoByteEntity> && !std::is_polymorphic_v<MqttProperty>);
+    static_assert(sizeof(MqttTwoByteEntity) == sizeof(uint16_t));
+
+    MqttProperty num(topic_alias, MqttTwoByteEntity((uint16_t) 0x1234));
+    MqttProperty str(content_type, MqttStringEntity(string("abc")));
+    EXPECT_EQ(num.GetString(), "");
+    EXPECT_EQ(str.GetUint(), 0);
+    EXPECT_EQ(str.GetPair(), nullptr);
+    EXPECT_EQ(str.GetString(), "abc");
+
+    uint8_t buf[16];
+    uint32_t offset = 0;
+    num.Serialize(buf, offset);
+    str.Serialize(buf + offset, offset);
+    const uint8_t expected[] = {topic_alias, 0x12, 0x34, content_type, 0, 3, 'a', 'b', 'c'};
+    EXPECT_EQ(offset, 9);
+    EXPECT_EQ(memcmp(buf, expected, sizeof(expected)), 0);
+}
+
 TEST(MqttProperties, Test_2){
     uint32_t var = 0xAB136501;
-    auto *prop = new MqttProperty(2, shared_ptr<MqttEntity>(new MqttFourByteEntity((uint8_t *) &var)));
+    auto *prop = new MqttProperty(2, MqttFourByteEntity((uint8_t *) &var));
 
     EXPECT_EQ(prop->GetId(), 2);
     EXPECT_EQ(prop->Size(), 4);
@@ -189,7 +237,7 @@ TEST(MqttProperties, Test_2){
 
 TEST(MqttProperties, Test_3){
     char str[] = "test_var";
-    auto *prop = new MqttProperty(2, shared_ptr<MqttEntity>(new MqttStringEntity(strlen(str), (uint8_t *) str)));
+    auto *prop = new MqttProperty(2, MqttStringEntity(strlen(str), (uint8_t *) str));
     EXPECT_EQ(prop->GetId(), 2);
     EXPECT_EQ(prop->Size(), 2 + strlen(str));
     EXPECT_EQ(prop->GetType(), mqtt_data_type::mqtt_string);
@@ -202,9 +250,9 @@ TEST(MqttProperties, Test_4){
     char p_str_1[] = "test_var_1";
     char p_str_2[] = "test_var_2";
 
-    auto *prop = new MqttProperty(2, shared_ptr<MqttEntity>(new MqttStringPairEntity(
+    auto *prop = new MqttProperty(2, MqttStringPairEntity(
             MqttStringEntity(strlen(p_str_1), (uint8_t *) p_str_1),
-            MqttStringEntity(strlen(p_str_2), (uint8_t *) p_str_2))));
+            MqttStringEntity(strlen(p_str_2), (uint8_t *) p_str_2)));
 
     EXPECT_EQ(prop->GetId(), 2);
     EXPECT_EQ(prop->Size(), 2 + strlen(p_str_1) + 2 + strlen(p_str_2));
@@ -221,7 +269,7 @@ TEST(MqttProperties, Test_4){
 
 TEST(MqttProperties, Test_5){
     uint8_t buf[1000];
-    auto *prop = new MqttProperty(11, shared_ptr<MqttEntity>(new MqttBinaryDataEntity(sizeof(buf), buf)));
+    auto *prop = new MqttProperty(11, MqttBinaryDataEntity(sizeof(buf), buf));
 
     EXPECT_EQ(prop->GetId(), 11);
     EXPECT_EQ(prop->Size(), 2 + sizeof(buf));
@@ -233,7 +281,7 @@ TEST(MqttProperties, Test_5){
 TEST(MqttProperties, Test_6){
     uint8_t var = 0xFA;
 
-    auto *prop = new MqttProperty(1, shared_ptr<MqttEntity>(new MqttByteEntity(&var)));
+    auto *prop = new MqttProperty(1, MqttByteEntity(&var));
     EXPECT_EQ(prop->GetId(), 1);
     EXPECT_EQ(prop->Size(), sizeof(var));
     EXPECT_EQ(prop->GetType(), mqtt_data_type::byte);
@@ -246,8 +294,8 @@ TEST(MqttPropertiesChain, Test_1){
     uint16_t var = 0xFFFA;
     auto p_chain = new MqttPropertyChain;
 
-    p_chain->AddProperty(make_shared<MqttProperty>(response_information, shared_ptr<MqttEntity>(new MqttTwoByteEntity((uint8_t *) &var))));
-    p_chain->AddProperty(make_shared<MqttProperty>(3, shared_ptr<MqttEntity>(new MqttTwoByteEntity((uint8_t *) &var))));
+    p_chain->AddProperty(MqttProperty(response_information, MqttTwoByteEntity((uint8_t *) &var)));
+    p_chain->AddProperty(MqttProperty(3, MqttTwoByteEntity((uint8_t *) &var)));
 
     EXPECT_EQ(p_chain->GetProperty(response_information)->GetId(), response_information);
     EXPECT_EQ(p_chain->GetProperty(response_information)->GetType(), mqtt_data_type::two_byte);
@@ -268,13 +316,13 @@ TEST(MqttPropertiesChain, Test_2){
 
     auto p_chain = new MqttPropertyChain;
 
-    p_chain->AddProperty(make_shared<MqttProperty>(1, shared_ptr<MqttEntity>(new MqttByteEntity(&var))));
-    p_chain->AddProperty(make_shared<MqttProperty>(2, shared_ptr<MqttEntity>(new MqttTwoByteEntity((uint8_t *) &var_2))));
-    p_chain->AddProperty(make_shared<MqttProperty>(3, shared_ptr<MqttEntity>(new MqttFourByteEntity((uint8_t *) &var_3))));
-    p_chain->AddProperty(make_shared<MqttProperty>(4, shared_ptr<MqttEntity>(new MqttStringEntity(strlen(str), (uint8_t *) str))));
-    p_chain->AddProperty(make_shared<MqttProperty>(5, shared_ptr<MqttEntity>(new MqttStringPairEntity(MqttStringEntity(strlen(p_str_1), (uint8_t *) p_str_1),
-                                                                                                      MqttStringEntity(strlen(p_str_2), (uint8_t *) p_str_2)))));
-    p_chain->AddProperty(make_shared<MqttProperty>(6, shared_ptr<MqttEntity>(new MqttBinaryDataEntity(sizeof(buf), buf))));
+    p_chain->AddProperty(MqttProperty(1, MqttByteEntity(&var)));
+    p_chain->AddProperty(MqttProperty(2, MqttTwoByteEntity((uint8_t *) &var_2)));
+    p_chain->AddProperty(MqttProperty(3, MqttFourByteEntity((uint8_t *) &var_3)));
+    p_chain->AddProperty(MqttProperty(4, MqttStringEntity(strlen(str), (uint8_t *) str)));
+    p_chain->AddProperty(MqttProperty(5, MqttStringPairEntity(MqttStringEntity(strlen(p_str_1), (uint8_t *) p_str_1),
+                                                                                                      MqttStringEntity(strlen(p_str_2), (uint8_t *) p_str_2))));
+    p_chain->AddProperty(MqttProperty(6, MqttBinaryDataEntity(sizeof(buf), buf)));
 
     EXPECT_EQ(p_chain->GetProperty(1)->GetId(), 1);
     EXPECT_EQ(p_chain->GetProperty(1)->GetType(), mqtt_data_type::byte);
@@ -328,14 +376,14 @@ TEST(MqttPropertiesChain, Test_3){
     memcpy(buf, &val, sizeof(val));
 
     auto p_chain = new MqttPropertyChain;
-    p_chain->AddProperty(make_shared<MqttProperty>(1, shared_ptr<MqttEntity>(new MqttByteEntity(&var))));
-    p_chain->AddProperty(make_shared<MqttProperty>(2, shared_ptr<MqttEntity>(new MqttTwoByteEntity((uint8_t *) &var_2))));
-    p_chain->AddProperty(make_shared<MqttProperty>(3, shared_ptr<MqttEntity>(new MqttFourByteEntity((uint8_t *) &var_3))));
-    p_chain->AddProperty(make_shared<MqttProperty>(4, shared_ptr<MqttEntity>(new MqttStringEntity(strlen(str), (uint8_t *) str))));
-    p_chain->AddProperty(make_shared<MqttProperty>(5, shared_ptr<MqttEntity>(new MqttStringPairEntity(MqttStringEntity(strlen(p_str_1), (uint8_t *) p_str_1),
-                                                                                                      MqttStringEntity(strlen(p_str_2), (uint8_t *) p_str_2)))));
-    p_chain->AddProperty(make_shared<MqttProperty>(6, shared_ptr<MqttEntity>(new MqttBinaryDataEntity(sizeof(buf), buf))));
-    p_chain->AddProperty(make_shared<MqttProperty>(7, shared_ptr<MqttEntity>(new MqttVIntEntity(buf))));
+    p_chain->AddProperty(MqttProperty(1, MqttByteEntity(&var)));
+    p_chain->AddProperty(MqttProperty(2, MqttTwoByteEntity((uint8_t *) &var_2)));
+    p_chain->AddProperty(MqttProperty(3, MqttFourByteEntity((uint8_t *) &var_3)));
+    p_chain->AddProperty(MqttProperty(4, MqttStringEntity(strlen(str), (uint8_t *) str)));
+    p_chain->AddProperty(MqttProperty(5, MqttStringPairEntity(MqttStringEntity(strlen(p_str_1), (uint8_t *) p_str_1),
+                                                                                                      MqttStringEntity(strlen(p_str_2), (uint8_t *) p_str_2))));
+    p_chain->AddProperty(MqttProperty(6, MqttBinaryDataEntity(sizeof(buf), buf)));
+    p_chain->AddProperty(MqttProperty(7, MqttVIntEntity(buf)));
 
     EXPECT_EQ(p_chain->GetSize(), 64);
     delete p_chain;
@@ -347,8 +395,8 @@ TEST(MqttPropertiesChain, Test_4){
 
     {
         MqttPropertyChain p_chain;
-        p_chain.AddProperty(make_shared<MqttProperty>(server_keep_alive, shared_ptr<MqttEntity>(new MqttTwoByteEntity((uint8_t *) &var))));
-        p_chain.AddProperty(make_shared<MqttProperty>(receive_maximum, shared_ptr<MqttEntity>(new MqttTwoByteEntity((uint8_t *) &var))));
+        p_chain.AddProperty(MqttProperty(server_keep_alive, MqttTwoByteEntity((uint8_t *) &var)));
+        p_chain.AddProperty(MqttProperty(receive_maximum, MqttTwoByteEntity((uint8_t *) &var)));
 
         EXPECT_EQ(p_chain.GetProperty(server_keep_alive)->GetId(), server_keep_alive);
         EXPECT_EQ(p_chain.GetProperty(server_keep_alive)->GetType(), mqtt_data_type::two_byte);
@@ -366,15 +414,49 @@ TEST(MqttPropertiesChain, Test_4){
     EXPECT_EQ(p_chain2[server_keep_alive]->GetUint(), 0xFFFA);
 }
 
+TEST(MqttPropertiesChain, Test_5){
+    //repeated user properties survive a round trip in their order, past the inline capacity
+    MqttPropertyChain p_chain;
+    p_chain.AddProperty(MqttProperty(user_property, MqttStringPairEntity(string("a"), string("1"))));
+    p_chain.AddProperty(MqttProperty(topic_alias, MqttTwoByteEntity((uint16_t) 5)));
+    for(int i=2; i<PROPERTY_CHAIN_INLINE + 3; i++){
+        p_chain.AddProperty(MqttProperty(user_property, MqttStringPairEntity(string("a"), to_string(i))));
+    }
+    EXPECT_EQ(p_chain.Count(), PROPERTY_CHAIN_INLINE + 3);
+    EXPECT_EQ(p_chain.GetProperty(reason_string), nullptr);
+    EXPECT_EQ(p_chain.GetProperty(topic_alias)->GetUint(), 5);
+    EXPECT_EQ(p_chain.GetProperty(user_property)->GetStringPair().second, "1");
+
+    uint8_t buf[256];
+    uint32_t offset = 0;
+    p_chain.Serialize(buf, offset);
+    EXPECT_EQ(offset, GetVarIntSize(p_chain.GetSize()) + p_chain.GetSize());
+
+    MqttPropertyChain copy;
+    uint32_t size = 0;
+    ASSERT_EQ(copy.Create(buf, size), mqtt_err::ok);
+    EXPECT_EQ(size, offset);
+    EXPECT_EQ(copy.GetSize(), p_chain.GetSize());
+    vector<string> values;
+    copy.ForEach(user_property, [&](const MqttProperty& property){ values.push_back(property.GetStringPair().second); });
+    vector<string> expected{"1"};
+    for(int i=2; i<PROPERTY_CHAIN_INLINE + 3; i++) expected.push_back(to_string(i));
+    EXPECT_EQ(values, expected);
+
+    MqttPropertyChain moved = std::move(copy);
+    EXPECT_EQ(moved.Count(), p_chain.Count());
+    EXPECT_EQ(moved.GetProperty(topic_alias)->GetUint(), 5);
+}
+
 TEST(MqttGetProperty, Test_1){
     uint8_t buf[2];
-    uint8_t size = 0;
+    uint32_t size = 0;
 
     buf[0] = payload_format_indicator;
     buf[1] = 0xA4;
 
     auto property = CreateProperty(buf, size);
-    EXPECT_NE(property, nullptr);
+    ASSERT_TRUE(property.has_value());
     EXPECT_EQ(property->GetId(), payload_format_indicator);
     EXPECT_EQ(property->GetType(), mqtt_data_type::byte);
     EXPECT_EQ(memcmp(property->GetData(), &buf[1], 1), 0);
@@ -385,7 +467,7 @@ TEST(MqttGetProperty, Test_1){
 
 TEST(MqttGetProperty, Test_2){
     uint8_t buf[3];
-    uint8_t size = 0;
+    uint32_t size = 0;
 
     buf[0] = server_keep_alive;
     buf[1] = 0xA4;
@@ -396,7 +478,7 @@ TEST(MqttGetProperty, Test_2){
     buf_2[1] = buf[1];
 
     auto property = CreateProperty(buf, size);
-    EXPECT_NE(property, nullptr);
+    ASSERT_TRUE(property.has_value());
     EXPECT_EQ(property->GetId(), server_keep_alive);
     EXPECT_EQ(property->GetType(), mqtt_data_type::two_byte);
     EXPECT_EQ(memcmp(property->GetData(), &buf_2[0], 2), 0);
@@ -407,7 +489,7 @@ TEST(MqttGetProperty, Test_2){
 
 TEST(MqttGetProperty, Test_3){
     uint8_t buf[5];
-    uint8_t size = 0;
+    uint32_t size = 0;
 
     buf[0] = message_expiry_interval;
     uint32_t val = 1235122;
@@ -415,7 +497,7 @@ TEST(MqttGetProperty, Test_3){
     memcpy(&buf[1], &val2, 4);
 
     auto property = CreateProperty(buf, size);
-    EXPECT_NE(property, nullptr);
+    ASSERT_TRUE(property.has_value());
     EXPECT_EQ(property->GetId(), message_expiry_interval);
     EXPECT_EQ(property->GetType(), mqtt_data_type::four_byte);
     EXPECT_EQ(memcmp(property->GetData(), &val, sizeof(val)), 0);
@@ -426,7 +508,7 @@ TEST(MqttGetProperty, Test_3){
 
 TEST(MqttGetProperty, Test_4){
     string str = "test_value";
-    uint8_t size = 0;
+    uint32_t size = 0;
     uint8_t buf[3 + str.size()];
     uint16_t len = str.size();
     uint16_t len2 = htons(len);
@@ -435,7 +517,7 @@ TEST(MqttGetProperty, Test_4){
     buf[0] = content_type;
 
     auto property = CreateProperty(buf, size);
-    EXPECT_NE(property, nullptr);
+    ASSERT_TRUE(property.has_value());
     EXPECT_EQ(property->GetId(), content_type);
     EXPECT_EQ(property->GetType(), mqtt_data_type::mqtt_string);
     EXPECT_EQ(strcmp((char *) property->GetData(), str.c_str()), 0);
@@ -445,7 +527,7 @@ TEST(MqttGetProperty, Test_4){
 }
 
 TEST(MqttGetProperty, Test_5){
-    uint8_t size = 0;
+    uint32_t size = 0;
     uint8_t buf[3 + 10];
     uint16_t len = 10;
     uint16_t len2 = htons(len);
@@ -453,7 +535,7 @@ TEST(MqttGetProperty, Test_5){
     buf[0] = correlation_data;
 
     auto property = CreateProperty(buf, size);
-    EXPECT_NE(property, nullptr);
+    ASSERT_TRUE(property.has_value());
     EXPECT_EQ(property->GetId(), correlation_data);
     EXPECT_EQ(property->GetType(), mqtt_data_type::binary_data);
     EXPECT_EQ(memcmp((char *) property->GetData(), &buf[3], 10), 0);
@@ -466,7 +548,7 @@ TEST(MqttGetProperty, Test_6){
     char str[] = "test_value";
     char str_2[] = "test_value2";
 
-    uint8_t size = 0;
+    uint32_t size = 0;
     uint8_t buf[1 + 2 + strlen(str) + 2 + strlen(str_2)];
 
     uint16_t len = strlen(str);
@@ -481,7 +563,7 @@ TEST(MqttGetProperty, Test_6){
     buf[0] = user_property;
 
     auto property = CreateProperty(buf, size);
-    EXPECT_NE(property, nullptr);
+    ASSERT_TRUE(property.has_value());
     EXPECT_EQ(property->GetId(), user_property);
     EXPECT_EQ(property->GetType(), mqtt_data_type::mqtt_string_pair);
     EXPECT_EQ(strcmp((char *) (property->GetPair()->first.GetData()), str), 0);
@@ -515,14 +597,14 @@ TEST(CreateMqttPacket, Test_1){
     uint32_t packet_size = 0;
     MqttPropertyChain p_chain;
 
-    p_chain.AddProperty(make_shared<MqttProperty>(11, shared_ptr<MqttEntity>(new MqttByteEntity(0xFA))));
-    p_chain.AddProperty(make_shared<MqttProperty>(22, shared_ptr<MqttEntity>(new MqttByteEntity(12))));
-    p_chain.AddProperty(make_shared<MqttProperty>(33, shared_ptr<MqttEntity>(new MqttTwoByteEntity(0xAA00))));
-    p_chain.AddProperty(make_shared<MqttProperty>(44, shared_ptr<MqttEntity>(new MqttFourByteEntity(0xAA001100))));
-    p_chain.AddProperty(make_shared<MqttProperty>(55, shared_ptr<MqttEntity>(new MqttStringEntity(string("hello")))));
-    p_chain.AddProperty(make_shared<MqttProperty>(66, shared_ptr<MqttEntity>(new MqttStringPairEntity(MqttStringEntity(string("test")), MqttStringEntity(string("test"))))));
-    p_chain.AddProperty(make_shared<MqttProperty>(77, shared_ptr<MqttEntity>(new MqttBinaryDataEntity(sizeof(buf), buf))));
-    p_chain.AddProperty(make_shared<MqttProperty>(88, shared_ptr<MqttEntity>(new MqttVIntEntity(0x11AA))));
+    p_chain.AddProperty(MqttProperty(11, MqttByteEntity(0xFA)));
+    p_chain.AddProperty(MqttProperty(22, MqttByteEntity(12)));
+    p_chain.AddProperty(MqttProperty(33, MqttTwoByteEntity(0xAA00)));
+    p_chain.AddProperty(MqttProperty(44, MqttFourByteEntity(0xAA001100)));
+    p_chain.AddProperty(MqttProperty(55, MqttStringEntity(string("hello"))));
+    p_chain.AddProperty(MqttProperty(66, MqttStringPairEntity(MqttStringEntity(string("test")), MqttStringEntity(string("test")))));
+    p_chain.AddProperty(MqttProperty(77, MqttBinaryDataEntity(sizeof(buf), buf)));
+    p_chain.AddProperty(MqttProperty(88, MqttVIntEntity(0x11AA)));
 
     VariableHeader vh{shared_ptr<IVariableHeader>(new ConnactVH(11,33, MqttPropertyChain{}))};
 
@@ -530,6 +612,60 @@ TEST(CreateMqttPacket, Test_1){
     EXPECT_GE(packet_size, 0);
 }
 
+TEST(CreateMqttPacket, Test_2){
+    //the pre-encoded acks are the packets the variable headers build
+    for(const uint8_t type : {PUBACK, PUBREC, PUBREL, PUBCOMP}){
+        const uint8_t first = FHBuilder().PacketType(type).Build() | (type == PUBREL ? 1 << 1 : 0);
+        uint8_t ack[ACK_MAX_SIZE];
+        uint32_t size;
+
+        VariableHeader vh5{shared_ptr<IVariableHeader>(new TypicalVH(0x1234, success, MqttPropertyChain()))};
+        auto packet = CreateMqttPacket(first, vh5, size);
+        ASSERT_EQ(EncodeAck(ack, type, MQTT_VERSION_5, 0x1234), size);
+        EXPECT_EQ(memcmp(ack, packet.get(), size), 0);
+
+        VariableHeader vh3{shared_ptr<IVariableHeader>(new TypicalV3VH(0xBEEF))};
+        packet = CreateMqttPacket(first, vh3, size);
+        ASSERT_EQ(EncodeAck(ack, type, MQTT_VERSION_3, 0xBEEF), size);
+        EXPECT_EQ(memcmp(ack, packet.get(), size), 0);
+    }
+    uint32_t size;
+    auto ping = CreateMqttPacket(FHBuilder().PacketType(PINGRESP).Build(), size);
+    uint8_t ack[ACK_MAX_SIZE];
+    ASSERT_EQ(EncodeAck(ack, PINGRESP, MQTT_VERSION_5, 0), size);
+    EXPECT_EQ(memcmp(ack, ping.get(), size), 0);
+}
+
+TEST(CreateMqttPacket, Test_3){
+    const uint8_t text[] = "payload";
+    auto message = make_shared<MqttBinaryDataEntity>(sizeof(text), text);
+    const string name = "a/b";
+
+    //the shared encoding with a subscriber's packet id is the packet the variable headers build
+    for(const uint8_t version : {MQTT_VERSION_3, MQTT_VERSION_5}){
+        for(uint8_t qos = mqtt_QoS::QoS_0; qos <= mqtt_QoS::QoS_2; qos++){
+            const uint16_t packet_id = qos == mqtt_QoS::QoS_0 ? 0 : 0x0102;
+            VariableHeader vh = version == MQTT_VERSION_5 ? VariableHeader{shared_ptr<IVariableHeader>(new PublishVH(MqttStringEntity(name), packet_id, MqttPropertyChain()))}
+                                                          : VariableHeader{shared_ptr<IVariableHeader>(new PublishV3VH(MqttStringEntity(name), packet_id))};
+            uint32_t expected_size, size;
+            auto expected = CreateMqttPacket(FHBuilder().PacketType(PUBLISH).WithQoS(qos).Build(), vh, message, expected_size);
+
+            auto encoded = EncodePublish(version, qos, name, message, true);
+            EXPECT_EQ(encoded.id_offset == encoded.size, qos == mqtt_QoS::QoS_0);
+            auto packet = CreateMqttPacket(encoded, packet_id, message, size);
+            ASSERT_EQ(size, expected_size);
+            EXPECT_EQ(memcmp(packet.get(), expected.get(), size), 0);
+
+            //without the payload, it is appended from the message
+            encoded = EncodePublish(version, qos, name, message, false);
+            EXPECT_EQ(encoded.size, expected_size - sizeof(text));
+            packet = CreateMqttPacket(encoded, packet_id, message, size);
+            ASSERT_EQ(size, expected_size);
+            EXPECT_EQ(memcmp(packet.get(), expected.get(), size), 0);
+        }
+    }
+}
+
 TEST(VariableHeaders, Test_1){
     VariableHeader vh{shared_ptr<IVariableHeader>(new ConnactVH(1,2, MqttPropertyChain()))};
     EXPECT_EQ(vh.GetSize(), 3);
@@ -561,4 +697,592 @@ TEST(MqttTopic, Test_1){
     EXPECT_EQ(topic_3 == "test", true);
     EXPECT_EQ(topic_2.GetSize(), topic_3.GetSize());
     EXPECT_EQ(memcmp(topic_3.GetData(), topic_2.GetData(), 4), 0);
-}
\ No newline at end of file
+}
+
+TEST(FrameDecoder, Test_1){
+    //PINGREQ, then a PUBLISH split in the middle of its remaining length
+    uint8_t data[] = {0xC0, 0x00, 0x30, 0x80, 0x01};
+    uint8_t payload[128];
+    memset(payload, 0xAB, sizeof(payload));
+
+    FrameDecoder decoder;
+    FixedHeader f_head;
+    shared_ptr<uint8_t> buf;
+
+    decoder.Append(data, 4);
+    EXPECT_EQ(decoder.Next(f_head, buf), decoder_status::ok);
+    EXPECT_EQ(f_head.GetType(), PINGREQ);
+    EXPECT_EQ(f_head.remaining_len, 0);
+    EXPECT_EQ(decoder.Next(f_head, buf), decoder_status::need_more);
+
+    decoder.Append(data + 4, 1);
+    decoder.Append(payload, 100);
+    EXPECT_EQ(decoder.Next(f_head, buf), decoder_status::need_more);
+    decoder.Append(payload + 100, 28);
+    EXPECT_EQ(decoder.Next(f_head, buf), decoder_status::ok);
+    EXPECT_EQ(f_head.GetType(), PUBLISH);
+    EXPECT_EQ(f_head.remaining_len, 128);
+    EXPECT_EQ(memcmp(buf.get(), payload, sizeof(payload)), 0);
+    EXPECT_EQ(decoder.Pending(), 0);
+
+    uint8_t malformed[] = {0x30, 0xFF, 0xFF, 0xFF, 0xFF, 0x01};
+    decoder.Append(malformed, sizeof(malformed));
+    EXPECT_EQ(decoder.Next(f_head, buf), decoder_status::malformed);
+}
+
+TEST(FrameDecoder, Test_2){
+    int sv[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+
+    FrameDecoder decoder;
+    FixedHeader f_head;
+    shared_ptr<uint8_t> buf;
+    EXPECT_EQ(decoder.ReadFrom(sv[0], true), decoder_status::would_block);
+
+    uint8_t data[] = {0xC0, 0x00, 0xC0, 0x00, 0xE0};
+    EXPECT_EQ(write(sv[1], data, sizeof(data)), sizeof(data));
+    EXPECT_EQ(decoder.ReadFrom(sv[0], false), decoder_status::ok);
+    EXPECT_EQ(decoder.Next(f_head, buf), decoder_status::ok);
+    EXPECT_EQ(decoder.Next(f_head, buf), decoder_status::ok);
+    EXPECT_EQ(decoder.Next(f_head, buf), decoder_status::need_more);
+    EXPECT_EQ(decoder.Pending(), 1);
+
+    close(sv[1]);
+    EXPECT_EQ(decoder.ReadFrom(sv[0], true), decoder_status::closed);
+    close(sv[0]);
+}
+
+TEST(OutboundQueue, Test_1){
+    QueueLimitTable table;
+    table.SetGlobal(QueueLimits{100, 3, overflow_policy::drop_oldest_qos0});
+    table.AddPrefix("a/", QueueLimits{0, 1, overflow_policy::drop_newest});
+    table.AddPrefix("a/b/", QueueLimits{0, 2, overflow_policy::disconnect});
+    EXPECT_EQ(table.Find("a/b/c").policy, overflow_policy::disconnect);
+    EXPECT_EQ(table.Find("a/c").policy, overflow_policy::drop_newest);
+    EXPECT_EQ(table.Find("b").max_bytes, 100);
+
+    int sv[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    OutboundQueue queue(sv[0], 0);
+    shared_ptr<uint8_t> data(new uint8_t[40], default_delete<uint8_t[]>());
+    size_t evicted;
+
+    //QoS 0 packets make room for the new one, QoS 1 packets are kept
+    EXPECT_EQ(queue.Push(data, 40, table.Find("b"), true, evicted), push_status::scheduled);
+    EXPECT_EQ(queue.Push(data, 40, table.Find("b"), false, evicted), push_status::queued);
+    EXPECT_EQ(queue.Push(data, 40, table.Find("b"), true, evicted), push_status::queued);
+    EXPECT_EQ(evicted, 1);
+    EXPECT_EQ(queue.Push(data, 40, table.Find("a/c"), true, evicted), push_status::dropped);
+    EXPECT_EQ(queue.Push(data, 40, table.Find("a/b/c"), true, evicted), push_status::overflow);
+    auto depth = queue.GetDepth();
+    EXPECT_EQ(depth.bytes, 80);
+    EXPECT_EQ(depth.messages, 2);
+    EXPECT_EQ(depth.dropped, 2);
+
+    //control packets are not limited
+    EXPECT_EQ(queue.Push(data, 40), false);
+    EXPECT_EQ(queue.GetDepth().messages, 3);
+
+    bool wake;
+    EXPECT_EQ(queue.Abort(data, 10, wake), true);
+    EXPECT_EQ(queue.Abort(data, 10, wake), false);
+    EXPECT_EQ(queue.GetDepth().bytes, 10);
+    EXPECT_EQ(queue.Push(data, 40), false);
+    {
+        lock_guard guard{queue.mtx};
+        EXPECT_EQ(queue.WriteV(OUTBOUND_FLUSH_LIMIT), outbound_status::drained);
+    }
+    uint8_t buf[64];
+    EXPECT_EQ(read(sv[1], buf, sizeof(buf)), 10);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+TEST(OutboundQueue, Test_2){
+    int srv = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_GE(srv, 0);
+    struct sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    ASSERT_EQ(bind(srv, (struct sockaddr*) &addr, addr_len), 0);
+    ASSERT_EQ(listen(srv, 1), 0);
+    ASSERT_EQ(getsockname(srv, (struct sockaddr*) &addr, &addr_len), 0);
+    int cli = socket(AF_INET, SOCK_STREAM, 0);
+    ASSERT_EQ(connect(cli, (struct sockaddr*) &addr, addr_len), 0);
+    int peer = accept(srv, nullptr, nullptr);
+    ASSERT_GE(peer, 0);
+
+    ZerocopyStats stats;
+    OutboundQueue queue(cli, 0);
+    if (!queue.EnableZerocopy(&stats)) GTEST_SKIP() << "SO_ZEROCOPY is not supported";
+    shared_ptr<uint8_t> head(new uint8_t[5], default_delete<uint8_t[]>());
+    shared_ptr<uint8_t> payload(new uint8_t[1000], default_delete<uint8_t[]>());
+    size_t evicted;
+
+    //head and payload are one message and are evicted together
+    const QueueLimits limits{0, 2, overflow_policy::drop_oldest_qos0};
+    EXPECT_EQ(queue.Push(head, 5, limits, true, evicted, payload, 1000), push_status::scheduled);
+    EXPECT_EQ(queue.Push(head, 5, limits, true, evicted, payload, 1000), push_status::queued);
+    EXPECT_EQ(queue.Push(head, 5, limits, true, evicted, payload, 1000), push_status::queued);
+    EXPECT_EQ(evicted, 1);
+    EXPECT_EQ(queue.GetDepth().messages, 2);
+    EXPECT_EQ(queue.GetDepth().bytes, 2010);
+    {
+        lock_guard guard{queue.mtx};
+        EXPECT_EQ(queue.WriteV(OUTBOUND_FLUSH_LIMIT), outbound_status::drained);
+        EXPECT_EQ(queue.isPinned(), true);
+    }
+    EXPECT_EQ(stats.sent.load(), 2010);
+
+    uint8_t buf[4096];
+    size_t received = 0;
+    while (received < 2010){
+        auto ret = read(peer, buf, sizeof(buf));
+        ASSERT_GT(ret, 0);
+        received += ret;
+    }
+    EXPECT_EQ(received, 2010);
+
+    //the buffers are released when the kernel reports the completion
+    bool pinned = true;
+    for(int i=0; i<100 && pinned; i++){
+        queue.Reap();
+        {
+            lock_guard guard{queue.mtx};
+            pinned = queue.isPinned();
+        }
+        if (pinned) this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    EXPECT_EQ(pinned, false);
+    EXPECT_EQ(stats.avoided.load() + stats.copied.load(), 2010);
+    close(peer);
+    close(cli);
+    close(srv);
+}
+
+TEST(OutboundQueue, Test_3){
+    int sv[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    OutboundQueue queue(sv[0], 0);
+    shared_ptr<uint8_t> data(new uint8_t[3]{7, 8, 9}, default_delete<uint8_t[]>());
+
+    //acks are copied into the descriptors and sent in order with the buffered packets
+    uint8_t ack[ACK_MAX_SIZE];
+    const uint8_t ack_size = EncodeAck(ack, PUBACK, MQTT_VERSION_3, 0x0102);
+    EXPECT_EQ(queue.Push(ack, ack_size), true);
+    EXPECT_EQ(queue.Push(data, 3), false);
+    ack[3] = 0x03;
+    EXPECT_EQ(queue.Push(ack, ack_size), false);
+    EXPECT_EQ(queue.GetDepth().messages, 3);
+    EXPECT_EQ(queue.GetDepth().bytes, 11);
+    {
+        lock_guard guard{queue.mtx};
+        EXPECT_EQ(queue.WriteV(OUTBOUND_FLUSH_LIMIT), outbound_status::drained);
+    }
+    uint8_t buf[64];
+    ASSERT_EQ(read(sv[1], buf, sizeof(buf)), 11);
+    const uint8_t expected[] = {0x40, 2, 1, 2, 7, 8, 9, 0x40, 2, 1, 3};
+    EXPECT_EQ(memcmp(buf, expected, sizeof(expected)), 0);
+
+    //a packet in pieces is limited and sent as one
+    const uint16_t packet_id = htons(0x0A0B);
+    OutboundPiece pieces[] = {{data, nullptr, 1}, {nullptr, reinterpret_cast<const uint8_t*>(&packet_id), 2}, {shared_ptr<uint8_t>(data, data.get() + 1), nullptr, 2}};
+    const QueueLimits limits{0, 1, overflow_policy::drop_oldest_qos0};
+    size_t evicted;
+    EXPECT_EQ(queue.Push(data, 3, limits, true, evicted), push_status::queued);
+    EXPECT_EQ(queue.Push(pieces, 3, limits, true, evicted), push_status::queued);
+    EXPECT_EQ(evicted, 1);
+    EXPECT_EQ(queue.GetDepth().bytes, 5);
+    {
+        lock_guard guard{queue.mtx};
+        EXPECT_EQ(queue.WriteV(OUTBOUND_FLUSH_LIMIT), outbound_status::drained);
+    }
+    const uint8_t expected_pieces[] = {7, 0x0A, 0x0B, 8, 9};
+    ASSERT_EQ(read(sv[1], buf, sizeof(buf)), 5);
+    EXPECT_EQ(memcmp(buf, expected_pieces, sizeof(expected_pieces)), 0);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+struct MpscItem : public MpscNode {
+    int producer;
+    int value;
+};
+
+TEST(MpscQueue, Test_1){
+    MpscQueue<MpscItem> queue;
+    EXPECT_EQ(queue.Empty(), true);
+    EXPECT_EQ(queue.Pop(), nullptr);
+
+    const int producers = 4, count = 10000;
+    vector<unique_ptr<MpscItem[]>> items;
+    for(int p=0; p<producers; p++) items.push_back(make_unique<MpscItem[]>(count));
+    vector<thread> threads;
+    for(int p=0; p<producers; p++){
+        threads.emplace_back([&items, &queue, p](){
+            for(int i=0; i<count; i++){
+                items[p][i].producer = p;
+                items[p][i].value = i;
+                queue.Push(&items[p][i]);
+            }
+        });
+    }
+    //every producer's items come out in its push order
+    vector<int> next(producers, 0);
+    int popped = 0;
+    while (popped < producers * count){
+        auto item = queue.Pop();
+        if (item == nullptr) continue;
+        EXPECT_EQ(item->value, next[item->producer]++);
+        popped++;
+    }
+    for(auto& it : threads) it.join();
+    EXPECT_EQ(queue.Empty(), true);
+
+    //a node may be pushed again once popped
+    queue.Push(&items[0][0]);
+    EXPECT_EQ(queue.Pop(), &items[0][0]);
+    queue.Push(&items[0][0]);
+    EXPECT_EQ(queue.Pop(), &items[0][0]);
+    EXPECT_EQ(queue.Pop(), nullptr);
+}
+
+TEST(SendPool, Test_1){
+    //descriptors released on another thread come back to the owner's pool
+    vector<SendDescriptor*> descs;
+    for(int i=0; i<SEND_POOL_CAPACITY; i++) descs.push_back(SendPool::Allocate());
+    EXPECT_NE(descs.front()->pool, nullptr);
+    auto extra = SendPool::Allocate();
+    EXPECT_EQ(extra->pool, nullptr);
+    SendPool::Release(extra);
+
+    thread other([&descs](){
+        for(auto it : descs) SendPool::Release(it);
+    });
+    other.join();
+    for(int i=0; i<SEND_POOL_CAPACITY; i++){
+        auto desc = SendPool::Allocate();
+        EXPECT_NE(desc->pool, nullptr);
+        descs[i] = desc;
+    }
+    for(auto it : descs) SendPool::Release(it);
+}
+
+TEST(TopicTrie, Test_1){
+    EXPECT_TRUE(TopicTrie::isValidFilter("a/+/c"));
+    EXPECT_TRUE(TopicTrie::isValidFilter("#"));
+    EXPECT_TRUE(TopicTrie::isValidFilter("a//b"));
+    EXPECT_FALSE(TopicTrie::isValidFilter(""));
+    EXPECT_FALSE(TopicTrie::isValidFilter("a/#/c"));
+    EXPECT_FALSE(TopicTrie::isValidFilter("a/b#"));
+    EXPECT_FALSE(TopicTrie::isValidFilter("a+/b"));
+
+    EXPECT_TRUE(TopicTrie::Matches("a/#", "a"));
+    EXPECT_TRUE(TopicTrie::Matches("a/+/c", "a/b/c"));
+    EXPECT_TRUE(TopicTrie::Matches("+/+", "/b"));
+    EXPECT_FALSE(TopicTrie::Matches("a/+", "a/b/c"));
+    EXPECT_FALSE(TopicTrie::Matches("#", "$SYS/load"));
+    EXPECT_TRUE(TopicTrie::Matches("$SYS/#", "$SYS/load"));
+
+    TopicTrie trie;
+    EXPECT_TRUE(trie.Subscribe("a/b/c", Subscriber{1, 0, 1, 0}));
+    EXPECT_TRUE(trie.Subscribe("a/+/c", Subscriber{2, 1, 2, 1}));
+    EXPECT_TRUE(trie.Subscribe("a/#", Subscriber{3, 0, 3, 2}));
+    EXPECT_TRUE(trie.Subscribe("#", Subscriber{4, 1, 4, 0}));
+    EXPECT_TRUE(trie.Subscribe("+/b/+", Subscriber{5, 0, 5, 0}));
+    EXPECT_FALSE(trie.Subscribe("a/#", Subscriber{3, 0, 3, 1}));
+    EXPECT_EQ(trie.Size(), 5);
+
+    auto match = [&trie](const string& topic){
+        vector<int> fds;
+        trie.Match(topic, [&fds](const Subscriber& sub){ fds.push_back(sub.fd); });
+        sort(fds.begin(), fds.end());
+        return fds;
+    };
+    EXPECT_EQ(match("a/b/c"), (vector<int>{1, 2, 3, 4, 5}));
+    EXPECT_EQ(match("a/x/c"), (vector<int>{2, 3, 4}));
+    EXPECT_EQ(match("a"), (vector<int>{3, 4}));
+    EXPECT_EQ(match("b/b/b"), (vector<int>{4, 5}));
+    EXPECT_EQ(match("$SYS/b/c"), (vector<int>{}));
+
+    uint8_t options = 0;
+    trie.Match("a", [&options](const Subscriber& sub){ if (sub.fd == 3) options = sub.options; });
+    EXPECT_EQ(options, 1);
+
+    //a reused fd does not remove the subscription of the previous connection
+    EXPECT_FALSE(trie.Unsubscribe("a/+/c", 2, 7));
+    EXPECT_TRUE(trie.Unsubscribe("a/+/c", 2, 2));
+    EXPECT_FALSE(trie.Unsubscribe("a/+/c", 2, 2));
+    EXPECT_TRUE(trie.Unsubscribe("#", 4, 4));
+    EXPECT_EQ(match("a/x/c"), (vector<int>{3}));
+    EXPECT_EQ(trie.Size(), 3);
+}
+
+TEST(TopicTrie, Test_2){
+    EXPECT_TRUE(TopicTrie::isValidFilter("$share/g/a/+"));
+    EXPECT_FALSE(TopicTrie::isValidFilter("$share/g"));
+    EXPECT_FALSE(TopicTrie::isValidFilter("$share//a"));
+    EXPECT_FALSE(TopicTrie::isValidFilter("$share/g+/a"));
+
+    TopicTrie trie;
+    EXPECT_TRUE(trie.Subscribe("$share/g1/a/+", Subscriber{1, 0, 1, 0}));
+    EXPECT_TRUE(trie.Subscribe("$share/g1/a/+", Subscriber{2, 0, 2, 0}));
+    EXPECT_TRUE(trie.Subscribe("$share/g1/a/+", Subscriber{3, 1, 3, 0}));
+    EXPECT_TRUE(trie.Subscribe("$share/g2/a/#", Subscriber{4, 1, 4, 0}));
+    EXPECT_TRUE(trie.Subscribe("a/b", Subscriber{5, 0, 5, 0}));
+
+    vector<const ShareGroup*> groups;
+    size_t plain = 0;
+    auto match = [&](const string& topic){
+        groups.clear();
+        plain = 0;
+        trie.Match(topic, [&plain](const Subscriber&){ plain++; }, [&groups](const ShareGroup& group){ groups.push_back(&group); });
+    };
+    match("a/b");
+    ASSERT_EQ(groups.size(), 2);
+    EXPECT_EQ(plain, 1);
+    const ShareGroup* g1 = groups[0]->members.size() == 3 ? groups[0] : groups[1];
+
+    auto no_load = [](const Subscriber&){ return 0u; };
+    vector<int> rr;
+    for(int i=0; i<6; i++) rr.push_back(g1->Pick(share_strategy::round_robin, 0, no_load).fd);
+    sort(rr.begin(), rr.end());
+    EXPECT_EQ(rr, (vector<int>{1, 1, 2, 2, 3, 3}));
+
+    const int sticky = g1->Pick(share_strategy::sticky_publisher, 12345, no_load).fd;
+    for(int i=0; i<4; i++) EXPECT_EQ(g1->Pick(share_strategy::sticky_publisher, 12345, no_load).fd, sticky);
+    EXPECT_EQ(g1->Pick(share_strategy::hash_topic, 7, no_load).fd, g1->Pick(share_strategy::hash_topic, 7, no_load).fd);
+
+    auto load = [](const Subscriber& sub){ return sub.fd == 2 ? 0u : 10u; };
+    for(int i=0; i<4; i++) EXPECT_EQ(g1->Pick(share_strategy::least_inflight, 0, load).fd, 2);
+
+    //leaving members shrink the group, the last one removes it
+    EXPECT_TRUE(trie.Unsubscribe("$share/g1/a/+", 2, 2));
+    EXPECT_FALSE(trie.Unsubscribe("$share/g2/a/+", 1, 1));
+    EXPECT_EQ(g1->members.size(), 2);
+    EXPECT_TRUE(trie.Unsubscribe("$share/g1/a/+", 1, 1));
+    EXPECT_TRUE(trie.Unsubscribe("$share/g1/a/+", 3, 3));
+    match("a/b");
+    EXPECT_EQ(groups.size(), 1);
+    EXPECT_EQ(trie.Size(), 2);
+}
+
+TEST(TopicNames, Test_1){
+    const size_t size = TopicNames::Size();
+    auto a = TopicNames::Intern("names/a");
+    auto a2 = TopicNames::Intern(string("names/") + "a");
+    auto b = TopicNames::Intern("names/b");
+    EXPECT_EQ(a.get(), a2.get());
+    EXPECT_NE(a->id, b->id);
+    EXPECT_EQ(a->hash, std::hash<string_view>{}("names/a"));
+    EXPECT_EQ(TopicNames::Find("names/b"), b);
+    EXPECT_EQ(TopicNames::Size(), size + 2);
+
+    //the name leaves the table with its last reference
+    b.reset();
+    EXPECT_EQ(TopicNames::Find("names/b"), nullptr);
+    EXPECT_EQ(TopicNames::Size(), size + 1);
+
+    MqttTopic topic(0, 1, "names/a", nullptr);
+    EXPECT_EQ(topic.GetNameID(), a->id);
+    EXPECT_EQ(topic.GetName(), "names/a");
+    EXPECT_EQ(MqttTopic{}.GetNameID(), 0);
+}
+
+TEST(SubscriberCache, Test_1){
+    auto a = TopicNames::Intern("a"), b = TopicNames::Intern("b"), c = TopicNames::Intern("c");
+    SubscriberCache cache(2);
+    EXPECT_EQ(cache.Find(*a, 1), nullptr);
+    cache.Insert(a, 1).subscribers.push_back(Subscriber{1, 0, 1, 0});
+    cache.Insert(b, 1).subscribers.push_back(Subscriber{2, 0, 2, 0});
+    ASSERT_NE(cache.Find(*a, 1), nullptr);
+    EXPECT_EQ(cache.Find(*a, 1)->subscribers.size(), 1);
+    //a newer generation makes the entry stale
+    EXPECT_EQ(cache.Find(*b, 2), nullptr);
+
+    //"b" is the least recently used
+    cache.Insert(c, 1);
+    EXPECT_EQ(cache.Size(), 2);
+    EXPECT_EQ(cache.Find(*b, 1), nullptr);
+    EXPECT_NE(cache.Find(*a, 1), nullptr);
+    EXPECT_NE(cache.Find(*c, 1), nullptr);
+
+    //refreshing an entry clears the old subscribers
+    EXPECT_TRUE(cache.Insert(a, 3).subscribers.empty());
+    EXPECT_NE(cache.Find(*a, 3), nullptr);
+
+    SubscriberCache off(0);
+    off.Insert(a, 1).subscribers.push_back(Subscriber{1, 0, 1, 0});
+    EXPECT_EQ(off.Find(*a, 1), nullptr);
+    EXPECT_EQ(off.Size(), 0);
+}
+
+TEST(Epoch, Test_1){
+    //an object retired while a reader is inside its section outlives the section
+    static atomic<int> freed{0};
+    auto deleter = [](void* p){ delete static_cast<int*>(p); freed++; };
+    atomic<bool> entered{false}, leave{false};
+    thread reader([&entered, &leave](){
+        EpochGuard guard;
+        entered = true;
+        while (!leave) this_thread::yield();
+    });
+    while (!entered) this_thread::yield();
+    Epoch::Retire(new int(1), deleter);
+    for(int i=0; i<4; i++) Epoch::Reclaim();
+    EXPECT_EQ(freed.load(), 0);
+    leave = true;
+    reader.join();
+    for(int i=0; i<4; i++) Epoch::Reclaim();
+    EXPECT_EQ(freed.load(), 1);
+
+    //an exited thread gives its slot back, more threads than slots come and go over the process lifetime
+    for(int i=0; i<EPOCH_MAX_THREADS + 16; i++){
+        thread([](){ EpochGuard guard; }).join();
+    }
+
+    //a snapshot taken before an update keeps seeing the old trie
+    RcuPtr<TopicTrie> subscriptions;
+    subscriptions.Update([](TopicTrie& trie){ return trie.Subscribe("a/+", Subscriber{1, 0, 1, 0}); });
+    EpochGuard guard;
+    const TopicTrie* before = subscriptions.Load();
+    EXPECT_TRUE(subscriptions.Update([](TopicTrie& trie){ return trie.Subscribe("a/b", Subscriber{2, 0, 2, 0}); }));
+    EXPECT_FALSE(subscriptions.Update([](TopicTrie& trie){ return trie.Unsubscribe("a/c", 2, 2); }));
+    const TopicTrie* after = subscriptions.Load();
+    size_t old_count = 0, new_count = 0;
+    before->Match("a/b", [&old_count](const Subscriber&){ old_count++; });
+    after->Match("a/b", [&new_count](const Subscriber&){ new_count++; });
+    EXPECT_EQ(old_count, 1);
+    EXPECT_EQ(new_count, 2);
+    EXPECT_NE(before->Generation(), after->Generation());
+
+    RcuTable<string> table;
+    EXPECT_TRUE(table.Insert(5, "five"));
+    EXPECT_FALSE(table.Insert(5, "again"));
+    EXPECT_TRUE(table.Insert(RCU_TABLE_SEGMENT_SIZE + 1, "far"));
+    EXPECT_FALSE(table.Insert(-1, "negative"));
+    const string* old = table.Find(5);
+    EXPECT_TRUE(table.Replace(5, "FIVE"));
+    EXPECT_EQ(*old, "five");
+    EXPECT_EQ(*table.Find(5), "FIVE");
+    size_t keys = 0;
+    table.ForEach([&keys](int key, const string&){ keys += key; });
+    EXPECT_EQ(keys, 5 + RCU_TABLE_SEGMENT_SIZE + 1);
+    EXPECT_TRUE(table.Erase(5));
+    EXPECT_EQ(table.Find(5), nullptr);
+    EXPECT_EQ(table.Size(), 1);
+}
+
+TEST(MqttView, Test_1){
+    //PUBLISH QoS 1: topic "a/b", packet id 7, message expiry 10, user property k=v, payload "xyz"
+    const uint8_t publish[] = {0, 3, 'a', '/', 'b', 0, 7, 12, 0x02, 0, 0, 0, 10, 0x26, 0, 1, 'k', 0, 1, 'v', 'x', 'y', 'z'};
+    FixedHeader fh(FHBuilder().PacketType(PUBLISH).WithQoS(1).Build());
+    fh.remaining_len = sizeof(publish);
+    PublishView pub;
+    ASSERT_EQ(pub.Read(fh, publish, MQTT_VERSION_5), mqtt_err::ok);
+    EXPECT_EQ(pub.topic, "a/b");
+    EXPECT_EQ(pub.topic.data(), reinterpret_cast<const char*>(publish + 2));
+    EXPECT_EQ(pub.packet_id, 7);
+    EXPECT_EQ(pub.properties.Count(), 2);
+    PropertyView property;
+    ASSERT_TRUE(pub.properties.Find(message_expiry_interval, property));
+    EXPECT_EQ(property.value, 10);
+    ASSERT_TRUE(pub.properties.Find(user_property, property));
+    EXPECT_EQ(property.str, "k");
+    EXPECT_EQ(property.str2, "v");
+    EXPECT_FALSE(pub.properties.Find(topic_alias, property));
+    EXPECT_EQ(pub.payload_offset, 20);
+    EXPECT_EQ(pub.payload_len, 3);
+
+    //truncated packets are rejected instead of being read past the end
+    fh.remaining_len = 4;
+    EXPECT_NE(pub.Read(fh, publish, MQTT_VERSION_5), mqtt_err::ok);
+    fh.remaining_len = 15;
+    EXPECT_NE(pub.Read(fh, publish, MQTT_VERSION_5), mqtt_err::ok);
+
+    //SUBSCRIBE v3.1.1: packet id 1, "a/#" QoS 1, "b" QoS 0
+    const uint8_t subscribe[] = {0, 1, 0, 3, 'a', '/', '#', 1, 0, 1, 'b', 0};
+    FixedHeader sh(FHBuilder().PacketType(SUBSCRIBE).Build());
+    sh.remaining_len = sizeof(subscribe);
+    SubscribeView sub;
+    ASSERT_EQ(sub.Read(sh, subscribe, MQTT_VERSION_3), mqtt_err::ok);
+    vector<pair<string, uint8_t>> filters;
+    sub.ForEach([&filters](string_view filter, uint8_t options){ filters.emplace_back(filter, options); });
+    EXPECT_EQ(filters, (vector<pair<string, uint8_t>>{{"a/#", 1}, {"b", 0}}));
+    sh.remaining_len = sizeof(subscribe) - 1;
+    EXPECT_NE(sub.Read(sh, subscribe, MQTT_VERSION_3), mqtt_err::ok);
+}
+
+TEST(MqttView, Test_2){
+    static_assert(GetPropertyDescriptor(topic_alias).type == mqtt_data_type::two_byte);
+    static_assert(GetPropertyDescriptor(0x7F).type == mqtt_data_type::undefined);
+
+    //PUBLISH QoS 0, topic "t": properties are checked against the packet type
+    FixedHeader fh(FHBuilder().PacketType(PUBLISH).Build());
+    PublishView pub;
+    const uint8_t repeated_users[] = {0, 1, 't', 14, 0x26, 0, 1, 'a', 0, 1, '1', 0x26, 0, 1, 'a', 0, 1, '2'};
+    fh.remaining_len = sizeof(repeated_users);
+    ASSERT_EQ(pub.Read(fh, repeated_users, MQTT_VERSION_5), mqtt_err::ok);
+    EXPECT_EQ(pub.properties.Count(), 2);
+    const uint8_t connack_only[] = {0, 1, 't', 2, 0x24, 1};
+    fh.remaining_len = sizeof(connack_only);
+    EXPECT_EQ(pub.Read(fh, connack_only, MQTT_VERSION_5), mqtt_err::mqtt_property_err);
+    const uint8_t repeated_alias[] = {0, 1, 't', 6, 0x23, 0, 1, 0x23, 0, 2};
+    fh.remaining_len = sizeof(repeated_alias);
+    EXPECT_EQ(pub.Read(fh, repeated_alias, MQTT_VERSION_5), mqtt_err::mqtt_property_err);
+    const uint8_t unknown_id[] = {0, 1, 't', 2, 0x3F, 1};
+    fh.remaining_len = sizeof(unknown_id);
+    EXPECT_EQ(pub.Read(fh, unknown_id, MQTT_VERSION_5), mqtt_err::mqtt_property_err);
+
+    //will delay interval belongs to the will properties, not to CONNECT
+    const uint8_t will_delay[] = {5, 0x18, 0, 0, 0, 30};
+    MqttPropertyChain p_chain;
+    uint32_t size;
+    EXPECT_EQ(p_chain.Create(will_delay, size, mqtt_pack_type::CONNECT), mqtt_err::mqtt_property_err);
+    ASSERT_EQ(p_chain.Create(will_delay, size, PROPERTIES_OF_WILL), mqtt_err::ok);
+    EXPECT_EQ(size, sizeof(will_delay));
+    EXPECT_EQ(p_chain.GetProperty(will_delay_interval)->GetUint(), 30);
+
+    //a property running past its block is rejected
+    const uint8_t truncated[] = {3, 0x03, 0, 5, 'a', 'b'};
+    EXPECT_EQ(p_chain.Create(truncated, size), mqtt_err::mqtt_property_err);
+}
+
+TEST(TimerWheel, Test_1){
+    TimerWheel<int> wheel;
+    vector<int> fired;
+    auto handler = [&fired](int& val){ fired.push_back(val); };
+
+    const time_t start = 1000000;
+    wheel.Advance(start, handler);
+    wheel.Add(start + 1, 1);
+    wheel.Add(start + 70, 70);
+    wheel.Add(start + 5000, 5000);
+    wheel.Add(start - 10, 0);
+    EXPECT_EQ(wheel.Size(), 4);
+
+    EXPECT_EQ(wheel.Advance(start + 1, handler), 2);
+    //an overdue timer fires on the next tick, in insertion order
+    EXPECT_EQ(fired, (vector<int>{1, 0}));
+    EXPECT_EQ(wheel.Advance(start + 69, handler), 0);
+    EXPECT_EQ(wheel.Advance(start + 70, handler), 1);
+    EXPECT_EQ(wheel.Advance(start + 4999, handler), 0);
+    EXPECT_EQ(wheel.Advance(start + 6000, handler), 1);
+    EXPECT_EQ(fired, (vector<int>{1, 0, 70, 5000}));
+    EXPECT_EQ(wheel.Size(), 0);
+
+    //a handler may re-arm its timer
+    wheel.Add(start + 6001, 1);
+    int rounds = 0;
+    wheel.Advance(start + 6010, [&](int& val){ if (++rounds < 3) wheel.Add(start + 6001 + rounds * 2, val); });
+    EXPECT_EQ(rounds, 3);
+
+    //a deadline past the wheel span does not fire before it is due
+    const time_t far = start + 6010 + (time_t(1) << 24) + 100;
+    wheel.Add(far, 7);
+    EXPECT_EQ(wheel.Advance(far - 1, handler), 0);
+    EXPECT_EQ(wheel.Size(), 1);
+    EXPECT_EQ(wheel.Advance(far, handler), 1);
+    EXPECT_EQ(fired.back(), 7);
+}